@@ -1,1305 +1,5313 @@
-#include "fs.h"
-
-#include <string.h>
-#include <time.h>
-
-#define FS_CHECK_ERROR(x)       do { int error = x; if (error != FS_OK) return error; } while(0)
-
-#define FS_SECTOR_POS(x)        ((x) * FS_SECTOR_SIZE)
-
-#define FS_STATES_IN_SECTOR     (FS_SECTOR_SIZE / sizeof(uint32_t))
-#define FS_NODES_IN_CLUSTER     (FS_SECTOR_SIZE / sizeof(_fs_node_t))
-#define FS_REFERENCES_IN_CLUSTER (FS_SECTOR_SIZE / sizeof(_fs_reference_t))
-
-#define FS_CLUSTER_EMPTY        0x00000000
-#define FS_CLUSTER_EOF          0xFFFFFFFE
-#define FS_CLUSTER_INVALID      0xFFFFFFFF
-#define FS_CLUSTER_NODE_BEGIN   0xFFFFFF00
-#define FS_CLUSTER_NODE_FULL    (FS_CLUSTER_NODE_BEGIN + FS_NODES_IN_CLUSTER)
-
-#define FS_NODE_TYPE_FILE       1
-#define FS_NODE_TYPE_DIR        2
-
-#define FS_FIND_FILE            1
-#define FS_FIND_DIR             2
-#define FS_FIND_NOT_EXISTS      3
-
-#define FS_NODE_FLAGS_INUSE     (1 << 0)
-
-typedef struct
-{
-    uint8_t     flags;
-    uint8_t     type;
-    uint16_t    links_count;
-    uint32_t    size;
-    uint32_t    cluster_index;
-    uint32_t    modification_time;
-} _fs_node_t;
-
-typedef struct
-{
-    uint32_t    sectors_count;
-    uint32_t    root_node;
-    uint32_t    table_sector_start;
-    uint32_t    table_sectors_count;
-    uint32_t    clusters_sector_start;
-    uint32_t    clusters_count;
-} _fs_bootstrap_sector_t;
-
-typedef struct
-{
-    uint32_t    state[FS_STATES_IN_SECTOR];
-} _fs_table_sector_t;
-
-typedef struct
-{
-    _fs_node_t  nodes[FS_NODES_IN_CLUSTER];
-} _fs_node_cluster_t;
-
-typedef struct
-{
-    char        name[FS_NAME_MAX_LENGTH + 1];
-    uint32_t    node;
-} _fs_reference_t;
-
-typedef struct
-{
-    _fs_reference_t ref[FS_REFERENCES_IN_CLUSTER];
-} _fs_dir_cluster_t;
-
-static int _fs_find_free_cluster(fs_t* fs, uint32_t* result);
-static int _fs_create_node(fs_t* fs, uint32_t* result_node_number);
-static int _fs_create_dir(fs_t* fs, uint32_t node, uint32_t parent_node, uint32_t* result_cluster);
-static int _fs_dir_find_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint8_t* result_code, uint32_t* result_node);
-static int _fs_dir_add_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t entry_node);
-static int _fs_dir_remove_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t* removed_entry_node);
-static int _fs_find_node(fs_t* fs, const char* path, uint32_t* result_node, uint8_t* result_code);
-static int _fs_free_node(fs_t* fs, uint32_t node);
-static int _fs_recursive_remove(fs_t* fs, uint32_t node);
-
-static uint32_t _fs_cluster_to_sector(fs_t* fs, uint32_t cluster);
-static size_t _fs_cluster_state_pos(fs_t* fs, uint32_t cluster);
-static size_t _fs_node_pos(fs_t* fs, uint32_t node_number);
-static int _fs_split_path(const char* path, char* dirpath, char* filename);
-
-static int _fs_write_state(fs_t* fs, uint32_t cluster, uint32_t new_state);
-static int _fs_write_node(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data);
-static int _fs_write_cluster_buffer(fs_t* fs, uint32_t cluster); // uses fs->buffer
-static int _fs_write_sector_buffer(fs_t* fs, size_t sector_index); // uses fs->buffer
-static int _fs_write_disk_buffer(fs_t* fs, size_t position, size_t size); // uses fs->buffer
-static int _fs_write_disk(fs_t* fs, const void* buffer, size_t position, size_t size);
-
-static int _fs_read_state(fs_t* fs, uint32_t cluster, uint32_t* result_state);
-static int _fs_read_node(fs_t* fs, uint32_t node_number, _fs_node_t* node_data);
-static int _fs_read_cluster_buffer(fs_t* fs, uint32_t cluster); // uses fs->buffer
-static int _fs_read_sector_buffer(fs_t* fs, size_t sector_index); // uses fs->buffer
-static int _fs_read_disk_buffer(fs_t* fs, size_t position, size_t size); // uses fs->buffer
-static int _fs_read_disk(fs_t* fs, void* buffer, size_t position, size_t size);
-
-int fs_create(const fs_disk_operations_t* operations, size_t size, fs_t* result_fs)
-{   
-    result_fs->operations = *operations;
-    
-    FS_CHECK_ERROR(result_fs->operations.init(&result_fs->state));
-    
-    result_fs->sectors_count = size / FS_SECTOR_SIZE;
-    
-    memset(result_fs->buffer, 0, FS_SECTOR_SIZE);
-    for (uint32_t i = 0; i < result_fs->sectors_count; i++)
-    {
-        FS_CHECK_ERROR(_fs_write_sector_buffer(result_fs, i));
-    }
-    
-    size_t remaining = size % FS_SECTOR_SIZE;
-    if (remaining != 0)
-    {
-        FS_CHECK_ERROR(_fs_write_disk_buffer(result_fs, FS_SECTOR_POS(result_fs->sectors_count), remaining));
-    }
-    
-    size_t table_size = result_fs->sectors_count * sizeof(uint32_t);
-    result_fs->table_sector_start = 1;
-    result_fs->table_sectors_count = table_size / FS_SECTOR_SIZE;
-    if (table_size % FS_SECTOR_SIZE != 0) result_fs->table_sectors_count++;
-    result_fs->clusters_sector_start = result_fs->table_sector_start + result_fs->table_sectors_count;
-    result_fs->clusters_count = result_fs->sectors_count - result_fs->table_sectors_count - 1;
-    
-    FS_CHECK_ERROR(_fs_create_node(result_fs, &result_fs->root_node));
-    
-    _fs_node_t root_node_data;
-    FS_CHECK_ERROR(_fs_read_node(result_fs, result_fs->root_node, &root_node_data));
-    root_node_data.type = FS_NODE_TYPE_DIR;
-    root_node_data.links_count = 2;
-    root_node_data.size = FS_SECTOR_SIZE;
-    root_node_data.modification_time = (uint32_t)time(NULL);
-    
-    FS_CHECK_ERROR(_fs_create_dir(result_fs, result_fs->root_node, result_fs->root_node, &root_node_data.cluster_index));  
-    
-    FS_CHECK_ERROR(_fs_write_node(result_fs, result_fs->root_node, &root_node_data));
-    
-    _fs_bootstrap_sector_t* bootstrap = (_fs_bootstrap_sector_t*)result_fs->buffer;
-    bootstrap->sectors_count = result_fs->sectors_count;
-    bootstrap->root_node = result_fs->root_node;
-    bootstrap->table_sector_start = result_fs->table_sector_start;
-    bootstrap->table_sectors_count = result_fs->table_sectors_count;
-    bootstrap->clusters_sector_start = result_fs->clusters_sector_start;
-    bootstrap->clusters_count = result_fs->clusters_count;
-    
-    FS_CHECK_ERROR(_fs_write_disk_buffer(result_fs, 0, sizeof(_fs_bootstrap_sector_t)));
-    
-    return FS_OK;
-}
-
-int fs_open(const fs_disk_operations_t* operations, fs_t* result_fs)
-{
-    result_fs->operations = *operations;
-    
-    FS_CHECK_ERROR(result_fs->operations.init(&result_fs->state));
-    
-    FS_CHECK_ERROR(_fs_read_sector_buffer(result_fs, 0));
-    
-    _fs_bootstrap_sector_t* bootstrap = (_fs_bootstrap_sector_t*)result_fs->buffer;
-    result_fs->sectors_count = bootstrap->sectors_count;
-    result_fs->root_node = bootstrap->root_node;
-    result_fs->table_sector_start = bootstrap->table_sector_start;
-    result_fs->table_sectors_count = bootstrap->table_sectors_count;
-    result_fs->clusters_sector_start = bootstrap->clusters_sector_start;
-    result_fs->clusters_count = bootstrap->clusters_count;
-    
-    return FS_OK;
-}
-
-int fs_close(fs_t* fs)
-{
-    FS_CHECK_ERROR(fs->operations.close(fs->state));
-    
-    return FS_OK;
-}
-
-int fs_mkdir(fs_t* fs, const char* path)
-{
-    if (path[0] != '/') return FS_WRONG_PATH;
-    
-    uint32_t node = fs->root_node;
-    
-    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
-    
-    char pathBuffer[FS_PATH_MAX_LENGTH + 1];
-    strcpy(pathBuffer, path);
-    char* name = strtok(pathBuffer, "/");
-    while (name != NULL)
-    {
-        if (strlen(name) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
-        
-        uint8_t find_status;
-        uint32_t find_node;
-        FS_CHECK_ERROR(_fs_dir_find_entry(fs, node, name, &find_status, &find_node));
-        if (find_status == FS_FIND_FILE) return FS_NOT_A_DIRECTORY;
-        else if (find_status == FS_FIND_NOT_EXISTS)
-        {
-            uint32_t new_node;
-            FS_CHECK_ERROR(_fs_create_node(fs, &new_node));
-            
-            _fs_node_t new_node_data;
-            FS_CHECK_ERROR(_fs_read_node(fs, new_node, &new_node_data));
-            new_node_data.type = FS_NODE_TYPE_DIR;
-            new_node_data.links_count = 2;
-            new_node_data.modification_time = (uint32_t)time(NULL);
-            new_node_data.size = FS_SECTOR_SIZE;
-            
-            FS_CHECK_ERROR(_fs_create_dir(fs, new_node, node, &new_node_data.cluster_index));
-            
-            FS_CHECK_ERROR(_fs_write_node(fs, new_node, &new_node_data));
-            
-            FS_CHECK_ERROR(_fs_dir_add_entry(fs, node, name, new_node));
-            
-            _fs_node_t node_data;
-            FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-            node_data.links_count++;
-            FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
-            
-            node = new_node;
-        }
-        else if (find_status == FS_FIND_DIR)
-        {
-            node = find_node;
-        }
-        
-        name = strtok(NULL, "/");
-    }
-    
-    return FS_OK;
-}
-
-int fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result)
-{
-    uint32_t node;
-    uint8_t status;
-    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
-    if (status != FS_FIND_DIR)
-    {
-        switch (status)
-        {
-            case FS_FIND_FILE: return FS_NOT_A_DIRECTORY;
-            case FS_FIND_NOT_EXISTS: return FS_NOT_EXISTS;
-        }
-    }
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    
-    *result = 0;
-    uint32_t current_cluster = node_data.cluster_index;
-    do
-    {
-        FS_CHECK_ERROR(_fs_read_cluster_buffer(fs, current_cluster));
-    
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (dir->ref[i].name[0] != 0) (*result)++;
-        }
-        
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    }
-    while (current_cluster != FS_CLUSTER_EOF);
-    
-    return FS_OK;
-}
-
-int fs_size(fs_t* fs, uint32_t node, uint32_t* files_size)
-{
-    *files_size = 0;
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    
-    if (node_data.type == FS_NODE_TYPE_FILE)
-    {
-        *files_size = node_data.size;
-    }
-    else if (node_data.type == FS_NODE_TYPE_DIR)
-    {
-        _fs_dir_cluster_t dir;
-    
-        uint32_t current_cluster = node_data.cluster_index;
-        do
-        {
-            size_t disk_pos = FS_SECTOR_POS(_fs_cluster_to_sector(fs, current_cluster));
-            FS_CHECK_ERROR(_fs_read_disk(fs, &dir, disk_pos, FS_SECTOR_SIZE));
-    
-            for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-            {
-                if (dir.ref[i].name[0] != 0)
-                {
-                    if (strcmp(dir.ref[i].name, ".") != 0 && strcmp(dir.ref[i].name, "..") != 0)
-                    {
-                        uint32_t size;
-                        FS_CHECK_ERROR(fs_size(fs, dir.ref[i].node, &size));
-                        *files_size += size;
-                    }
-                }
-            }
-        
-            FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-        }
-        while (current_cluster != FS_CLUSTER_EOF);
-    }
-    
-    return FS_OK;
-}
-
-int fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results)
-{
-    uint32_t node;
-    uint8_t status;
-    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
-    if (status != FS_FIND_DIR)
-    {
-        switch (status)
-        {
-            case FS_FIND_FILE: return FS_NOT_A_DIRECTORY;
-            case FS_FIND_NOT_EXISTS: return FS_NOT_EXISTS;
-        }
-    }
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    
-    *count = 0;
-    uint32_t current_cluster = node_data.cluster_index;
-    do
-    {
-        FS_CHECK_ERROR(_fs_read_cluster_buffer(fs, current_cluster));
-    
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (dir->ref[i].name[0] != 0)
-            {
-                if (*count >= max_results) return FS_BUFFER_TOO_SMALL;
-                
-                strcpy(results[*count].name, dir->ref[i].name);
-                results[*count].node = dir->ref[i].node;
-                
-                _fs_node_t entry_node_data;
-                FS_CHECK_ERROR(_fs_read_node(fs, dir->ref[i].node, &entry_node_data));
-                
-                results[*count].node_type = entry_node_data.type == FS_NODE_TYPE_FILE ? FS_FILE : FS_DIR;
-                results[*count].node_links_count = entry_node_data.links_count;
-                results[*count].node_modification_time = entry_node_data.modification_time;
-                
-                (*count)++;
-            }
-        }
-        
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    }
-    while (current_cluster != FS_CLUSTER_EOF);
-    
-    return FS_OK;
-}
-
-int fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result)
-{
-    char dirpath[256];
-    FS_CHECK_ERROR(_fs_split_path(path, dirpath, result->name));
-    
-    uint32_t node;
-    uint8_t status; 
-    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
-    if (status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS; 
-    result->node = node;   
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));  
-    result->node_type = node_data.type == FS_NODE_TYPE_DIR ? FS_DIR : FS_FILE;
-    result->node_links_count = node_data.links_count;
-    result->node_modification_time = node_data.modification_time;
-    
-    return FS_OK;
-}
-
-int fs_link(fs_t* fs, const char* path, uint32_t node)
-{
-    char dirpath[256];
-    char filename[FS_NAME_MAX_LENGTH + 1];
-    
-    uint32_t target_node;
-    uint8_t target_code;
-    FS_CHECK_ERROR(_fs_find_node(fs, path, &target_node, &target_code));
-    if (target_code != FS_FIND_NOT_EXISTS) return FS_ALREADY_EXISTS;
-        
-    FS_CHECK_ERROR(_fs_split_path(path, dirpath, filename));
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    if (node_data.type != FS_NODE_TYPE_FILE) return FS_NOT_A_FILE;
-    node_data.links_count++;
-    FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
-    
-    uint32_t dir_node;
-    uint8_t dir_result;
-    FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_result));
-    
-    FS_CHECK_ERROR(_fs_dir_add_entry(fs, dir_node, filename, node));
-    
-    return FS_OK;
-}
-
-int fs_remove(fs_t* fs, const char* path)
-{
-    if (strcmp(path, "/") == 0) return FS_WRONG_PATH;
-    
-    char dirpath[256];
-    char name[FS_NAME_MAX_LENGTH + 1];
-    FS_CHECK_ERROR(_fs_split_path(path, dirpath, name));
-    
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return FS_WRONG_PATH;
-    
-    uint32_t dir_node;
-    uint8_t dir_status;
-    FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_status));
-    if (dir_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
-    
-    uint32_t removed_node;
-    FS_CHECK_ERROR(_fs_dir_remove_entry(fs, dir_node, name, &removed_node));
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, removed_node, &node_data));
-    node_data.links_count--;
-    FS_CHECK_ERROR(_fs_write_node(fs, removed_node, &node_data));
-    
-    if (node_data.type == FS_NODE_TYPE_FILE)
-    {
-        if (node_data.links_count == 0)
-        {
-            FS_CHECK_ERROR(_fs_free_node(fs, removed_node));
-        }
-    }
-    else if (node_data.type == FS_NODE_TYPE_DIR)
-    {
-        FS_CHECK_ERROR(_fs_recursive_remove(fs, removed_node));
-    }
-    
-    return FS_OK;
-}
-
-int fs_info(fs_t* fs, fs_info_t* result)
-{
-    result->sectors = fs->sectors_count;
-    result->clusters = fs->clusters_count;
-    result->table_sectors = fs->table_sectors_count;
-    result->free_clusters = 0;
-    result->node_clusters = 0;
-    result->data_clusters = 0;
-    result->nodes = 0;
-    result->files_size = 0;
-    result->dir_structures_size = 0;
-
-    uint32_t current_table_sector_index = 0xFFFFFFFF;
-    _fs_table_sector_t* table_sector = (_fs_table_sector_t*)fs->buffer;
-    
-    for (uint32_t i = 0; i < fs->clusters_count; i++)
-    {
-        uint32_t required_table_sector_index = i / FS_STATES_IN_SECTOR;
-        uint32_t array_index = i % FS_STATES_IN_SECTOR;
-        
-        if (current_table_sector_index != required_table_sector_index)
-        {
-            uint32_t final_table_sector_index = required_table_sector_index + fs->table_sector_start;
-            FS_CHECK_ERROR(_fs_read_sector_buffer(fs, final_table_sector_index));
-            
-            current_table_sector_index = required_table_sector_index;
-        }
-        
-        uint32_t cluster_state = table_sector->state[array_index];
-        if (cluster_state == FS_CLUSTER_EMPTY)
-        {
-            result->free_clusters++;
-        }
-        else if (cluster_state >= FS_CLUSTER_NODE_BEGIN && cluster_state <= FS_CLUSTER_NODE_FULL)
-        {
-            result->node_clusters++;
-            result->nodes += cluster_state & 0xFF;
-            
-            _fs_node_cluster_t nodes;
-            size_t disk_pos = FS_SECTOR_POS(_fs_cluster_to_sector(fs, i));
-            FS_CHECK_ERROR(_fs_read_disk(fs, &nodes, disk_pos, FS_SECTOR_SIZE));
-            
-            for (size_t ni = 0; ni < FS_NODES_IN_CLUSTER; ni++)
-            {
-                _fs_node_t* node = &nodes.nodes[ni];
-                if (!(node->flags & FS_NODE_FLAGS_INUSE)) continue;
-                
-                if (node->type == FS_NODE_TYPE_FILE)
-                {
-                    result->files_size += node->size;
-                }
-                else if (node->type == FS_NODE_TYPE_DIR)
-                {
-                    result->dir_structures_size += node->size;
-                }
-            }
-        }
-        else
-        {
-            result->data_clusters++;
-        }
-    }
-    
-    result->allocated_nodes = result->node_clusters * FS_NODES_IN_CLUSTER;
-    
-    result->nodes_size = result->node_clusters * FS_SECTOR_SIZE;
-    
-    result->used_space = result->files_size + result->dir_structures_size + result->nodes_size;;
-    result->total_size = FS_SECTOR_SIZE * fs->sectors_count;
-    result->usable_space = FS_SECTOR_SIZE * fs->clusters_count;
-    
-    result->free_space = result->usable_space - result->used_space;
-    
-    return FS_OK;
-}
-
-int fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result)
-{
-    size_t len = strlen(path);
-    if (len > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
-    if (*(path + len - 1) == '/') return FS_WRONG_PATH;
-    
-    uint8_t status;
-    FS_CHECK_ERROR(_fs_find_node(fs, path, &result->node, &status));
-    
-    if (status == FS_FIND_DIR) return FS_NOT_A_FILE;
-    else if (status == FS_FIND_NOT_EXISTS)
-    {
-        if (!(flags & FS_CREATE)) return FS_NOT_EXISTS;
-        
-        char dirpath[FS_PATH_MAX_LENGTH + 1];
-        char filename[FS_NAME_MAX_LENGTH + 1];
-        
-        // create file
-        FS_CHECK_ERROR(_fs_split_path(path, dirpath, filename));
-        
-        uint32_t dir_node;
-        uint8_t dir_status;
-        FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_status));
-        
-        // previous _fs_find_node finished successfully so dir_node for sure is a directory
-        
-        FS_CHECK_ERROR(_fs_create_node(fs, &result->node));
-        
-        _fs_node_t node_data;
-        FS_CHECK_ERROR(_fs_read_node(fs, result->node, &node_data));
-        node_data.type = FS_NODE_TYPE_FILE;
-        node_data.links_count = 1;
-        node_data.size = 0;
-        node_data.modification_time = (uint32_t)time(NULL);
-        
-        FS_CHECK_ERROR(_fs_find_free_cluster(fs, &node_data.cluster_index));
-        FS_CHECK_ERROR(_fs_write_state(fs, node_data.cluster_index, FS_CLUSTER_EOF));
-        
-        FS_CHECK_ERROR(_fs_write_node(fs, result->node, &node_data));
-        
-        FS_CHECK_ERROR(_fs_dir_add_entry(fs, dir_node, filename, result->node));
-        
-        result->pos = 0;
-        result->first_cluster = node_data.cluster_index;
-        result->current_cluster = node_data.cluster_index;
-        result->current_cluster_pos = 0;
-        result->size = node_data.size;
-        result->is_opened = 1;
-    }
-    else if (status == FS_FIND_FILE)
-    {
-        // open existing file
-        
-        _fs_node_t node_data;
-        FS_CHECK_ERROR(_fs_read_node(fs, result->node, &node_data));
-        
-        result->pos = 0;
-        result->first_cluster = node_data.cluster_index;
-        result->current_cluster = node_data.cluster_index;
-        result->current_cluster_pos = 0;
-        
-        if (flags & FS_CREATE)
-        {
-            node_data.size = 0;
-            node_data.modification_time = (uint32_t)time(NULL);
-            FS_CHECK_ERROR(_fs_write_node(fs, result->node, &node_data));
-            
-            // free up all clusters except first
-            uint32_t cluster_state;
-            FS_CHECK_ERROR(_fs_read_state(fs, node_data.cluster_index, &cluster_state));
-            while (cluster_state != FS_CLUSTER_EOF)
-            {
-                uint32_t next_cluster;
-                FS_CHECK_ERROR(_fs_read_state(fs, cluster_state, &next_cluster));
-                FS_CHECK_ERROR(_fs_write_state(fs, cluster_state, FS_CLUSTER_EMPTY));
-                cluster_state = next_cluster;
-            }
-            
-            FS_CHECK_ERROR(_fs_write_state(fs, node_data.cluster_index, FS_CLUSTER_EOF));
-        }
-        
-        result->size = node_data.size;
-        result->is_opened = 1;
-        
-        if (flags & FS_APPEND)
-        {
-            FS_CHECK_ERROR(fs_file_seek(fs, result, FS_SEEK_END, 0));
-        }
-    }
-    
-    return FS_OK;
-}
-
-int fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written)
-{
-    *written = 0;
-    
-    if (!file->is_opened) return FS_FILE_CLOSED;
-    
-    const uint8_t* byte_buffer = (const uint8_t*)buffer;
-    
-    while (size)
-    {
-        uint32_t remaining_in_cluster = FS_SECTOR_SIZE - file->current_cluster_pos;
-        if (size < remaining_in_cluster) remaining_in_cluster = size;
-        
-        if (remaining_in_cluster > 0)
-        {
-            size_t disk_pos = FS_SECTOR_POS(_fs_cluster_to_sector(fs, file->current_cluster));
-            disk_pos += file->current_cluster_pos;
-    
-            FS_CHECK_ERROR(_fs_write_disk(fs, byte_buffer, disk_pos, remaining_in_cluster));
-    
-            size -= remaining_in_cluster;
-            file->current_cluster_pos += remaining_in_cluster;
-            file->pos += remaining_in_cluster;
-            byte_buffer += remaining_in_cluster;
-            *written += remaining_in_cluster;
-        }
-
-        if (size)
-        {
-            // obtain new cluster if there are remaining bytes to write
-            
-            uint32_t cluster_state;
-            FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
-            
-            if (cluster_state == FS_CLUSTER_EOF)
-            {
-                // allocate new cluster
-                uint32_t new_cluster;
-                FS_CHECK_ERROR(_fs_find_free_cluster(fs, &new_cluster));
-                
-                FS_CHECK_ERROR(_fs_write_state(fs, new_cluster, FS_CLUSTER_EOF));
-                FS_CHECK_ERROR(_fs_write_state(fs, file->current_cluster, new_cluster));
-                
-                file->current_cluster = new_cluster;
-                file->current_cluster_pos = 0;
-            }
-            else
-            {
-                // switch to next cluster
-                file->current_cluster = cluster_state;
-                file->current_cluster_pos = 0;
-            }
-        }
-    }
-    
-    if (file->pos > file->size) file->size = file->pos;
-    
-    return FS_OK;
-}
-
-int fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read)
-{
-    *read = 0;
-    
-    if (!file->is_opened) return FS_FILE_CLOSED;
-    
-    if (file->pos >= file->size) return FS_EOF;
-    
-    if (file->pos + size > file->size) size = file->size - file->pos;
-    
-    uint8_t* byte_buffer = (uint8_t*)buffer;
-    
-    while (size)
-    {
-        uint32_t remaining_in_cluster = FS_SECTOR_SIZE - file->current_cluster_pos;
-        if (size < remaining_in_cluster) remaining_in_cluster = size;
-        
-        if (remaining_in_cluster > 0)
-        {
-            size_t disk_pos = FS_SECTOR_POS(_fs_cluster_to_sector(fs, file->current_cluster));
-            disk_pos += file->current_cluster_pos;
-            
-            FS_CHECK_ERROR(_fs_read_disk(fs, byte_buffer, disk_pos, remaining_in_cluster));
-            
-            size -= remaining_in_cluster;
-            file->current_cluster_pos += remaining_in_cluster;
-            file->pos += remaining_in_cluster;
-            byte_buffer += remaining_in_cluster;
-            *read += remaining_in_cluster;
-        }
-        
-        if (file->pos > file->size) return FS_EOF;
-        
-        if (size)
-        {
-            // obtain new cluster if there are remaining bytes to read
-            
-            uint32_t cluster_state;
-            FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
-            
-            if (cluster_state == FS_CLUSTER_EOF) return FS_EOF;
-            
-            // switch to next cluster
-            file->current_cluster = cluster_state;
-            file->current_cluster_pos = 0;
-        }
-    }
-    
-    return FS_OK;
-}
-
-int fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos)
-{
-    if (!file->is_opened) return FS_FILE_CLOSED;
-    
-    switch (mode)
-    {
-        case FS_SEEK_CURRENT: pos = file->pos + pos; break;
-        case FS_SEEK_END: pos = file->size - pos; break;
-    }
-    
-    if (pos < 0) return FS_EOF;
-    if (pos > file->size) return FS_EOF;
-    
-    uint32_t clusters_to_skip = pos / FS_SECTOR_SIZE;
-    uint32_t current_cluster = file->first_cluster;
-    while (clusters_to_skip)
-    {
-        uint32_t next_cluster;
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &next_cluster));
-        if (next_cluster == FS_CLUSTER_EOF) return FS_EOF;
-        
-        current_cluster = next_cluster;
-        
-        clusters_to_skip--;
-    }
-    
-    file->current_cluster = current_cluster;
-    file->current_cluster_pos = pos % FS_SECTOR_SIZE;
-    file->pos = pos;
-    
-    return FS_OK;
-}
-
-int fs_file_discard(fs_t* fs, fs_file_t* file)
-{
-    if (!file->is_opened) return FS_FILE_CLOSED;
-    
-    file->size = file->pos;
-    
-    // free up all following current
-    uint32_t cluster_state;
-    FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
-    while (cluster_state != FS_CLUSTER_EOF)
-    {
-        uint32_t next_cluster;
-        FS_CHECK_ERROR(_fs_read_state(fs, cluster_state, &next_cluster));
-        FS_CHECK_ERROR(_fs_write_state(fs, cluster_state, FS_CLUSTER_EMPTY));
-        cluster_state = next_cluster;
-    }
-            
-    FS_CHECK_ERROR(_fs_write_state(fs, file->current_cluster, FS_CLUSTER_EOF));
-    
-    return FS_OK;
-}
-
-int fs_file_close(fs_t* fs, fs_file_t* file)
-{
-    if (!file->is_opened) return FS_FILE_CLOSED;
-    
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, file->node, &node_data));
-    
-    node_data.size = file->size;
-    node_data.modification_time = (uint32_t)time(NULL);
-    
-    FS_CHECK_ERROR(_fs_write_node(fs, file->node, &node_data));
-    
-    file->is_opened = 0;
-    
-    return FS_OK;
-}
-
-
-static int _fs_find_free_cluster(fs_t* fs, uint32_t* result)
-{
-    uint32_t current_table_sector_index = 0xFFFFFFFF;
-    _fs_table_sector_t* table_sector = (_fs_table_sector_t*)fs->buffer;
-    
-    for (uint32_t i = 0; i < fs->clusters_count; i++)
-    {
-        uint32_t required_table_sector_index = i / FS_STATES_IN_SECTOR;
-        uint32_t array_index = i % FS_STATES_IN_SECTOR;
-        
-        if (current_table_sector_index != required_table_sector_index)
-        {
-            uint32_t final_table_sector_index = required_table_sector_index + fs->table_sector_start;
-            FS_CHECK_ERROR(_fs_read_sector_buffer(fs, final_table_sector_index));
-            
-            current_table_sector_index = required_table_sector_index;
-        }
-        
-        uint32_t cluster_state = table_sector->state[array_index];
-        if (cluster_state == FS_CLUSTER_EMPTY)
-        {
-            *result = i;
-            return FS_OK;
-        }
-    }
-    
-    return FS_FULL;
-}
-
-static int _fs_create_node(fs_t* fs, uint32_t* result_node_number)
-{
-    // search for existing sector with free nodes  
-    uint32_t first_empty_cluster_index =  FS_CLUSTER_INVALID;
-    uint32_t node_cluster_index = FS_CLUSTER_INVALID;
-    uint32_t current_table_sector_index = 0xFFFFFFFF;
-    _fs_table_sector_t* table_sector = (_fs_table_sector_t*)fs->buffer;
-    
-    for (uint32_t i = 0; i < fs->clusters_count; i++)
-    {
-        uint32_t required_table_sector_index = i / FS_STATES_IN_SECTOR;
-        uint32_t array_index = i % FS_STATES_IN_SECTOR;
-        
-        if (current_table_sector_index != required_table_sector_index)
-        {
-            uint32_t final_table_sector_index = required_table_sector_index + fs->table_sector_start;
-            FS_CHECK_ERROR(_fs_read_sector_buffer(fs, final_table_sector_index));
-            
-            current_table_sector_index = required_table_sector_index;
-        }
-        
-        uint32_t cluster_state = table_sector->state[array_index];
-        if (cluster_state == FS_CLUSTER_EMPTY)
-        {
-            if (first_empty_cluster_index == FS_CLUSTER_INVALID) first_empty_cluster_index = i;
-        }
-        else if (cluster_state >= FS_CLUSTER_NODE_BEGIN && cluster_state < FS_CLUSTER_NODE_FULL)
-        {
-            // found node sector with free place
-            node_cluster_index = i;
-            
-            cluster_state++;
-            FS_CHECK_ERROR(_fs_write_state(fs, node_cluster_index, cluster_state));
-            
-            break;
-        }
-    }
-    
-    _fs_node_cluster_t* node_cluster = (_fs_node_cluster_t*)fs->buffer;
-    if (node_cluster_index != FS_CLUSTER_INVALID)
-    {
-        // find free place for node in cluster
-        uint32_t node_sector_index = _fs_cluster_to_sector(fs, node_cluster_index);
-        FS_CHECK_ERROR(_fs_read_sector_buffer(fs, node_sector_index));
-    
-        for (uint8_t i = 0; i < FS_NODES_IN_CLUSTER; i++)
-        {
-            if (!(node_cluster->nodes[i].flags & FS_NODE_FLAGS_INUSE))
-            {
-                // found free place
-                _fs_node_t node;
-                memset(&node, 0, sizeof(_fs_node_t));
-                node.flags |= FS_NODE_FLAGS_INUSE;
-                
-                *result_node_number = (node_cluster_index << 8) | i;
-                
-                FS_CHECK_ERROR(_fs_write_node(fs, *result_node_number, &node));
-                
-                return FS_OK;
-            }
-        }
-    }
-    else if (first_empty_cluster_index != FS_CLUSTER_INVALID)
-    {
-        // no node sector with free places found, start new cluster
-        uint32_t sector_index = _fs_cluster_to_sector(fs, first_empty_cluster_index);
-        
-        FS_CHECK_ERROR(_fs_write_state(fs, first_empty_cluster_index, FS_CLUSTER_NODE_BEGIN + 1));
-        
-        memset(fs->buffer, 0, FS_SECTOR_SIZE);
-        node_cluster->nodes[0].flags |= FS_NODE_FLAGS_INUSE;
-        
-        FS_CHECK_ERROR(_fs_write_sector_buffer(fs, sector_index));
-        
-        *result_node_number = first_empty_cluster_index << 8;
-        
-        return FS_OK;
-    }
-    
-    // place for new node not found - file system is full
-    return FS_FULL;
-}
-
-static int _fs_create_dir(fs_t* fs, uint32_t node, uint32_t parent_node, uint32_t* result_cluster)
-{
-    FS_CHECK_ERROR(_fs_find_free_cluster(fs, result_cluster));
-    
-    FS_CHECK_ERROR(_fs_write_state(fs, *result_cluster, FS_CLUSTER_EOF));
-    
-    memset(fs->buffer, 0, FS_SECTOR_SIZE);
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    strcpy(dir->ref[0].name, ".");
-    dir->ref[0].node = node;
-    
-    strcpy(dir->ref[1].name, "..");
-    dir->ref[1].node = parent_node;
-    
-    FS_CHECK_ERROR(_fs_write_cluster_buffer(fs, *result_cluster));
-    
-    return 0;
-}
-
-static int _fs_dir_find_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint8_t* result_code, uint32_t* result_node)
-{
-    _fs_node_t node_data;
-    
-    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    uint32_t current_cluster = node_data.cluster_index;
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    do
-    {
-        FS_CHECK_ERROR(_fs_read_cluster_buffer(fs, current_cluster));
-        
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (strcmp(dir->ref[i].name, entry_name) == 0)
-            {
-                _fs_node_t entry_node_data;
-                FS_CHECK_ERROR(_fs_read_node(fs, dir->ref[i].node, &entry_node_data));
-            
-                switch (entry_node_data.type)
-                {
-                    case FS_NODE_TYPE_FILE: *result_code = FS_FIND_FILE; break;
-                    case FS_NODE_TYPE_DIR: *result_code = FS_FIND_DIR; break;
-                }
-                
-                *result_node = dir->ref[i].node;
-            
-                return FS_OK;
-            }
-        }
-        
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    } while (current_cluster != FS_CLUSTER_EOF);
-    
-    *result_code = FS_FIND_NOT_EXISTS;
-    return FS_OK;
-}
-
-static int _fs_dir_add_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t entry_node)
-{
-    _fs_node_t node_data;
-    
-    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    uint32_t current_cluster = node_data.cluster_index;
-    uint32_t prev_cluster = FS_CLUSTER_INVALID;
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    do
-    {
-        FS_CHECK_ERROR(_fs_read_cluster_buffer(fs, current_cluster));
-        
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (dir->ref[i].name[0] == 0)
-            {
-                // found free entry
-                strcpy(dir->ref[i].name, entry_name);
-                dir->ref[i].node = entry_node;
-                
-                FS_CHECK_ERROR(_fs_write_cluster_buffer(fs, current_cluster));
-                
-                node_data.modification_time = (uint32_t)time(NULL);
-                FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
-                
-                return FS_OK;
-            }
-        }
-        
-        prev_cluster = current_cluster;
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    } while (current_cluster != FS_CLUSTER_EOF);
-    
-    // all entries in directory clusters are occupied
-    // allocate next cluster
-    
-    uint32_t new_cluster;
-    FS_CHECK_ERROR(_fs_find_free_cluster(fs, &new_cluster));
-    
-    node_data.size += FS_SECTOR_SIZE;
-    node_data.modification_time = (uint32_t)time(NULL);
-    FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
-    
-    FS_CHECK_ERROR(_fs_write_state(fs, prev_cluster, new_cluster)); // link to next cluster
-    FS_CHECK_ERROR(_fs_write_state(fs, new_cluster, FS_CLUSTER_EOF));
-    
-    memset(fs->buffer, 0, FS_SECTOR_SIZE);
-    strcpy(dir->ref[0].name, entry_name);
-    dir->ref[0].node = entry_node;
-    
-    FS_CHECK_ERROR(_fs_write_cluster_buffer(fs, new_cluster));
-    
-    return FS_OK;
-}
-
-static int _fs_dir_remove_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t* removed_entry_node)
-{
-    _fs_node_t node_data;
-    
-    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    uint32_t current_cluster = node_data.cluster_index;
-    uint32_t prev_cluster = FS_CLUSTER_INVALID;
-    _fs_dir_cluster_t* dir = (_fs_dir_cluster_t*)fs->buffer;
-    do
-    {
-        FS_CHECK_ERROR(_fs_read_cluster_buffer(fs, current_cluster));
-        
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (strcmp(dir->ref[i].name, entry_name) == 0)
-            {
-                *removed_entry_node = dir->ref[i].node;
-                memset(&dir->ref[i], 0, sizeof(_fs_reference_t));
-                
-                FS_CHECK_ERROR(_fs_write_cluster_buffer(fs, current_cluster));
-                
-                node_data.modification_time = (uint32_t)time(NULL);
-                FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
-                
-                return FS_OK;
-            }
-        }
-        
-        prev_cluster = current_cluster;
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    } while (current_cluster != FS_CLUSTER_EOF);
-    
-    return FS_NOT_EXISTS;
-}
-
-static int _fs_find_node(fs_t* fs, const char* path, uint32_t* result_node, uint8_t* result_code)
-{
-    if (path[0] != '/') return FS_WRONG_PATH;
-    
-    *result_node = fs->root_node;
-    *result_code = FS_FIND_DIR;
-    
-    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
-    
-    char pathBuffer[FS_PATH_MAX_LENGTH + 1];
-    strcpy(pathBuffer, path);
-    char* name = strtok(pathBuffer, "/");
-    while (name != NULL)
-    {
-        if (strlen(name) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
-        
-        uint8_t find_status;
-        uint32_t find_node;
-        FS_CHECK_ERROR(_fs_dir_find_entry(fs, *result_node, name, &find_status, &find_node));
-        
-        name = strtok(NULL, "/");
-        
-        if (name != NULL)
-        {
-            // element in the middle of path should be directory
-            if (find_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
-        }
-        else
-        {
-            *result_code = find_status;
-        }
-        
-        *result_node = find_node;
-    }
-    
-    return FS_OK;
-}
-
-static int _fs_free_node(fs_t* fs, uint32_t node)
-{
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    
-    // free up all clusters
-    uint32_t cluster_state;
-    FS_CHECK_ERROR(_fs_read_state(fs, node_data.cluster_index, &cluster_state));
-    while (cluster_state != FS_CLUSTER_EOF)
-    {
-        uint32_t next_cluster;
-        FS_CHECK_ERROR(_fs_read_state(fs, cluster_state, &next_cluster));
-        FS_CHECK_ERROR(_fs_write_state(fs, cluster_state, FS_CLUSTER_EMPTY));
-        cluster_state = next_cluster;
-    }
-        
-    FS_CHECK_ERROR(_fs_write_state(fs, node_data.cluster_index, FS_CLUSTER_EMPTY));
-    
-    // change state of node cluster
-    uint32_t cluster_node = node >> 8;
-    uint32_t node_cluster_state;
-    FS_CHECK_ERROR(_fs_read_state(fs, cluster_node, &node_cluster_state));
-    node_cluster_state--;
-    if (node_cluster_state == FS_CLUSTER_NODE_BEGIN) node_cluster_state = FS_CLUSTER_EMPTY;
-    FS_CHECK_ERROR(_fs_write_state(fs, cluster_node, node_cluster_state));
-    
-    memset(&node_data, 0,  sizeof(_fs_node_t));
-    
-    FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
-}
-
-static int _fs_recursive_remove(fs_t* fs, uint32_t node)
-{
-    _fs_node_t node_data;
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    
-    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
-    
-    node_data.links_count--;
-    FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
-    
-    _fs_dir_cluster_t dir;
-
-    uint32_t current_cluster = node_data.cluster_index;
-    do
-    {
-        size_t disk_pos = FS_SECTOR_POS(_fs_cluster_to_sector(fs, current_cluster));
-        FS_CHECK_ERROR(_fs_read_disk(fs, &dir, disk_pos, FS_SECTOR_SIZE));
-
-        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER; i++)
-        {
-            if (dir.ref[i].name[0] != 0)
-            { 
-                if (strcmp(dir.ref[i].name, ".") == 0) continue;
-                
-                _fs_node_t child_node_data;
-                FS_CHECK_ERROR(_fs_read_node(fs, dir.ref[i].node, &child_node_data));
-                child_node_data.links_count--;
-                FS_CHECK_ERROR(_fs_write_node(fs, dir.ref[i].node, &child_node_data));
-                
-                if (strcmp(dir.ref[i].name, "..") == 0) continue; // do not remove parent recursively
-                
-                if (child_node_data.type == FS_NODE_TYPE_DIR)
-                {
-                    FS_CHECK_ERROR(_fs_recursive_remove(fs, dir.ref[i].node));
-                }
-                else if (child_node_data.type == FS_NODE_TYPE_FILE)
-                {
-                    if (child_node_data.links_count == 0)
-                    {
-                        FS_CHECK_ERROR(_fs_free_node(fs, dir.ref[i].node));
-                    }
-                }
-            }
-        }
-    
-        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
-    }
-    while (current_cluster != FS_CLUSTER_EOF);
-    
-    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
-    if (node_data.links_count == 0)
-    {
-        FS_CHECK_ERROR(_fs_free_node(fs, node));
-    }
-    
-    return FS_OK;
-}
-
-static uint32_t _fs_cluster_to_sector(fs_t* fs, uint32_t cluster)
-{
-    return fs->clusters_sector_start + cluster;
-}
-
-static size_t _fs_cluster_state_pos(fs_t* fs, uint32_t cluster)
-{
-    return FS_SECTOR_POS(fs->table_sector_start) + cluster * sizeof(uint32_t);
-}
-
-static size_t _fs_node_pos(fs_t* fs, uint32_t node_number)
-{
-    size_t index = node_number & 0x000000FF;
-    uint32_t cluster = node_number >> 8;
-    uint32_t sector = _fs_cluster_to_sector(fs, cluster);
-    
-    return FS_SECTOR_POS(sector) + index * sizeof(_fs_node_t);
-}
-
-static int _fs_split_path(const char* path, char* dirpath, char* filename)
-{
-    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
-        
-    strcpy(dirpath, path);
-    char* separator = strrchr(dirpath, '/');
-        
-    strcpy(filename, separator + 1);
-        
-    *(separator + 1) = 0;
-        
-    if (strlen(filename) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
-    
-    return FS_OK;
-}
-
-static int _fs_write_state(fs_t* fs, uint32_t cluster, uint32_t new_state)
-{
-    size_t pos = _fs_cluster_state_pos(fs, cluster);
-    
-    return _fs_write_disk(fs, &new_state, pos, sizeof(uint32_t));
-}
-
-static int _fs_write_node(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data)
-{
-    size_t pos = _fs_node_pos(fs, node_number);
-    
-    return _fs_write_disk(fs, node_data, pos, sizeof(_fs_node_t));
-}
-
-static int _fs_write_cluster_buffer(fs_t* fs, uint32_t cluster) // uses fs->buffer
-{
-    size_t sector_index = _fs_cluster_to_sector(fs, cluster);
-    
-    return _fs_write_sector_buffer(fs, sector_index);
-}
-
-static int _fs_write_sector_buffer(fs_t* fs, size_t sector_index) // uses fs->buffer
-{
-    return _fs_write_disk_buffer(fs, FS_SECTOR_POS(sector_index), FS_SECTOR_SIZE);
-}
-
-static int _fs_write_disk_buffer(fs_t* fs, size_t position, size_t size) // uses fs->buffer
-{
-    return _fs_write_disk(fs, fs->buffer, position, size);
-}
-
-static int _fs_write_disk(fs_t* fs, const void* buffer, size_t position, size_t size)
-{
-    return fs->operations.write(fs->state, buffer, position, size);
-}
-
-static int _fs_read_state(fs_t* fs, uint32_t cluster, uint32_t* result_state)
-{
-    size_t pos = _fs_cluster_state_pos(fs, cluster);
-    
-    return _fs_read_disk(fs, result_state, pos, sizeof(uint32_t));
-}
-
-static int _fs_read_node(fs_t* fs, uint32_t node_number, _fs_node_t* node_data)
-{
-    size_t pos = _fs_node_pos(fs, node_number);
-    
-    return _fs_read_disk(fs, node_data, pos, sizeof(_fs_node_t));
-}
-
-static int _fs_read_cluster_buffer(fs_t* fs, uint32_t cluster) // uses fs->buffer
-{
-    size_t sector_index = _fs_cluster_to_sector(fs, cluster);
-    
-    return _fs_read_sector_buffer(fs, sector_index);
-}
-
-static int _fs_read_sector_buffer(fs_t* fs, size_t sector_index) // uses fs->buffer
-{
-    return _fs_read_disk_buffer(fs, FS_SECTOR_POS(sector_index), FS_SECTOR_SIZE);
-}
-
-static int _fs_read_disk_buffer(fs_t* fs, size_t position, size_t size) // uses fs->buffer
-{
-    return _fs_read_disk(fs, fs->buffer, position, size);
-}
-
-static int _fs_read_disk(fs_t* fs, void* buffer, size_t position, size_t size)
-{
-    return fs->operations.read(fs->state, buffer, position, size);
-}
\ No newline at end of file
+#include "fs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if FS_SCAN_MAX_THREADS > 1
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define FS_CHECK_ERROR(x)       do { int error = x; if (error != FS_OK) return error; } while(0)
+
+#define FS_SECTOR_POS(fs, x)    ((size_t)(x) * (fs)->sector_size)
+
+#define FS_STATES_IN_SECTOR(fs) ((fs)->sector_size / sizeof(uint32_t))
+#define FS_REFERENCES_IN_CLUSTER(fs) ((fs)->cluster_size / sizeof(_fs_reference_t))
+#define FS_REFERENCES_IN_SECTOR(fs) ((fs)->sector_size / sizeof(_fs_reference_t))
+#define FS_NODES_MAX_IN_CLUSTER 253 // node cluster states have to stay below FS_CLUSTER_EOF
+#define FS_MAX_CLUSTERS         (1 << 24) // node number holds its cluster in upper 24 bits
+
+#define FS_CLUSTER_EMPTY        0x00000000
+#define FS_CLUSTER_EOF          0xFFFFFFFE
+#define FS_CLUSTER_INVALID      0xFFFFFFFF
+#define FS_CLUSTER_NODE_BEGIN   0xFFFFFF00
+#define FS_CLUSTER_NODE_FULL(fs) (FS_CLUSTER_NODE_BEGIN + (fs)->nodes_in_cluster)
+
+#define FS_NODE_TYPE_FILE       1
+#define FS_NODE_TYPE_DIR        2
+
+#define FS_FIND_FILE            1
+#define FS_FIND_DIR             2
+#define FS_FIND_NOT_EXISTS      3
+
+#define FS_NODE_FLAGS_INUSE     (1 << 0)
+#define FS_NODE_FLAGS_SHARED    (1 << 1) // file was cloned, clusters of its chain may be referenced by other files
+
+#define FS_BITMAP_WORDS(x)      (((x) + 31) / 32)
+
+#define FS_SUMMARY_POS          64 // within bootstrap sector, bootstrap structure has to stay below it
+#define FS_SUMMARY_MAGIC        0x53554D32
+
+#define FS_JOURNAL_DESCRIPTOR_MAGIC 0x4A444553
+#define FS_JOURNAL_COMMIT_MAGIC     0x4A434D54
+#define FS_JOURNAL_ENTRIES_IN_DESCRIPTOR(fs) (((fs)->sector_size - sizeof(_fs_journal_descriptor_t)) / sizeof(uint32_t))
+#define FS_CHECKSUM_BASIS       2166136261u
+
+#define FS_SCAN_BATCH_SIZE      65536   // bytes of allocation table read at once by scan worker
+#define FS_SCAN_MIN_CLUSTERS    65536   // minimum number of clusters worth starting another scan thread
+#define FS_NODE_STRIPE(node)    (((node) ^ ((node) >> 8)) % FS_NODE_LOCK_STRIPES)
+
+#if FS_THREAD_SAFE
+#define FS_MUTEX_LOCK(fs, x)    pthread_mutex_lock(&(fs)->x)
+#define FS_MUTEX_UNLOCK(fs, x)  pthread_mutex_unlock(&(fs)->x)
+#else
+#define FS_MUTEX_LOCK(fs, x)    ((void)0)
+#define FS_MUTEX_UNLOCK(fs, x)  ((void)0)
+#endif
+
+typedef struct
+{
+    uint8_t     flags;
+    uint8_t     type;
+    uint16_t    links_count;
+    uint32_t    size;
+    uint32_t    cluster_index;
+    uint32_t    modification_time;
+} _fs_node_t;
+
+typedef struct
+{
+    uint32_t    sectors_count;
+    uint32_t    root_node;
+    uint32_t    table_sector_start;
+    uint32_t    table_sectors_count;
+    uint32_t    clusters_sector_start;
+    uint32_t    clusters_count;
+    uint32_t    sector_size;            // 0 in file systems created before it was configurable
+    uint32_t    sectors_per_cluster;
+    uint32_t    journal_sector_start;
+    uint32_t    journal_sectors_count;  // 0 if file system has no journal
+    uint32_t    refs_sector_start;
+    uint32_t    refs_sectors_count;     // 0 in file systems created before clones were supported
+    uint32_t    snapshots_node;         // 0 (root node) if there are no snapshots
+} _fs_bootstrap_sector_t;
+
+typedef struct
+{
+    uint32_t    magic;
+    uint32_t    is_clean;               // summary matches allocation table and nodes
+    uint64_t    files_size;
+    uint64_t    dir_structures_size;
+    uint32_t    free_clusters;
+    uint32_t    node_clusters;
+    uint32_t    nodes;
+} _fs_summary_t;
+
+typedef struct
+{
+    uint32_t    magic;
+    uint32_t    sequence;
+    uint32_t    count;                  // sector numbers following this structure, their contents follow the descriptor
+    uint32_t    is_last;                // commit sector follows contents of this descriptor
+} _fs_journal_descriptor_t;
+
+typedef struct
+{
+    uint32_t    magic;
+    uint32_t    sequence;
+    uint32_t    count;                  // sectors in whole transaction
+    uint32_t    checksum;               // of all descriptors and contents
+} _fs_journal_commit_t;
+
+typedef struct
+{
+    uint32_t    sector;
+    const char* data;
+} _fs_journal_block_t;
+
+typedef struct
+{
+    char        name[FS_NAME_MAX_LENGTH + 1];
+    uint32_t    node;
+} _fs_reference_t;
+
+typedef struct
+{
+    uint32_t    cluster;
+    uint32_t    used_mask[FS_BITMAP_WORDS(FS_NODES_MAX_IN_CLUSTER)];
+    uint8_t     used_count;
+    uint8_t     is_mask_loaded;
+} _fs_node_slots_t;
+
+typedef struct
+{
+    fs_t*       fs;
+    uint32_t    first_cluster;
+    uint32_t    end_cluster;
+    uint8_t     build_allocation;       // fill free bitmap and collect partially filled node clusters
+    uint8_t     count_nodes;            // read node clusters and count nodes for summary
+    int         error;
+    uint32_t    free_clusters;
+    uint32_t    node_clusters;
+    uint32_t    nodes;
+    uint64_t    files_size;
+    uint64_t    dir_structures_size;
+    _fs_node_slots_t* node_index;       // partially filled node clusters in order
+    uint32_t    node_index_count;
+    uint32_t    node_index_capacity;
+} _fs_scan_worker_t;
+
+typedef struct
+{
+    uint32_t*   nodes;      // pairs of file node with more than one link and its copy, hashed by file node
+    uint32_t    count;
+    uint32_t    capacity;
+} _fs_node_map_t;
+
+static int _fs_mkdir(fs_t* fs, const char* path);
+static int _fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result);
+static int _fs_size(fs_t* fs, uint32_t node, uint32_t* files_size);
+static int _fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results);
+static int _fs_dir_list_node(fs_t* fs, uint32_t node, uint8_t flags, fs_dir_entry_t* results, size_t* count, size_t max_results);
+static int _fs_dir_open(fs_t* fs, const char* path, uint8_t flags, fs_dir_t* result);
+static int _fs_dir_open_node(fs_t* fs, uint32_t node, uint8_t flags, fs_dir_t* result);
+static int _fs_dir_next(fs_t* fs, fs_dir_t* dir, fs_dir_entry_t* result);
+static int _fs_dir_load(fs_t* fs, fs_dir_t* dir);
+static void _fs_dir_close(fs_dir_t* dir);
+static int _fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result);
+static int _fs_link(fs_t* fs, const char* path, uint32_t node);
+static int _fs_rename(fs_t* fs, const char* source_path, const char* destination_path);
+static int _fs_clone(fs_t* fs, const char* source_path, const char* destination_path);
+static int _fs_share_chain(fs_t* fs, uint32_t node, _fs_node_t* node_data);
+static int _fs_remove(fs_t* fs, const char* path);
+static int _fs_snapshot_create(fs_t* fs, const char* name);
+static int _fs_snapshot_delete(fs_t* fs, const char* name);
+static int _fs_snapshot_find(fs_t* fs, const char* name, uint32_t* result_node);
+static int _fs_snapshot_copy_dir(fs_t* fs, uint32_t dir_node, uint32_t copy_node, _fs_node_map_t* copies);
+static int _fs_snapshot_copy_file(fs_t* fs, uint32_t copy_node, const char* name, uint32_t file_node, _fs_node_t* file_data, _fs_node_map_t* copies);
+static int _fs_snapshot_link_copy(fs_t* fs, uint32_t copy_node, const char* name, uint32_t copy_file);
+static int _fs_add_dir(fs_t* fs, uint32_t dir_node, const char* name, uint32_t parent_node, uint32_t* result_node);
+static uint32_t _fs_node_map_find(const _fs_node_map_t* map, uint32_t node);
+static int _fs_node_map_add(_fs_node_map_t* map, uint32_t node, uint32_t copy);
+static int _fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result);
+static int _fs_file_open_existing(fs_t* fs, uint8_t flags, fs_file_t* result);
+static int _fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written);
+static int _fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read);
+static int _fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos);
+static int _fs_file_discard(fs_t* fs, fs_file_t* file);
+static int _fs_file_write_delayed(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written);
+static int _fs_file_flush(fs_t* fs, fs_file_t* file);
+static void _fs_file_delayed_init(fs_file_t* file, uint8_t flags);
+static void _fs_read_ahead_init(fs_t* fs, fs_file_t* file);
+static void _fs_read_ahead_free(fs_file_t* file);
+static int _fs_read_ahead(fs_t* fs, fs_file_t* file, uint32_t size);
+static size_t _fs_read_ahead_copy(fs_t* fs, fs_file_t* file, void* buffer, size_t size);
+static size_t _fs_read_ahead_take(fs_t* fs, fs_file_t* file, size_t size, const void** result_data);
+static int _fs_file_read_view(fs_t* fs, fs_file_t* file, size_t size, const void** result_data, size_t* result_size);
+static void _fs_node_changed(fs_t* fs, uint32_t node);
+static void _fs_file_share_init(fs_t* fs, fs_file_t* file, const _fs_node_t* node_data);
+static int _fs_file_revalidate(fs_t* fs, fs_file_t* file);
+static int _fs_file_unshare(fs_t* fs, fs_file_t* file);
+static int _fs_file_unshare_locked(fs_t* fs, fs_file_t* file, uint32_t index); // alloc_lock has to be held
+static int _fs_file_close(fs_t* fs, fs_file_t* file);
+
+static int _fs_find_free_cluster(fs_t* fs, uint32_t* result); // alloc_lock has to be held
+static int _fs_alloc_cluster(fs_t* fs, uint32_t new_state, uint32_t* result);
+static int _fs_alloc_run(fs_t* fs, uint32_t prev_cluster, uint32_t count, uint32_t* result_first, uint32_t* result_count);
+static int _fs_alloc_run_locked(fs_t* fs, uint32_t prev_cluster, uint32_t count, uint32_t* result_first, uint32_t* result_count);
+static int _fs_release_chain(fs_t* fs, uint32_t cluster, uint32_t new_state);
+static int _fs_create_node(fs_t* fs, uint32_t* result_node_number);
+static int _fs_create_node_locked(fs_t* fs, uint32_t* result_node_number);
+static int _fs_create_dir(fs_t* fs, uint32_t node, uint32_t parent_node, uint32_t* result_cluster);
+static int _fs_create_dir_node(fs_t* fs, uint32_t parent_node, uint32_t* result_node);
+static int _fs_dir_find_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint8_t* result_code, uint32_t* result_node);
+static int _fs_dir_add_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t entry_node);
+static int _fs_dir_remove_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t* removed_entry_node);
+static int _fs_dir_rename_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, const char* new_name);
+static int _fs_dir_set_parent(fs_t* fs, uint32_t dir_node, uint32_t parent_node);
+static int _fs_find_node(fs_t* fs, const char* path, uint32_t* result_node, uint8_t* result_code);
+static int _fs_free_node(fs_t* fs, uint32_t node);
+static void _fs_discard_node(fs_t* fs, uint32_t node);
+static int _fs_release_node_locked(fs_t* fs, uint32_t node);
+static int _fs_recursive_remove(fs_t* fs, uint32_t node);
+
+static uint32_t _fs_cluster_to_sector(fs_t* fs, uint32_t cluster);
+static size_t _fs_cluster_state_pos(fs_t* fs, uint32_t cluster);
+static size_t _fs_cluster_refs_pos(fs_t* fs, uint32_t cluster);
+static size_t _fs_node_pos(fs_t* fs, uint32_t node_number);
+static int _fs_split_path(const char* path, char* dirpath, char* filename);
+
+static int _fs_write_state(fs_t* fs, uint32_t cluster, uint32_t new_state);
+static int _fs_write_state_locked(fs_t* fs, uint32_t cluster, uint32_t new_state);
+static int _fs_write_refs_locked(fs_t* fs, uint32_t cluster, uint16_t refs);
+static int _fs_write_node(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data);
+static int _fs_write_node_locked(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data);
+static int _fs_write_cluster_sector(fs_t* fs, uint32_t cluster, uint32_t sector, const void* buffer);
+static int _fs_zero_cluster(fs_t* fs, uint32_t cluster);
+static int _fs_write_metadata(fs_t* fs, const void* buffer, size_t position, size_t size);
+static int _fs_write_disk(fs_t* fs, const void* buffer, size_t position, size_t size);
+static int _fs_write_disk_raw(fs_t* fs, const void* buffer, size_t position, size_t size);
+static int _fs_write_disk_run(fs_t* fs, const void* buffer, size_t position, size_t size);
+static int _fs_write_disk_vector(fs_t* fs, const fs_disk_vector_t* vectors, size_t count, size_t position);
+
+static int _fs_read_state(fs_t* fs, uint32_t cluster, uint32_t* result_state);
+static int _fs_read_refs(fs_t* fs, uint32_t cluster, uint16_t* result_refs);
+static int _fs_read_node(fs_t* fs, uint32_t node_number, _fs_node_t* node_data);
+static int _fs_read_cluster_sector(fs_t* fs, uint32_t cluster, uint32_t sector, void* buffer);
+static int _fs_read_disk(fs_t* fs, void* buffer, size_t position, size_t size);
+static int _fs_read_disk_raw(fs_t* fs, void* buffer, size_t position, size_t size);
+static int _fs_map_disk(fs_t* fs, const void** result_address, size_t position, size_t size);
+static int _fs_read_disk_run(fs_t* fs, void* buffer, size_t position, size_t size);
+static int _fs_read_disk_vector(fs_t* fs, const fs_disk_vector_t* vectors, size_t count, size_t position);
+static int _fs_sync_disk(fs_t* fs);
+
+static int _fs_file_run(fs_t* fs, fs_file_t* file, size_t size, uint32_t* result_last_cluster, size_t* result_size);
+static void _fs_file_advance(fs_t* fs, fs_file_t* file, uint32_t last_cluster, size_t size);
+
+static void _fs_chain_map_init(fs_file_t* file);
+static void _fs_chain_map_note(fs_file_t* file, uint32_t index, uint32_t cluster, uint32_t clusters_count);
+static void _fs_chain_map_lookup(fs_file_t* file, uint32_t index, uint32_t* result_index, uint32_t* result_cluster);
+static void _fs_chain_map_truncate(fs_file_t* file, uint32_t last_index);
+static void _fs_chain_map_free(fs_file_t* file);
+
+static int _fs_allocation_init(fs_t* fs, uint8_t scan_table, uint8_t rebuild_summary);
+static int _fs_allocation_load(fs_t* fs); // alloc_lock has to be held
+static void _fs_allocation_free(fs_t* fs);
+static void _fs_bitmap_update(fs_t* fs, uint32_t cluster, uint32_t new_state);
+static uint32_t _fs_bitmap_next_free(fs_t* fs, uint32_t from);
+static uint32_t _fs_bitmap_run_length(fs_t* fs, uint32_t start, uint32_t max);
+static uint32_t _fs_lowest_bit(uint32_t value);
+
+static int _fs_node_index_add(fs_t* fs, uint32_t cluster, uint8_t used_count, uint8_t is_mask_loaded);
+static void _fs_node_index_remove(fs_t* fs, uint32_t position);
+static uint32_t _fs_node_index_hash(fs_t* fs, uint32_t cluster);
+static uint32_t _fs_node_index_find(fs_t* fs, uint32_t cluster);
+static int _fs_node_index_load_mask(fs_t* fs, _fs_node_slots_t* slots);
+
+static void _fs_dentry_init(fs_t* fs);
+static fs_dentry_t* _fs_dentry_slot(fs_t* fs, uint32_t parent_node, const char* name);
+static void _fs_dentry_store(fs_t* fs, uint32_t parent_node, const char* name, uint8_t status, uint32_t node);
+static void _fs_dentry_invalidate(fs_t* fs, uint32_t parent_node, const char* name);
+static void _fs_dentry_invalidate_node(fs_t* fs, uint32_t node);
+
+static int _fs_summary_write(fs_t* fs, uint8_t is_clean);
+static int _fs_summary_mark_dirty(fs_t* fs); // alloc_lock has to be held
+static int _fs_summary_commit(fs_t* fs);
+static void _fs_summary_update_state(fs_t* fs, uint32_t old_state, uint32_t new_state);
+static void _fs_summary_update_node(fs_t* fs, const _fs_node_t* node_data, int8_t sign);
+
+static void _fs_journal_init(fs_t* fs, uint32_t sector_start, uint32_t sectors_count);
+static int _fs_journal_check(fs_t* fs, int error);
+static int _fs_journal_commit_locked(fs_t* fs, uint8_t is_complete); // alloc_lock has to be held
+static int _fs_journal_commit_cached(fs_t* fs); // cache_lock has to be held
+static int _fs_journal_write(fs_t* fs, const _fs_journal_block_t* blocks, uint32_t count);
+static int _fs_journal_replay(fs_t* fs);
+static uint32_t _fs_journal_capacity(fs_t* fs);
+static uint32_t _fs_journal_changed_count(fs_t* fs);
+static int _fs_journal_hold(fs_t* fs, uint32_t sector, const char* data);
+static uint8_t _fs_journal_take_held(fs_t* fs, uint32_t sector, char* data);
+static int _fs_journal_free_cluster(fs_t* fs, uint32_t cluster);
+static void _fs_journal_release_freed(fs_t* fs);
+static void _fs_journal_free(fs_t* fs);
+static int _fs_journal_compare_blocks(const void* a, const void* b);
+static int _fs_write_blocks(fs_t* fs, const _fs_journal_block_t* blocks, uint32_t count);
+static int _fs_batch_write_held(fs_t* fs); // cache_lock has to be held
+static uint32_t _fs_checksum(uint32_t hash, const void* data, size_t size);
+
+static int _fs_format_full(fs_t* fs, size_t size);
+static int _fs_format_fast(fs_t* fs, size_t size);
+
+static int _fs_scan(fs_t* fs, uint8_t build_allocation, uint8_t count_nodes);
+static void* _fs_scan_worker(void* argument);
+static int _fs_scan_range(_fs_scan_worker_t* worker);
+static uint32_t _fs_scan_threads(fs_t* fs);
+
+static int _fs_geometry_init(fs_t* fs, uint32_t sector_size, uint32_t sectors_per_cluster);
+static void _fs_geometry_free(fs_t* fs);
+static uint8_t _fs_is_power_of_two(uint32_t value);
+
+static void _fs_cache_init(fs_t* fs);
+static int _fs_cache_read(fs_t* fs, void* buffer, size_t position, size_t size); // cache_lock has to be held by all _fs_cache functions except flush
+static int _fs_cache_write(fs_t* fs, const void* buffer, size_t position, size_t size, uint8_t is_metadata);
+static int _fs_cache_get(fs_t* fs, uint32_t sector, uint8_t load, fs_cache_entry_t** result_entry);
+static fs_cache_entry_t* _fs_cache_find(fs_t* fs, uint32_t sector);
+static int _fs_cache_claim(fs_t* fs, uint32_t sector, fs_cache_entry_t** result_entry);
+static int _fs_cache_fill(fs_t* fs, uint32_t sector, const void* data);
+static int _fs_cache_write_back(fs_t* fs, uint32_t first_sector, uint32_t end_sector);
+static int _fs_cache_flush(fs_t* fs);
+
+static int _fs_locks_init(fs_t* fs);
+static void _fs_locks_free(fs_t* fs);
+static void _fs_volume_lock(fs_t* fs, uint8_t exclusive);
+static void _fs_volume_unlock(fs_t* fs);
+static void _fs_node_lock(fs_t* fs, uint32_t node, uint8_t exclusive);
+static void _fs_node_unlock(fs_t* fs, uint32_t node);
+static void _fs_disk_lock(fs_t* fs);
+static void _fs_disk_unlock(fs_t* fs);
+
+int fs_create(const fs_disk_operations_t* operations, size_t size, const fs_format_options_t* options, fs_t* result_fs)
+{   
+    uint32_t sector_size = FS_DEFAULT_SECTOR_SIZE;
+    uint32_t sectors_per_cluster = FS_DEFAULT_SECTORS_PER_CLUSTER;
+    uint8_t flags = 0;
+    uint32_t journal_sectors = 0;
+    if (options != NULL)
+    {
+        sector_size = options->sector_size;
+        sectors_per_cluster = options->sectors_per_cluster;
+        flags = options->flags;
+        journal_sectors = options->journal_sectors;
+    }
+    
+    if (journal_sectors != 0 && journal_sectors < FS_MIN_JOURNAL_SECTORS) return FS_INVALID_PARAMETER;
+    
+    result_fs->operations = *operations;
+    
+    FS_CHECK_ERROR(_fs_locks_init(result_fs));
+    FS_CHECK_ERROR(_fs_geometry_init(result_fs, sector_size, sectors_per_cluster));
+    
+    FS_CHECK_ERROR(result_fs->operations.init(&result_fs->state));
+    
+    _fs_cache_init(result_fs);
+    _fs_dentry_init(result_fs);
+    result_fs->batch_depth = 0;
+    memset(result_fs->node_versions, 0, sizeof(result_fs->node_versions));
+    memset(result_fs->node_relinks, 0, sizeof(result_fs->node_relinks));
+    result_fs->is_read_only = 0;
+    result_fs->snapshots_node = 0;
+    
+    uint64_t sectors_count = size / result_fs->sector_size;
+    if (sectors_count > UINT32_MAX) sectors_count = UINT32_MAX;
+    result_fs->sectors_count = (uint32_t)sectors_count;
+    if (result_fs->sectors_count <= journal_sectors + 1) return FS_INVALID_PARAMETER;
+    
+    // bootstrap sector, allocation table, reference count table, journal and clusters have to fit together on the disk
+    uint64_t available_sectors = result_fs->sectors_count - 1 - journal_sectors;
+    uint64_t clusters_count = available_sectors * result_fs->sector_size / ((uint64_t)sectors_per_cluster * result_fs->sector_size + sizeof(uint32_t) + sizeof(uint16_t));
+    if (clusters_count > FS_MAX_CLUSTERS) clusters_count = FS_MAX_CLUSTERS; // rest of larger disk stays unused
+    uint64_t table_sectors_count;
+    uint64_t refs_sectors_count;
+    for (;;)
+    {
+        table_sectors_count = (clusters_count * sizeof(uint32_t) + result_fs->sector_size - 1) / result_fs->sector_size;
+        refs_sectors_count = (clusters_count * sizeof(uint16_t) + result_fs->sector_size - 1) / result_fs->sector_size;
+        if (table_sectors_count + refs_sectors_count + clusters_count * sectors_per_cluster <= available_sectors) break;
+        clusters_count--;
+    }
+    
+    result_fs->table_sector_start = 1;
+    result_fs->table_sectors_count = (uint32_t)table_sectors_count;
+    result_fs->refs_sector_start = result_fs->table_sector_start + result_fs->table_sectors_count;
+    result_fs->refs_sectors_count = (uint32_t)refs_sectors_count;
+    _fs_journal_init(result_fs, result_fs->refs_sector_start + result_fs->refs_sectors_count, journal_sectors);
+    result_fs->clusters_sector_start = result_fs->journal_sector_start + journal_sectors;
+    result_fs->clusters_count = (uint32_t)clusters_count;
+    
+    if (flags & FS_FORMAT_FULL_ZERO)
+    {
+        FS_CHECK_ERROR(_fs_format_full(result_fs, size));
+    }
+    else
+    {
+        FS_CHECK_ERROR(_fs_format_fast(result_fs, size));
+    }
+    
+    // summary is written as clean once the file system is complete
+    result_fs->node_clusters = 0;
+    result_fs->nodes = 0;
+    result_fs->files_size = 0;
+    result_fs->dir_structures_size = 0;
+    result_fs->is_summary_dirty = 1;
+    
+    FS_CHECK_ERROR(_fs_allocation_init(result_fs, 0, 0));
+    
+    FS_CHECK_ERROR(_fs_create_node(result_fs, &result_fs->root_node));
+    
+    _fs_node_t root_node_data;
+    FS_CHECK_ERROR(_fs_read_node(result_fs, result_fs->root_node, &root_node_data));
+    root_node_data.type = FS_NODE_TYPE_DIR;
+    root_node_data.links_count = 2;
+    root_node_data.size = result_fs->cluster_size;
+    root_node_data.modification_time = (uint32_t)time(NULL);
+    
+    FS_CHECK_ERROR(_fs_create_dir(result_fs, result_fs->root_node, result_fs->root_node, &root_node_data.cluster_index));  
+    
+    FS_CHECK_ERROR(_fs_write_node(result_fs, result_fs->root_node, &root_node_data));
+    
+    _fs_bootstrap_sector_t bootstrap;
+    memset(&bootstrap, 0, sizeof(bootstrap));
+    bootstrap.sectors_count = result_fs->sectors_count;
+    bootstrap.root_node = result_fs->root_node;
+    bootstrap.table_sector_start = result_fs->table_sector_start;
+    bootstrap.table_sectors_count = result_fs->table_sectors_count;
+    bootstrap.clusters_sector_start = result_fs->clusters_sector_start;
+    bootstrap.clusters_count = result_fs->clusters_count;
+    bootstrap.sector_size = result_fs->sector_size;
+    bootstrap.sectors_per_cluster = result_fs->sectors_per_cluster;
+    bootstrap.journal_sector_start = result_fs->journal_sector_start;
+    bootstrap.journal_sectors_count = result_fs->journal_sectors_count;
+    bootstrap.refs_sector_start = result_fs->refs_sector_start;
+    bootstrap.refs_sectors_count = result_fs->refs_sectors_count;
+    
+    FS_CHECK_ERROR(_fs_write_metadata(result_fs, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+    
+    // journal is found through bootstrap sector, so it goes straight to the disk and the first commit syncs it
+    if (journal_sectors != 0) FS_CHECK_ERROR(_fs_write_disk_raw(result_fs, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+    
+    FS_CHECK_ERROR(_fs_summary_commit(result_fs));
+    
+    return FS_OK;
+}
+
+int fs_open(const fs_disk_operations_t* operations, fs_t* result_fs)
+{
+    result_fs->operations = *operations;
+    
+    FS_CHECK_ERROR(_fs_locks_init(result_fs));
+    FS_CHECK_ERROR(result_fs->operations.init(&result_fs->state));
+    
+    // geometry is not known yet, read bootstrap directly
+    _fs_bootstrap_sector_t bootstrap;
+    FS_CHECK_ERROR(result_fs->operations.read(result_fs->state, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+    
+    if (bootstrap.sector_size == 0)
+    {
+        bootstrap.sector_size = FS_DEFAULT_SECTOR_SIZE;
+        bootstrap.sectors_per_cluster = FS_DEFAULT_SECTORS_PER_CLUSTER;
+    }
+    
+    FS_CHECK_ERROR(_fs_geometry_init(result_fs, bootstrap.sector_size, bootstrap.sectors_per_cluster));
+    
+    _fs_cache_init(result_fs);
+    _fs_dentry_init(result_fs);
+    result_fs->batch_depth = 0;
+    memset(result_fs->node_versions, 0, sizeof(result_fs->node_versions));
+    memset(result_fs->node_relinks, 0, sizeof(result_fs->node_relinks));
+    result_fs->is_read_only = 0;
+    
+    result_fs->sectors_count = bootstrap.sectors_count;
+    result_fs->root_node = bootstrap.root_node;
+    result_fs->snapshots_node = bootstrap.snapshots_node;
+    result_fs->table_sector_start = bootstrap.table_sector_start;
+    result_fs->table_sectors_count = bootstrap.table_sectors_count;
+    result_fs->clusters_sector_start = bootstrap.clusters_sector_start;
+    result_fs->clusters_count = bootstrap.clusters_count;
+    if (result_fs->clusters_count > FS_MAX_CLUSTERS) return FS_INVALID_PARAMETER;
+    
+    // reference count table follows allocation table, anything else means there is none
+    result_fs->refs_sector_start = result_fs->table_sector_start + result_fs->table_sectors_count;
+    result_fs->refs_sectors_count = bootstrap.refs_sectors_count;
+    if (bootstrap.refs_sector_start != result_fs->refs_sector_start ||
+        bootstrap.refs_sectors_count != (result_fs->clusters_count * sizeof(uint16_t) + result_fs->sector_size - 1) / result_fs->sector_size)
+    {
+        result_fs->refs_sectors_count = 0;
+    }
+    
+    // journal lies between reference count table and clusters, anything else means there is none
+    uint32_t journal_sectors = bootstrap.journal_sectors_count;
+    if (journal_sectors < FS_MIN_JOURNAL_SECTORS || bootstrap.journal_sector_start != result_fs->refs_sector_start + result_fs->refs_sectors_count ||
+        bootstrap.journal_sector_start + journal_sectors != result_fs->clusters_sector_start)
+    {
+        journal_sectors = 0;
+    }
+    _fs_journal_init(result_fs, bootstrap.journal_sector_start, journal_sectors);
+    
+    // changes committed before file system was closed may be missing in their places
+    if (journal_sectors != 0)
+    {
+        FS_CHECK_ERROR(_fs_journal_replay(result_fs));
+        
+        // bootstrap sector is part of transactions too, the first snapshot may have been created by the replayed one
+        FS_CHECK_ERROR(_fs_read_disk(result_fs, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+        result_fs->snapshots_node = bootstrap.snapshots_node;
+    }
+    
+    _fs_summary_t summary;
+    FS_CHECK_ERROR(_fs_read_disk(result_fs, &summary, FS_SUMMARY_POS, sizeof(_fs_summary_t)));
+    
+    if (summary.magic == FS_SUMMARY_MAGIC && summary.is_clean)
+    {
+        // allocation table is scanned when something is allocated or freed for the first time
+        result_fs->free_bitmap = NULL;
+        result_fs->node_index = NULL;
+        result_fs->node_index_count = 0;
+        result_fs->node_index_capacity = 0;
+        result_fs->node_index_table = NULL;
+        
+        result_fs->free_clusters = summary.free_clusters;
+        result_fs->node_clusters = summary.node_clusters;
+        result_fs->nodes = summary.nodes;
+        result_fs->files_size = summary.files_size;
+        result_fs->dir_structures_size = summary.dir_structures_size;
+        result_fs->is_summary_dirty = 0;
+    }
+    else
+    {
+        // file system was not closed properly or was created without summary
+        FS_CHECK_ERROR(_fs_allocation_init(result_fs, 1, 1));
+        result_fs->is_summary_dirty = 1;
+    }
+    
+    return FS_OK;
+}
+
+int fs_close(fs_t* fs)
+{
+    // no other thread may use file system at this point, snapshot view has nothing to write and its disk stays open
+    if (!fs->is_read_only)
+    {
+        FS_CHECK_ERROR(_fs_summary_commit(fs));
+        
+        FS_CHECK_ERROR(fs->operations.close(fs->state));
+    }
+    
+    _fs_allocation_free(fs);
+    _fs_journal_free(fs);
+    _fs_geometry_free(fs);
+    _fs_locks_free(fs);
+    
+    return FS_OK;
+}
+
+int fs_sync(fs_t* fs)
+{
+    // summary may be marked clean only when no change is in progress
+    _fs_volume_lock(fs, 1);
+    int error = _fs_summary_commit(fs);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+int fs_batch_begin(fs_t* fs)
+{
+    // depth is changed only when no operation is in progress
+    _fs_volume_lock(fs, 1);
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    fs->batch_depth++;
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    _fs_volume_unlock(fs);
+    
+    return FS_OK;
+}
+
+int fs_batch_commit(fs_t* fs)
+{
+    _fs_volume_lock(fs, 1);
+    if (fs->batch_depth == 0)
+    {
+        _fs_volume_unlock(fs);
+        return FS_INVALID_PARAMETER;
+    }
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    fs->batch_depth--;
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    int error = fs->batch_depth == 0 ? _fs_summary_commit(fs) : FS_OK;
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+int fs_mkdir(fs_t* fs, const char* path)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_mkdir(fs, path);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_mkdir(fs_t* fs, const char* path)
+{
+    if (path[0] != '/') return FS_WRONG_PATH;
+    
+    uint32_t node = fs->root_node;
+    
+    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
+    
+    char pathBuffer[FS_PATH_MAX_LENGTH + 1];
+    strcpy(pathBuffer, path);
+    char* save_pointer;
+    char* name = strtok_r(pathBuffer, "/", &save_pointer);
+    while (name != NULL)
+    {
+        if (strlen(name) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
+        
+        uint8_t find_status;
+        uint32_t find_node;
+        FS_CHECK_ERROR(_fs_dir_find_entry(fs, node, name, &find_status, &find_node));
+        if (find_status == FS_FIND_FILE) return FS_NOT_A_DIRECTORY;
+        else if (find_status == FS_FIND_NOT_EXISTS)
+        {
+            // directory is removed again when its parent cannot take another entry
+            uint32_t new_node;
+            FS_CHECK_ERROR(_fs_add_dir(fs, node, name, node, &new_node));
+            
+            node = new_node;
+        }
+        else if (find_status == FS_FIND_DIR)
+        {
+            node = find_node;
+        }
+        
+        name = strtok_r(NULL, "/", &save_pointer);
+    }
+    
+    return FS_OK;
+}
+
+int fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_dir_entries_count(fs, path, result);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result)
+{
+    uint32_t node;
+    uint8_t status;
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
+    if (status != FS_FIND_DIR)
+    {
+        switch (status)
+        {
+            case FS_FIND_FILE: return FS_NOT_A_DIRECTORY;
+            case FS_FIND_NOT_EXISTS: return FS_NOT_EXISTS;
+        }
+    }
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    
+    *result = 0;
+    uint32_t current_cluster = node_data.cluster_index;
+    do
+    {
+        for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+        {
+            FS_CHECK_ERROR(_fs_read_cluster_sector(fs, current_cluster, sector, dir));
+        
+            for (size_t i = 0; i < FS_REFERENCES_IN_SECTOR(fs); i++)
+            {
+                if (dir[i].name[0] != 0) (*result)++;
+            }
+        }
+        
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    }
+    while (current_cluster != FS_CLUSTER_EOF);
+    
+    return FS_OK;
+}
+
+int fs_size(fs_t* fs, uint32_t node, uint32_t* files_size)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_size(fs, node, files_size);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_size(fs_t* fs, uint32_t node, uint32_t* files_size)
+{
+    *files_size = 0;
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    
+    if (node_data.type == FS_NODE_TYPE_FILE)
+    {
+        *files_size = node_data.size;
+    }
+    else if (node_data.type == FS_NODE_TYPE_DIR)
+    {
+        _fs_reference_t ref;
+    
+        uint32_t current_cluster = node_data.cluster_index;
+        do
+        {
+            size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, current_cluster));
+    
+            for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER(fs); i++)
+            {
+                // one entry at a time - keeps stack of the recursion below small
+                FS_CHECK_ERROR(_fs_read_disk(fs, &ref, disk_pos + i * sizeof(_fs_reference_t), sizeof(_fs_reference_t)));
+                if (ref.name[0] != 0)
+                {
+                    if (strcmp(ref.name, ".") != 0 && strcmp(ref.name, "..") != 0)
+                    {
+                        uint32_t size;
+                        FS_CHECK_ERROR(_fs_size(fs, ref.node, &size));
+                        *files_size += size;
+                    }
+                }
+            }
+        
+            FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+        }
+        while (current_cluster != FS_CLUSTER_EOF);
+    }
+    
+    return FS_OK;
+}
+
+int fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_dir_list(fs, path, results, count, max_results);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results)
+{
+    uint32_t node;
+    uint8_t status;
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
+    if (status != FS_FIND_DIR)
+    {
+        switch (status)
+        {
+            case FS_FIND_FILE: return FS_NOT_A_DIRECTORY;
+            case FS_FIND_NOT_EXISTS: return FS_NOT_EXISTS;
+        }
+    }
+    
+    return _fs_dir_list_node(fs, node, 0, results, count, max_results);
+}
+
+static int _fs_dir_list_node(fs_t* fs, uint32_t node, uint8_t flags, fs_dir_entry_t* results, size_t* count, size_t max_results)
+{
+    fs_dir_t dir;
+    FS_CHECK_ERROR(_fs_dir_open_node(fs, node, flags, &dir));
+    
+    *count = 0;
+    fs_dir_entry_t entry;
+    int error;
+    while ((error = _fs_dir_next(fs, &dir, &entry)) == FS_OK)
+    {
+        if (*count >= max_results)
+        {
+            error = FS_BUFFER_TOO_SMALL;
+            break;
+        }
+        
+        results[(*count)++] = entry;
+    }
+    
+    _fs_dir_close(&dir);
+    
+    return error == FS_EOF ? FS_OK : error;
+}
+
+int fs_dir_open(fs_t* fs, const char* path, uint8_t flags, fs_dir_t* result)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_dir_open(fs, path, flags, result);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_dir_open(fs_t* fs, const char* path, uint8_t flags, fs_dir_t* result)
+{
+    uint32_t node;
+    uint8_t status;
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
+    if (status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS;
+    if (status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
+    
+    return _fs_dir_open_node(fs, node, flags, result);
+}
+
+static int _fs_dir_open_node(fs_t* fs, uint32_t node, uint8_t flags, fs_dir_t* result)
+{
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    // one sector of references and a node for each of them, memory does not depend on directory size
+    result->entries = (char*)malloc(fs->sector_size + FS_REFERENCES_IN_SECTOR(fs) * sizeof(_fs_node_t));
+    if (result->entries == NULL) return FS_OUT_OF_MEMORY;
+    
+    result->node = node;
+    result->first_cluster = node_data.cluster_index;
+    result->cluster = node_data.cluster_index;
+    result->sector = 0;
+    result->flags = flags;
+    result->entries_count = 0;
+    result->entries_pos = 0;
+    result->is_opened = 1;
+    
+    return FS_OK;
+}
+
+int fs_dir_next(fs_t* fs, fs_dir_t* dir, fs_dir_entry_t* result)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_dir_next(fs, dir, result);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_dir_next(fs_t* fs, fs_dir_t* dir, fs_dir_entry_t* result)
+{
+    if (!dir->is_opened) return FS_FILE_CLOSED;
+    
+    _fs_reference_t* refs = (_fs_reference_t*)dir->entries;
+    _fs_node_t* nodes = (_fs_node_t*)(dir->entries + fs->sector_size);
+    while (1)
+    {
+        if (dir->entries_pos == dir->entries_count)
+        {
+            if (dir->cluster == FS_CLUSTER_EOF) return FS_EOF;
+            
+            FS_CHECK_ERROR(_fs_dir_load(fs, dir));
+        }
+        
+        uint32_t i = dir->entries_pos++;
+        if (refs[i].name[0] == 0) continue;
+        if ((dir->flags & FS_DIR_SKIP_DOTS) && (strcmp(refs[i].name, ".") == 0 || strcmp(refs[i].name, "..") == 0)) continue;
+        
+        // name read from the disk does not have to be terminated
+        memset(result, 0, sizeof(fs_dir_entry_t));
+        memcpy(result->name, refs[i].name, FS_NAME_MAX_LENGTH);
+        result->name[FS_NAME_MAX_LENGTH] = 0;
+        result->node = refs[i].node;
+        
+        if (!(dir->flags & FS_DIR_NAMES_ONLY))
+        {
+            result->node_type = nodes[i].type == FS_NODE_TYPE_FILE ? FS_FILE : FS_DIR;
+            result->node_links_count = nodes[i].links_count;
+            result->node_modification_time = nodes[i].modification_time;
+        }
+        
+        return FS_OK;
+    }
+}
+
+static int _fs_dir_load(fs_t* fs, fs_dir_t* dir)
+{
+    // directory could be removed since the previous call (and its node given to another one), its clusters are not followed then
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, dir->node, &node_data));
+    if (!(node_data.flags & FS_NODE_FLAGS_INUSE) || node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_EXISTS;
+    if (node_data.cluster_index != dir->first_cluster) return FS_NOT_EXISTS;
+    
+    _fs_reference_t* refs = (_fs_reference_t*)dir->entries;
+    FS_CHECK_ERROR(_fs_read_cluster_sector(fs, dir->cluster, dir->sector, refs));
+    
+    uint32_t count = FS_REFERENCES_IN_SECTOR(fs);
+    if (!(dir->flags & FS_DIR_NAMES_ONLY))
+    {
+        // entries created together have nodes next to each other, every node sector is read once
+        _fs_node_t* nodes = (_fs_node_t*)(dir->entries + fs->sector_size);
+        uint8_t is_loaded[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+        memset(is_loaded, 0, count);
+        _fs_node_t node_sector[FS_MAX_SECTOR_SIZE / sizeof(_fs_node_t)];
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (refs[i].name[0] == 0 || is_loaded[i]) continue;
+            
+            size_t sector_pos = _fs_node_pos(fs, refs[i].node) / fs->sector_size * fs->sector_size;
+            FS_CHECK_ERROR(_fs_read_disk(fs, node_sector, sector_pos, fs->sector_size));
+            
+            for (uint32_t j = i; j < count; j++)
+            {
+                if (refs[j].name[0] == 0 || is_loaded[j]) continue;
+                
+                size_t pos = _fs_node_pos(fs, refs[j].node);
+                if (pos - sector_pos >= fs->sector_size) continue;
+                
+                nodes[j] = node_sector[(pos - sector_pos) / sizeof(_fs_node_t)];
+                is_loaded[j] = 1;
+            }
+        }
+    }
+    
+    dir->entries_count = count;
+    dir->entries_pos = 0;
+    
+    dir->sector++;
+    if (dir->sector == fs->sectors_per_cluster)
+    {
+        dir->sector = 0;
+        FS_CHECK_ERROR(_fs_read_state(fs, dir->cluster, &dir->cluster));
+    }
+    
+    return FS_OK;
+}
+
+int fs_dir_close(fs_t* fs, fs_dir_t* dir)
+{
+    (void)fs;
+    
+    if (!dir->is_opened) return FS_FILE_CLOSED;
+    
+    _fs_dir_close(dir);
+    
+    return FS_OK;
+}
+
+static void _fs_dir_close(fs_dir_t* dir)
+{
+    free(dir->entries);
+    dir->entries = NULL;
+    dir->is_opened = 0;
+}
+
+int fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result)
+{
+    _fs_volume_lock(fs, 0);
+    int error = _fs_entry_info(fs, path, result);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result)
+{
+    char dirpath[256];
+    FS_CHECK_ERROR(_fs_split_path(path, dirpath, result->name));
+    
+    uint32_t node;
+    uint8_t status; 
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &node, &status));
+    if (status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS; 
+    result->node = node;   
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));  
+    result->node_type = node_data.type == FS_NODE_TYPE_DIR ? FS_DIR : FS_FILE;
+    result->node_links_count = node_data.links_count;
+    result->node_modification_time = node_data.modification_time;
+    
+    return FS_OK;
+}
+
+int fs_link(fs_t* fs, const char* path, uint32_t node)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_link(fs, path, node);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_link(fs_t* fs, const char* path, uint32_t node)
+{
+    char dirpath[256];
+    char filename[FS_NAME_MAX_LENGTH + 1];
+    
+    uint32_t target_node;
+    uint8_t target_code;
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &target_node, &target_code));
+    if (target_code != FS_FIND_NOT_EXISTS) return FS_ALREADY_EXISTS;
+        
+    FS_CHECK_ERROR(_fs_split_path(path, dirpath, filename));
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    if (node_data.type != FS_NODE_TYPE_FILE) return FS_NOT_A_FILE;
+    
+    uint32_t dir_node;
+    uint8_t dir_result;
+    FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_result));
+    
+    // directory may need another cluster for the entry, link is counted only when it is added
+    FS_CHECK_ERROR(_fs_dir_add_entry(fs, dir_node, filename, node));
+    
+    node_data.links_count++;
+    FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
+    
+    return FS_OK;
+}
+
+int fs_rename(fs_t* fs, const char* source_path, const char* destination_path)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_rename(fs, source_path, destination_path);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_rename(fs_t* fs, const char* source_path, const char* destination_path)
+{
+    if (source_path[0] != '/' || destination_path[0] != '/') return FS_WRONG_PATH;
+    
+    char source_dirpath[FS_PATH_MAX_LENGTH + 1];
+    char source_name[FS_NAME_MAX_LENGTH + 1];
+    FS_CHECK_ERROR(_fs_split_path(source_path, source_dirpath, source_name));
+    
+    char destination_dirpath[FS_PATH_MAX_LENGTH + 1];
+    char destination_name[FS_NAME_MAX_LENGTH + 1];
+    FS_CHECK_ERROR(_fs_split_path(destination_path, destination_dirpath, destination_name));
+    
+    if (source_name[0] == 0 || strcmp(source_name, ".") == 0 || strcmp(source_name, "..") == 0) return FS_WRONG_PATH;
+    if (destination_name[0] == 0 || strcmp(destination_name, ".") == 0 || strcmp(destination_name, "..") == 0) return FS_WRONG_PATH;
+    
+    uint32_t source_dir;
+    uint8_t source_dir_status;
+    FS_CHECK_ERROR(_fs_find_node(fs, source_dirpath, &source_dir, &source_dir_status));
+    if (source_dir_status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS;
+    if (source_dir_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t node;
+    uint8_t status;
+    FS_CHECK_ERROR(_fs_dir_find_entry(fs, source_dir, source_name, &status, &node));
+    if (status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS;
+    
+    uint32_t destination_dir;
+    uint8_t destination_dir_status;
+    FS_CHECK_ERROR(_fs_find_node(fs, destination_dirpath, &destination_dir, &destination_dir_status));
+    if (destination_dir_status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS;
+    if (destination_dir_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t existing_node;
+    uint8_t existing_status;
+    FS_CHECK_ERROR(_fs_dir_find_entry(fs, destination_dir, destination_name, &existing_status, &existing_node));
+    if (existing_status != FS_FIND_NOT_EXISTS) return existing_node == node ? FS_OK : FS_ALREADY_EXISTS;
+    
+    // within one directory the entry keeps its slot and only its name is rewritten
+    if (source_dir == destination_dir) return _fs_dir_rename_entry(fs, source_dir, source_name, destination_name);
+    
+    if (status == FS_FIND_DIR)
+    {
+        // directory cannot be moved below itself
+        uint32_t ancestor = destination_dir;
+        while (ancestor != fs->root_node)
+        {
+            if (ancestor == node) return FS_WRONG_PATH;
+            
+            uint32_t parent;
+            uint8_t parent_status;
+            FS_CHECK_ERROR(_fs_dir_find_entry(fs, ancestor, "..", &parent_status, &parent));
+            if (parent == ancestor) break;
+            ancestor = parent;
+        }
+    }
+    
+    // new entry is added first, so interrupted move without journal leaves a link too many instead of a lost node
+    FS_CHECK_ERROR(_fs_dir_add_entry(fs, destination_dir, destination_name, node));
+    
+    uint32_t removed_node;
+    FS_CHECK_ERROR(_fs_dir_remove_entry(fs, source_dir, source_name, &removed_node));
+    
+    if (status == FS_FIND_DIR)
+    {
+        FS_CHECK_ERROR(_fs_dir_set_parent(fs, node, destination_dir));
+        
+        // ".." of moved directory is a link of its parent
+        _fs_node_t parent_data;
+        FS_CHECK_ERROR(_fs_read_node(fs, source_dir, &parent_data));
+        parent_data.links_count--;
+        FS_CHECK_ERROR(_fs_write_node(fs, source_dir, &parent_data));
+        
+        FS_CHECK_ERROR(_fs_read_node(fs, destination_dir, &parent_data));
+        parent_data.links_count++;
+        FS_CHECK_ERROR(_fs_write_node(fs, destination_dir, &parent_data));
+    }
+    
+    return FS_OK;
+}
+
+int fs_clone(fs_t* fs, const char* source_path, const char* destination_path)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_clone(fs, source_path, destination_path);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_clone(fs_t* fs, const char* source_path, const char* destination_path)
+{
+    if (fs->refs_sectors_count == 0) return FS_NOT_SUPPORTED;
+    
+    size_t len = strlen(destination_path);
+    if (len > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
+    if (*(destination_path + len - 1) == '/') return FS_WRONG_PATH;
+    
+    uint32_t source_node;
+    uint8_t source_status;
+    FS_CHECK_ERROR(_fs_find_node(fs, source_path, &source_node, &source_status));
+    if (source_status == FS_FIND_NOT_EXISTS) return FS_NOT_EXISTS;
+    if (source_status != FS_FIND_FILE) return FS_NOT_A_FILE;
+    
+    uint32_t destination_node;
+    uint8_t destination_status;
+    FS_CHECK_ERROR(_fs_find_node(fs, destination_path, &destination_node, &destination_status));
+    if (destination_status == FS_FIND_DIR) return FS_NOT_A_FILE;
+    if (destination_status == FS_FIND_FILE && destination_node == source_node) return FS_OK;
+    
+    _fs_node_t source_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, source_node, &source_data));
+    
+    char dirpath[FS_PATH_MAX_LENGTH + 1];
+    char filename[FS_NAME_MAX_LENGTH + 1];
+    uint32_t dir_node = 0;
+    if (destination_status == FS_FIND_NOT_EXISTS)
+    {
+        FS_CHECK_ERROR(_fs_split_path(destination_path, dirpath, filename));
+        
+        uint8_t dir_status;
+        FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_status));
+    }
+    
+    // reference for destination is taken first and dropped again if destination cannot be pointed to the chain
+    FS_CHECK_ERROR(_fs_share_chain(fs, source_node, &source_data));
+    
+    _fs_node_t destination_data;
+    int error;
+    if (destination_status == FS_FIND_NOT_EXISTS)
+    {
+        error = _fs_create_node(fs, &destination_node);
+        if (error == FS_OK)
+        {
+            error = _fs_read_node(fs, destination_node, &destination_data);
+            destination_data.type = FS_NODE_TYPE_FILE;
+            destination_data.links_count = 1;
+            
+            if (error == FS_OK) error = _fs_dir_add_entry(fs, dir_node, filename, destination_node);
+            if (error != FS_OK) _fs_discard_node(fs, destination_node);
+        }
+    }
+    else
+    {
+        error = _fs_read_node(fs, destination_node, &destination_data);
+    }
+    
+    uint32_t replaced_cluster = FS_CLUSTER_INVALID;
+    if (error == FS_OK)
+    {
+        if (destination_status == FS_FIND_FILE) replaced_cluster = destination_data.cluster_index;
+        
+        destination_data.flags |= FS_NODE_FLAGS_SHARED;
+        destination_data.size = source_data.size;
+        destination_data.cluster_index = source_data.cluster_index;
+        destination_data.modification_time = (uint32_t)time(NULL);
+        error = _fs_write_node(fs, destination_node, &destination_data);
+    }
+    
+    if (error != FS_OK)
+    {
+        _fs_release_chain(fs, source_data.cluster_index, FS_CLUSTER_EMPTY);
+        return error;
+    }
+    
+    // handles opened on destination follow its new chain
+    fs->node_relinks[FS_NODE_STRIPE(destination_node)]++;
+    _fs_node_changed(fs, destination_node);
+    
+    // previous contents of replaced file are released once it points to the source chain, they may share clusters
+    if (replaced_cluster != FS_CLUSTER_INVALID) FS_CHECK_ERROR(_fs_release_chain(fs, replaced_cluster, FS_CLUSTER_EMPTY));
+    
+    return FS_OK;
+}
+
+static int _fs_share_chain(fs_t* fs, uint32_t node, _fs_node_t* node_data)
+{
+    // flag only makes writes check references, it is set first so the reference is never added without it
+    node_data->flags |= FS_NODE_FLAGS_SHARED;
+    FS_CHECK_ERROR(_fs_write_node(fs, node, node_data));
+    
+    // clusters of open handles are not known to be private any more
+    fs->node_relinks[FS_NODE_STRIPE(node)]++;
+    
+    // the first cluster gets one more reference, so does the whole chain which is reached only through it
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    uint16_t refs;
+    int error = _fs_read_refs(fs, node_data->cluster_index, &refs);
+    if (error == FS_OK && refs == UINT16_MAX) error = FS_FULL;
+    if (error == FS_OK) error = _fs_write_refs_locked(fs, node_data->cluster_index, refs + 1);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+int fs_remove(fs_t* fs, const char* path)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_remove(fs, path);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_remove(fs_t* fs, const char* path)
+{
+    if (strcmp(path, "/") == 0) return FS_WRONG_PATH;
+    
+    char dirpath[256];
+    char name[FS_NAME_MAX_LENGTH + 1];
+    FS_CHECK_ERROR(_fs_split_path(path, dirpath, name));
+    
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return FS_WRONG_PATH;
+    
+    uint32_t dir_node;
+    uint8_t dir_status;
+    FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_status));
+    if (dir_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t removed_node;
+    FS_CHECK_ERROR(_fs_dir_remove_entry(fs, dir_node, name, &removed_node));
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, removed_node, &node_data));
+    node_data.links_count--;
+    FS_CHECK_ERROR(_fs_write_node(fs, removed_node, &node_data));
+    
+    if (node_data.type == FS_NODE_TYPE_FILE)
+    {
+        if (node_data.links_count == 0)
+        {
+            FS_CHECK_ERROR(_fs_free_node(fs, removed_node));
+        }
+    }
+    else if (node_data.type == FS_NODE_TYPE_DIR)
+    {
+        FS_CHECK_ERROR(_fs_recursive_remove(fs, removed_node));
+    }
+    
+    return FS_OK;
+}
+
+int fs_snapshot_create(fs_t* fs, const char* name)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_snapshot_create(fs, name);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_snapshot_create(fs_t* fs, const char* name)
+{
+    if (fs->refs_sectors_count == 0) return FS_NOT_SUPPORTED;
+    
+    uint32_t snapshot_node;
+    FS_CHECK_ERROR(_fs_snapshot_find(fs, name, &snapshot_node));
+    if (snapshot_node != 0) return FS_ALREADY_EXISTS;
+    
+    if (fs->snapshots_node == 0)
+    {
+        // directory of snapshots is not reachable from root, it is found through bootstrap sector
+        // node is kept only when its directory was created
+        uint32_t snapshots_node;
+        FS_CHECK_ERROR(_fs_create_dir_node(fs, FS_CLUSTER_INVALID, &snapshots_node));
+        fs->snapshots_node = snapshots_node;
+        
+        _fs_bootstrap_sector_t bootstrap;
+        FS_CHECK_ERROR(_fs_read_disk(fs, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+        bootstrap.snapshots_node = fs->snapshots_node;
+        FS_CHECK_ERROR(_fs_write_metadata(fs, &bootstrap, 0, sizeof(_fs_bootstrap_sector_t)));
+    }
+    
+    // snapshot root is its own parent, like root directory
+    FS_CHECK_ERROR(_fs_add_dir(fs, fs->snapshots_node, name, FS_CLUSTER_INVALID, &snapshot_node));
+    
+    _fs_node_map_t copies;
+    copies.nodes = NULL;
+    copies.count = 0;
+    copies.capacity = 0;
+    
+    int error = _fs_snapshot_copy_dir(fs, fs->root_node, snapshot_node, &copies);
+    free(copies.nodes);
+    
+    // incomplete snapshot is not left behind
+    if (error != FS_OK) _fs_snapshot_delete(fs, name);
+    
+    return error;
+}
+
+static int _fs_snapshot_copy_dir(fs_t* fs, uint32_t dir_node, uint32_t copy_node, _fs_node_map_t* copies)
+{
+    _fs_node_t dir_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &dir_data));
+    
+    _fs_reference_t ref;
+    
+    uint32_t current_cluster = dir_data.cluster_index;
+    do
+    {
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, current_cluster));
+        
+        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER(fs); i++)
+        {
+            FS_CHECK_ERROR(_fs_read_disk(fs, &ref, disk_pos + i * sizeof(_fs_reference_t), sizeof(_fs_reference_t)));
+            if (ref.name[0] == 0 || strcmp(ref.name, ".") == 0 || strcmp(ref.name, "..") == 0) continue;
+            
+            _fs_node_t node_data;
+            FS_CHECK_ERROR(_fs_read_node(fs, ref.node, &node_data));
+            
+            if (node_data.type == FS_NODE_TYPE_DIR)
+            {
+                uint32_t copy_dir;
+                FS_CHECK_ERROR(_fs_add_dir(fs, copy_node, ref.name, copy_node, &copy_dir));
+                FS_CHECK_ERROR(_fs_snapshot_copy_dir(fs, ref.node, copy_dir, copies));
+                continue;
+            }
+            
+            FS_CHECK_ERROR(_fs_snapshot_copy_file(fs, copy_node, ref.name, ref.node, &node_data, copies));
+        }
+        
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    }
+    while (current_cluster != FS_CLUSTER_EOF);
+    
+    // adding entries touched modification time of the copy
+    _fs_node_t copy_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, copy_node, &copy_data));
+    copy_data.modification_time = dir_data.modification_time;
+    
+    return _fs_write_node(fs, copy_node, &copy_data);
+}
+
+static int _fs_snapshot_copy_file(fs_t* fs, uint32_t copy_node, const char* name, uint32_t file_node, _fs_node_t* file_data, _fs_node_map_t* copies)
+{
+    // file with more links is copied once, all of its entries in the snapshot point to the same copy
+    if (copies->count != 0)
+    {
+        uint32_t slot = _fs_node_map_find(copies, file_node);
+        if (copies->nodes[slot * 2] == file_node) return _fs_snapshot_link_copy(fs, copy_node, name, copies->nodes[slot * 2 + 1]);
+    }
+    
+    // copy is linked into the snapshot before it gets the chain, so on failure it is freed
+    // with incomplete snapshot and never releases clusters of the live file
+    uint32_t copy_file;
+    FS_CHECK_ERROR(_fs_create_node(fs, &copy_file));
+    
+    _fs_node_t copy_data;
+    memset(&copy_data, 0, sizeof(_fs_node_t));
+    copy_data.flags = FS_NODE_FLAGS_INUSE;
+    copy_data.type = FS_NODE_TYPE_FILE;
+    copy_data.links_count = 1;
+    copy_data.cluster_index = FS_CLUSTER_EOF;
+    
+    int error = _fs_write_node(fs, copy_file, &copy_data);
+    if (error == FS_OK) error = _fs_dir_add_entry(fs, copy_node, name, copy_file);
+    if (error != FS_OK)
+    {
+        _fs_discard_node(fs, copy_file);
+        return error;
+    }
+    
+    if (file_data->links_count > 1) FS_CHECK_ERROR(_fs_node_map_add(copies, file_node, copy_file));
+    
+    FS_CHECK_ERROR(_fs_share_chain(fs, file_node, file_data));
+    
+    copy_data.flags = file_data->flags;
+    copy_data.size = file_data->size;
+    copy_data.cluster_index = file_data->cluster_index;
+    copy_data.modification_time = file_data->modification_time;
+    error = _fs_write_node(fs, copy_file, &copy_data);
+    
+    // reference added for the copy is dropped if the copy does not point to the chain
+    if (error != FS_OK) _fs_release_chain(fs, file_data->cluster_index, FS_CLUSTER_EMPTY);
+    
+    return error;
+}
+
+static int _fs_snapshot_link_copy(fs_t* fs, uint32_t copy_node, const char* name, uint32_t copy_file)
+{
+    // links of the copy count its entries added so far, so incomplete snapshot is removed completely
+    _fs_node_t copy_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, copy_file, &copy_data));
+    copy_data.links_count++;
+    FS_CHECK_ERROR(_fs_write_node(fs, copy_file, &copy_data));
+    
+    int error = _fs_dir_add_entry(fs, copy_node, name, copy_file);
+    if (error != FS_OK)
+    {
+        copy_data.links_count--;
+        _fs_write_node(fs, copy_file, &copy_data);
+    }
+    
+    return error;
+}
+
+static int _fs_add_dir(fs_t* fs, uint32_t dir_node, const char* name, uint32_t parent_node, uint32_t* result_node)
+{
+    FS_CHECK_ERROR(_fs_create_dir_node(fs, parent_node, result_node));
+    
+    int error = _fs_dir_add_entry(fs, dir_node, name, *result_node);
+    if (error != FS_OK)
+    {
+        // directory without entry is removed like an empty one, which also drops its link to the parent
+        _fs_node_t node_data;
+        int remove_error = _fs_read_node(fs, *result_node, &node_data);
+        if (remove_error == FS_OK && parent_node != FS_CLUSTER_INVALID)
+        {
+            node_data.links_count--;
+            remove_error = _fs_write_node(fs, *result_node, &node_data);
+        }
+        if (remove_error == FS_OK) _fs_recursive_remove(fs, *result_node);
+    }
+    
+    return error;
+}
+
+static uint32_t _fs_node_map_find(const _fs_node_map_t* map, uint32_t node)
+{
+    // pair holding the node or empty pair where it would be added
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = (node * 2654435761u) & mask;
+    while (map->nodes[i * 2] != FS_CLUSTER_INVALID && map->nodes[i * 2] != node) i = (i + 1) & mask;
+    
+    return i;
+}
+
+static int _fs_node_map_add(_fs_node_map_t* map, uint32_t node, uint32_t copy)
+{
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        // table is kept at most half full, pairs are hashed again into twice as large one
+        _fs_node_map_t grown;
+        grown.capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+        grown.count = map->count;
+        grown.nodes = (uint32_t*)malloc((size_t)grown.capacity * 2 * sizeof(uint32_t));
+        if (grown.nodes == NULL) return FS_OUT_OF_MEMORY;
+        memset(grown.nodes, 0xFF, (size_t)grown.capacity * 2 * sizeof(uint32_t));
+        
+        for (uint32_t i = 0; i < map->capacity; i++)
+        {
+            if (map->nodes[i * 2] == FS_CLUSTER_INVALID) continue;
+            
+            uint32_t slot = _fs_node_map_find(&grown, map->nodes[i * 2]);
+            grown.nodes[slot * 2] = map->nodes[i * 2];
+            grown.nodes[slot * 2 + 1] = map->nodes[i * 2 + 1];
+        }
+        
+        free(map->nodes);
+        *map = grown;
+    }
+    
+    uint32_t slot = _fs_node_map_find(map, node);
+    map->nodes[slot * 2] = node;
+    map->nodes[slot * 2 + 1] = copy;
+    map->count++;
+    
+    return FS_OK;
+}
+
+int fs_snapshot_delete(fs_t* fs, const char* name)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 1);
+    int error = _fs_snapshot_delete(fs, name);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_snapshot_delete(fs_t* fs, const char* name)
+{
+    uint32_t snapshot_node;
+    FS_CHECK_ERROR(_fs_snapshot_find(fs, name, &snapshot_node));
+    if (snapshot_node == 0) return FS_NOT_EXISTS;
+    
+    uint32_t removed_node;
+    FS_CHECK_ERROR(_fs_dir_remove_entry(fs, fs->snapshots_node, name, &removed_node));
+    
+    // snapshot root has no entry in a parent directory, its ".." is the last link
+    return _fs_recursive_remove(fs, snapshot_node);
+}
+
+int fs_snapshot_list(fs_t* fs, fs_dir_entry_t* results, size_t* count, size_t max_results)
+{
+    _fs_volume_lock(fs, 0);
+    *count = 0;
+    int error = fs->snapshots_node != 0 ? _fs_dir_list_node(fs, fs->snapshots_node, FS_DIR_SKIP_DOTS, results, count, max_results) : FS_OK;
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_snapshot_find(fs_t* fs, const char* name, uint32_t* result_node)
+{
+    // result is 0 if there is no such snapshot
+    *result_node = 0;
+    
+    size_t len = strlen(name);
+    if (len == 0 || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return FS_WRONG_PATH;
+    if (len > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
+    
+    if (fs->snapshots_node == 0) return FS_OK;
+    
+    uint8_t status;
+    uint32_t node;
+    FS_CHECK_ERROR(_fs_dir_find_entry(fs, fs->snapshots_node, name, &status, &node));
+    if (status == FS_FIND_DIR) *result_node = node;
+    
+    return FS_OK;
+}
+
+int fs_snapshot_open(fs_t* fs, const char* name, fs_t* result_view)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    // view reads the disk directly, so everything written to the snapshot has to be there
+    _fs_volume_lock(fs, 1);
+    uint32_t snapshot_node;
+    int error = _fs_snapshot_find(fs, name, &snapshot_node);
+    if (error == FS_OK && snapshot_node == 0) error = FS_NOT_EXISTS;
+    if (error == FS_OK) error = _fs_summary_commit(fs);
+    _fs_volume_unlock(fs);
+    if (error != FS_OK) return error;
+    
+    result_view->operations = fs->operations;
+    result_view->state = fs->state;
+    
+    FS_CHECK_ERROR(_fs_locks_init(result_view));
+#if FS_THREAD_SAFE
+    // disk calls of the view and of the file system are serialized together
+    result_view->disk_mutex = fs->disk_mutex;
+#endif
+    FS_CHECK_ERROR(_fs_geometry_init(result_view, fs->sector_size, fs->sectors_per_cluster));
+    
+    _fs_cache_init(result_view);
+    _fs_dentry_init(result_view);
+    result_view->batch_depth = 0;
+    memset(result_view->node_versions, 0, sizeof(result_view->node_versions));
+    memset(result_view->node_relinks, 0, sizeof(result_view->node_relinks));
+    result_view->is_read_only = 1;
+    
+    result_view->sectors_count = fs->sectors_count;
+    result_view->root_node = snapshot_node;
+    result_view->snapshots_node = 0;
+    result_view->table_sector_start = fs->table_sector_start;
+    result_view->table_sectors_count = fs->table_sectors_count;
+    result_view->refs_sector_start = fs->refs_sector_start;
+    result_view->refs_sectors_count = fs->refs_sectors_count;
+    result_view->clusters_sector_start = fs->clusters_sector_start;
+    result_view->clusters_count = fs->clusters_count;
+    
+    // nothing is written through the view, journal of the file system is not used
+    _fs_journal_init(result_view, fs->journal_sector_start, 0);
+    
+    // summary describes the whole volume at the moment view was opened
+    result_view->free_bitmap = NULL;
+    result_view->node_index = NULL;
+    result_view->node_index_count = 0;
+    result_view->node_index_capacity = 0;
+    result_view->node_index_table = NULL;
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    result_view->free_clusters = fs->free_clusters;
+    result_view->node_clusters = fs->node_clusters;
+    result_view->nodes = fs->nodes;
+    result_view->files_size = fs->files_size;
+    result_view->dir_structures_size = fs->dir_structures_size;
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    result_view->is_summary_dirty = 0;
+    
+    return FS_OK;
+}
+
+int fs_info(fs_t* fs, fs_info_t* result)
+{
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    result->sectors = fs->sectors_count;
+    result->clusters = fs->clusters_count;
+    result->table_sectors = fs->table_sectors_count;
+    result->refs_sectors = fs->refs_sectors_count;
+    result->journal_sectors = fs->journal_sectors_count;
+    result->free_clusters = fs->free_clusters;
+    result->node_clusters = fs->node_clusters;
+    result->data_clusters = fs->clusters_count - fs->free_clusters - fs->node_clusters;
+    result->nodes = fs->nodes;
+    result->files_size = fs->files_size;
+    result->dir_structures_size = fs->dir_structures_size;
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    result->sector_size = fs->sector_size;
+    result->cluster_size = fs->cluster_size;
+    result->allocated_nodes = result->node_clusters * fs->nodes_in_cluster;
+    
+    result->nodes_size = (uint64_t)result->node_clusters * fs->cluster_size;
+    
+    result->used_space = result->files_size + result->dir_structures_size + result->nodes_size;
+    result->total_size = (uint64_t)fs->sector_size * fs->sectors_count;
+    result->usable_space = (uint64_t)fs->cluster_size * fs->clusters_count;
+    
+    result->free_space = result->usable_space - result->used_space;
+    
+    return FS_OK;
+}
+
+int fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result)
+{
+    // file may be created or truncated, which changes directories and allocation
+    uint8_t exclusive = (flags & FS_CREATE) != 0;
+    if (exclusive && fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, exclusive);
+    int error = _fs_file_open(fs, path, flags, result);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result)
+{
+    size_t len = strlen(path);
+    if (len > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
+    if (*(path + len - 1) == '/') return FS_WRONG_PATH;
+    
+    uint8_t status;
+    FS_CHECK_ERROR(_fs_find_node(fs, path, &result->node, &status));
+    
+    if (status == FS_FIND_DIR) return FS_NOT_A_FILE;
+    else if (status == FS_FIND_NOT_EXISTS)
+    {
+        if (!(flags & FS_CREATE)) return FS_NOT_EXISTS;
+        
+        char dirpath[FS_PATH_MAX_LENGTH + 1];
+        char filename[FS_NAME_MAX_LENGTH + 1];
+        
+        // create file
+        FS_CHECK_ERROR(_fs_split_path(path, dirpath, filename));
+        
+        uint32_t dir_node;
+        uint8_t dir_status;
+        FS_CHECK_ERROR(_fs_find_node(fs, dirpath, &dir_node, &dir_status));
+        
+        // previous _fs_find_node finished successfully so dir_node for sure is a directory
+        
+        FS_CHECK_ERROR(_fs_create_node(fs, &result->node));
+        
+        _fs_node_t node_data;
+        int error = _fs_read_node(fs, result->node, &node_data);
+        node_data.type = FS_NODE_TYPE_FILE;
+        node_data.links_count = 1;
+        node_data.size = 0;
+        node_data.modification_time = (uint32_t)time(NULL);
+        
+        if (error == FS_OK) error = _fs_alloc_cluster(fs, FS_CLUSTER_EOF, &node_data.cluster_index);
+        if (error != FS_OK)
+        {
+            _fs_discard_node(fs, result->node);
+            return error;
+        }
+        
+        // node is freed with its cluster when directory cannot take another entry
+        error = _fs_write_node(fs, result->node, &node_data);
+        if (error == FS_OK) error = _fs_dir_add_entry(fs, dir_node, filename, result->node);
+        if (error != FS_OK)
+        {
+            _fs_free_node(fs, result->node);
+            return error;
+        }
+        
+        result->pos = 0;
+        result->first_cluster = node_data.cluster_index;
+        result->current_cluster = node_data.cluster_index;
+        result->current_cluster_pos = 0;
+        result->size = node_data.size;
+        result->is_opened = 1;
+        _fs_chain_map_init(result);
+        _fs_file_delayed_init(result, flags);
+        _fs_read_ahead_init(fs, result);
+        _fs_file_share_init(fs, result, &node_data);
+    }
+    else if (status == FS_FIND_FILE)
+    {
+        // writers of the file are excluded, unless the whole volume is locked for truncation
+        uint8_t lock_node = !(flags & FS_CREATE);
+        
+        if (lock_node) _fs_node_lock(fs, result->node, 0);
+        int error = _fs_file_open_existing(fs, flags, result);
+        if (lock_node) _fs_node_unlock(fs, result->node);
+        
+        if (error != FS_OK) return error;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_file_open_existing(fs_t* fs, uint8_t flags, fs_file_t* result)
+{
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, result->node, &node_data));
+    
+    result->pos = 0;
+    result->first_cluster = node_data.cluster_index;
+    result->current_cluster = node_data.cluster_index;
+    result->current_cluster_pos = 0;
+    
+    if (flags & FS_CREATE)
+    {
+        node_data.size = 0;
+        node_data.modification_time = (uint32_t)time(NULL);
+        
+        uint32_t shared_cluster = FS_CLUSTER_INVALID;
+        if (node_data.flags & FS_NODE_FLAGS_SHARED)
+        {
+            // truncated file starts a chain of its own, shared chain is left to other files
+            // only after the node does not point to it, so failed allocation changes nothing
+            shared_cluster = node_data.cluster_index;
+            FS_CHECK_ERROR(_fs_alloc_cluster(fs, FS_CLUSTER_EOF, &node_data.cluster_index));
+            node_data.flags &= ~FS_NODE_FLAGS_SHARED;
+            
+            result->first_cluster = node_data.cluster_index;
+            result->current_cluster = node_data.cluster_index;
+            fs->node_relinks[FS_NODE_STRIPE(result->node)]++;
+        }
+        
+        FS_CHECK_ERROR(_fs_write_node(fs, result->node, &node_data));
+        _fs_node_changed(fs, result->node);
+        
+        if (shared_cluster != FS_CLUSTER_INVALID) FS_CHECK_ERROR(_fs_release_chain(fs, shared_cluster, FS_CLUSTER_EMPTY));
+        
+        // free up all clusters except first
+        FS_CHECK_ERROR(_fs_release_chain(fs, node_data.cluster_index, FS_CLUSTER_EOF));
+    }
+    
+    result->size = node_data.size;
+    result->is_opened = 1;
+    _fs_chain_map_init(result);
+    
+    _fs_file_delayed_init(result, flags);
+    _fs_read_ahead_init(fs, result);
+    _fs_file_share_init(fs, result, &node_data);
+    
+    if (flags & FS_APPEND)
+    {
+        FS_CHECK_ERROR(_fs_file_seek(fs, result, FS_SEEK_END, 0));
+    }
+
+    return FS_OK;
+}
+
+int fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 1);
+    int error = file->is_delayed ? _fs_file_write_delayed(fs, file, buffer, size, written) : _fs_file_write(fs, file, buffer, size, written);
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written)
+{
+    *written = 0;
+    
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    FS_CHECK_ERROR(_fs_file_revalidate(fs, file));
+    
+    if (size != 0) _fs_node_changed(fs, file->node);
+    
+    const uint8_t* byte_buffer = (const uint8_t*)buffer;
+    
+    while (size)
+    {
+        if (file->current_cluster_pos == fs->cluster_size)
+        {
+            // obtain new cluster if there are remaining bytes to write
+            
+            uint32_t cluster_state;
+            FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
+            
+            if (cluster_state == FS_CLUSTER_EOF)
+            {
+                // last cluster gets linked to new ones, so it cannot be shared
+                FS_CHECK_ERROR(_fs_file_unshare(fs, file));
+                
+                // allocate contiguous clusters for as much of the remaining data as possible
+                uint32_t wanted_clusters = (uint32_t)((size + fs->cluster_size - 1) / fs->cluster_size);
+                uint32_t new_cluster;
+                uint32_t new_clusters_count;
+                FS_CHECK_ERROR(_fs_alloc_run(fs, file->current_cluster, wanted_clusters, &new_cluster, &new_clusters_count));
+                
+                file->current_cluster = new_cluster;
+                file->current_cluster_pos = 0;
+                
+                if (file->is_shared)
+                {
+                    file->private_clusters += new_clusters_count;
+                    file->private_last_cluster = new_cluster + new_clusters_count - 1;
+                }
+            }
+            else
+            {
+                // switch to next cluster
+                file->current_cluster = cluster_state;
+                file->current_cluster_pos = 0;
+            }
+        }
+        
+        // data is written only to clusters owned by this file
+        size_t run_limit = size;
+        if (file->is_shared)
+        {
+            FS_CHECK_ERROR(_fs_file_unshare(fs, file));
+            
+            uint32_t index = (file->pos - file->current_cluster_pos) / fs->cluster_size;
+            size_t private_size = (size_t)(file->private_clusters - index) * fs->cluster_size - file->current_cluster_pos;
+            if (run_limit > private_size) run_limit = private_size;
+        }
+        
+        // physically adjacent clusters are written with single request
+        uint32_t last_cluster;
+        size_t run_size;
+        FS_CHECK_ERROR(_fs_file_run(fs, file, run_limit, &last_cluster, &run_size));
+        
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, file->current_cluster));
+        disk_pos += file->current_cluster_pos;
+        
+        FS_CHECK_ERROR(_fs_write_disk_run(fs, byte_buffer, disk_pos, run_size));
+        
+        _fs_file_advance(fs, file, last_cluster, run_size);
+        
+        // data written so far stays in the file even if the rest does not fit
+        if (file->pos > file->size) file->size = file->pos;
+        
+        size -= run_size;
+        byte_buffer += run_size;
+        *written += run_size;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_file_write_delayed(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written)
+{
+    *written = 0;
+    
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    if (size == 0) return FS_OK;
+    
+    // only data appended at the end of file is held, so the whole of it gets one run of clusters when flushed
+    if (file->pos != file->size || file->delayed_size + size > FS_DELAYED_MAX_SIZE)
+    {
+        FS_CHECK_ERROR(_fs_file_flush(fs, file));
+        if (file->pos != file->size || size > FS_DELAYED_MAX_SIZE) return _fs_file_write(fs, file, buffer, size, written);
+    }
+    
+    if (file->delayed_size + size > file->delayed_capacity)
+    {
+        uint32_t new_capacity = file->delayed_capacity == 0 ? fs->cluster_size : file->delayed_capacity;
+        while (new_capacity < file->delayed_size + size) new_capacity *= 2;
+        if (new_capacity > FS_DELAYED_MAX_SIZE) new_capacity = FS_DELAYED_MAX_SIZE;
+        
+        char* new_data = (char*)realloc(file->delayed_data, new_capacity);
+        if (new_data == NULL)
+        {
+            FS_CHECK_ERROR(_fs_file_flush(fs, file));
+            return _fs_file_write(fs, file, buffer, size, written);
+        }
+        
+        file->delayed_data = new_data;
+        file->delayed_capacity = new_capacity;
+    }
+    
+    memcpy(file->delayed_data + file->delayed_size, buffer, size);
+    file->delayed_size += size;
+    file->pos += size;
+    file->size += size;
+    *written = size;
+    
+    return FS_OK;
+}
+
+static int _fs_file_flush(fs_t* fs, fs_file_t* file)
+{
+    if (file->delayed_size == 0) return FS_OK;
+    
+    // handle still points to the position where held data starts
+    uint32_t size = file->delayed_size;
+    file->delayed_size = 0;
+    file->pos -= size;
+    file->size -= size;
+    
+    size_t written;
+    int error = _fs_file_write(fs, file, file->delayed_data, size, &written);
+    if (error != FS_OK)
+    {
+        // data which did not reach the disk stays held after the written part, so it is not lost
+        file->delayed_size = (uint32_t)(size - written);
+        memmove(file->delayed_data, file->delayed_data + written, file->delayed_size);
+        file->pos += file->delayed_size;
+        file->size = file->pos;
+    }
+    
+    return error;
+}
+
+static void _fs_file_delayed_init(fs_file_t* file, uint8_t flags)
+{
+    file->is_delayed = (flags & FS_DELAYED) != 0;
+    file->delayed_data = NULL;
+    file->delayed_size = 0;
+    file->delayed_capacity = 0;
+}
+
+int fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read)
+{
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 0);
+    int error = _fs_file_read(fs, file, buffer, size, read);
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read)
+{
+    *read = 0;
+    
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    FS_CHECK_ERROR(_fs_file_revalidate(fs, file));
+    
+    if (file->pos >= file->size) return FS_EOF;
+    
+    if (file->pos + size > file->size) size = file->size - file->pos;
+    
+    uint8_t* byte_buffer = (uint8_t*)buffer;
+    
+    uint8_t is_sequential = file->pos == file->ahead_read_end;
+    
+    size_t copied = _fs_read_ahead_copy(fs, file, byte_buffer, size);
+    size -= copied;
+    byte_buffer += copied;
+    *read += copied;
+    
+    if (file->advice != FS_ADVISE_RANDOM)
+    {
+        // next window is read when sequential reads reach the end of current one, reads larger than window go directly
+        if (size != 0 && (is_sequential || file->advice == FS_ADVISE_SEQUENTIAL) && size < file->ahead_next_size)
+        {
+            FS_CHECK_ERROR(_fs_read_ahead(fs, file, file->ahead_next_size));
+            
+            file->ahead_next_size *= 2;
+            if (file->ahead_next_size > FS_READ_AHEAD_MAX_SIZE) file->ahead_next_size = FS_READ_AHEAD_MAX_SIZE;
+            
+            copied = _fs_read_ahead_copy(fs, file, byte_buffer, size);
+            size -= copied;
+            byte_buffer += copied;
+            *read += copied;
+        }
+        else if (!is_sequential && file->advice == FS_ADVISE_NORMAL)
+        {
+            file->ahead_next_size = 4 * fs->cluster_size;
+        }
+    }
+    
+    while (size)
+    {
+        if (file->current_cluster_pos == fs->cluster_size)
+        {
+            // obtain new cluster if there are remaining bytes to read
+            
+            uint32_t cluster_state;
+            FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
+            
+            if (cluster_state == FS_CLUSTER_EOF) return FS_EOF;
+            
+            // switch to next cluster
+            file->current_cluster = cluster_state;
+            file->current_cluster_pos = 0;
+        }
+        
+        // physically adjacent clusters are read with single request
+        uint32_t last_cluster;
+        size_t run_size;
+        FS_CHECK_ERROR(_fs_file_run(fs, file, size, &last_cluster, &run_size));
+        
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, file->current_cluster));
+        disk_pos += file->current_cluster_pos;
+        
+        FS_CHECK_ERROR(_fs_read_disk_run(fs, byte_buffer, disk_pos, run_size));
+        
+        _fs_file_advance(fs, file, last_cluster, run_size);
+        
+        size -= run_size;
+        byte_buffer += run_size;
+        *read += run_size;
+    }
+    
+    file->ahead_read_end = file->pos;
+    
+    return FS_OK;
+}
+
+static void _fs_read_ahead_init(fs_t* fs, fs_file_t* file)
+{
+    file->advice = FS_ADVISE_NORMAL;
+    file->ahead_data = NULL;
+    file->ahead_pos = 0;
+    file->ahead_size = 0;
+    file->ahead_capacity = 0;
+    file->ahead_next_size = 4 * fs->cluster_size;
+    file->ahead_version = 0;
+    file->ahead_read_end = 0;
+    file->ahead_runs_count = 0;
+    file->is_viewed = 0;
+}
+
+static void _fs_read_ahead_free(fs_file_t* file)
+{
+    free(file->ahead_data);
+    file->ahead_data = NULL;
+    file->ahead_size = 0;
+    file->ahead_capacity = 0;
+}
+
+static int _fs_read_ahead(fs_t* fs, fs_file_t* file, uint32_t size)
+{
+    file->ahead_size = 0;
+    file->ahead_runs_count = 0;
+    
+    if (size > file->size - file->pos) size = file->size - file->pos;
+    if (size > file->ahead_capacity)
+    {
+        // window is only an optimization, reads keep working without it
+        char* new_data = (char*)realloc(file->ahead_data, size);
+        if (new_data == NULL) return FS_OK;
+        
+        file->ahead_data = new_data;
+        file->ahead_capacity = size;
+    }
+    
+    // window is read like a regular read, but handle returns to the position where it started
+    uint32_t pos = file->pos;
+    uint32_t current_cluster = file->current_cluster;
+    uint32_t current_cluster_pos = file->current_cluster_pos;
+    
+    file->ahead_pos = pos;
+    file->ahead_version = fs->node_versions[FS_NODE_STRIPE(file->node)];
+    
+    int error = FS_OK;
+    while (file->ahead_size < size && file->ahead_runs_count < FS_READ_AHEAD_MAX_RUNS)
+    {
+        if (file->current_cluster_pos == fs->cluster_size)
+        {
+            uint32_t cluster_state;
+            error = _fs_read_state(fs, file->current_cluster, &cluster_state);
+            if (error != FS_OK || cluster_state == FS_CLUSTER_EOF) break;
+            
+            file->current_cluster = cluster_state;
+            file->current_cluster_pos = 0;
+        }
+        
+        uint32_t last_cluster;
+        size_t run_size;
+        error = _fs_file_run(fs, file, size - file->ahead_size, &last_cluster, &run_size);
+        if (error != FS_OK) break;
+        
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, file->current_cluster));
+        disk_pos += file->current_cluster_pos;
+        
+        error = _fs_read_disk_run(fs, file->ahead_data + file->ahead_size, disk_pos, run_size);
+        if (error != FS_OK) break;
+        
+        fs_file_run_t* run = &file->ahead_runs[file->ahead_runs_count++];
+        run->offset = file->ahead_size;
+        run->cluster = file->current_cluster;
+        run->cluster_pos = file->current_cluster_pos;
+        
+        _fs_file_advance(fs, file, last_cluster, run_size);
+        file->ahead_size += run_size;
+    }
+    
+    file->pos = pos;
+    file->current_cluster = current_cluster;
+    file->current_cluster_pos = current_cluster_pos;
+    
+    if (error != FS_OK) file->ahead_size = 0;
+    
+    return error;
+}
+
+static size_t _fs_read_ahead_copy(fs_t* fs, fs_file_t* file, void* buffer, size_t size)
+{
+    const void* data;
+    size = _fs_read_ahead_take(fs, file, size, &data);
+    if (size != 0) memcpy(buffer, data, size);
+    
+    return size;
+}
+
+static size_t _fs_read_ahead_take(fs_t* fs, fs_file_t* file, size_t size, const void** result_data)
+{
+    // window is valid only until contents of the node change
+    if (file->ahead_size == 0 || file->ahead_version != fs->node_versions[FS_NODE_STRIPE(file->node)]) return 0;
+    if (file->pos < file->ahead_pos || file->pos >= file->ahead_pos + file->ahead_size) return 0;
+    
+    uint32_t offset = file->pos - file->ahead_pos;
+    if (size > file->ahead_size - offset) size = file->ahead_size - offset;
+    
+    *result_data = file->ahead_data + offset;
+    offset += size;
+    
+    // handle is moved to the run holding the last copied byte, at cluster boundary it stays at the end of previous cluster
+    uint32_t run_index = file->ahead_runs_count - 1;
+    while (file->ahead_runs[run_index].offset >= offset) run_index--;
+    
+    fs_file_run_t* run = &file->ahead_runs[run_index];
+    uint32_t run_pos = run->cluster_pos + (offset - run->offset);
+    uint32_t cluster_index = (run_pos - 1) / fs->cluster_size;
+    
+    file->current_cluster = run->cluster + cluster_index;
+    file->current_cluster_pos = run_pos - cluster_index * fs->cluster_size;
+    file->pos += size;
+    
+    return size;
+}
+
+static void _fs_node_changed(fs_t* fs, uint32_t node)
+{
+    // caller holds node lock exclusively (or the whole volume), readers of the node are excluded
+    fs->node_versions[FS_NODE_STRIPE(node)]++;
+}
+
+static void _fs_file_share_init(fs_t* fs, fs_file_t* file, const _fs_node_t* node_data)
+{
+    file->is_shared = (node_data->flags & FS_NODE_FLAGS_SHARED) != 0;
+    file->private_clusters = 0;
+    file->private_last_cluster = FS_CLUSTER_INVALID;
+    file->relink_version = fs->node_relinks[FS_NODE_STRIPE(file->node)];
+}
+
+static int _fs_file_revalidate(fs_t* fs, fs_file_t* file)
+{
+    // chain of the file may have been relinked by clone or copy on write through another handle
+    uint32_t relinks = fs->node_relinks[FS_NODE_STRIPE(file->node)];
+    if (file->relink_version == relinks) return FS_OK;
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, file->node, &node_data));
+    
+    _fs_file_share_init(fs, file, &node_data);
+    file->first_cluster = node_data.cluster_index;
+    file->chain_map_count = 0;
+    file->ahead_size = 0;
+    
+    // position is found again in the new chain, data held by FS_DELAYED handle follows it
+    uint32_t pos = file->pos - file->delayed_size;
+    file->pos = 0;
+    file->current_cluster = file->first_cluster;
+    file->current_cluster_pos = 0;
+    FS_CHECK_ERROR(_fs_file_seek(fs, file, FS_SEEK_BEGIN, (int32_t)pos));
+    file->pos += file->delayed_size;
+    
+    return FS_OK;
+}
+
+static int _fs_file_unshare(fs_t* fs, fs_file_t* file)
+{
+    uint32_t index = (file->pos - file->current_cluster_pos) / fs->cluster_size;
+    if (!file->is_shared || index < file->private_clusters) return FS_OK;
+    
+    // references cannot change between checking and copying clusters
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_file_unshare_locked(fs, file, index);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_file_unshare_locked(fs_t* fs, fs_file_t* file, uint32_t index)
+{
+    // chain is shared from its first cluster with more than one reference, clusters before it are private
+    uint32_t prev_cluster = file->private_last_cluster;
+    uint32_t cluster = file->first_cluster;
+    if (file->private_clusters != 0) FS_CHECK_ERROR(_fs_read_state(fs, prev_cluster, &cluster));
+    
+    uint32_t shared_index = file->private_clusters;
+    for (;;)
+    {
+        uint16_t refs;
+        FS_CHECK_ERROR(_fs_read_refs(fs, cluster, &refs));
+        if (refs != 0) break;
+        
+        if (shared_index == index)
+        {
+            file->private_clusters = index + 1;
+            file->private_last_cluster = cluster;
+            return FS_OK;
+        }
+        
+        prev_cluster = cluster;
+        FS_CHECK_ERROR(_fs_read_state(fs, cluster, &cluster));
+        shared_index++;
+    }
+    
+    // shared clusters up to the current one are copied into a chain of their own,
+    // which replaces them in this file only after all of them are copied
+    char* data = (char*)malloc(fs->cluster_size);
+    if (data == NULL) return FS_OUT_OF_MEMORY;
+    
+    uint32_t shared_cluster = cluster;
+    uint32_t first_copy = FS_CLUSTER_INVALID;
+    uint32_t last_copy = FS_CLUSTER_INVALID;
+    int error = FS_OK;
+    for (uint32_t i = shared_index; i <= index; i++)
+    {
+        uint32_t copy;
+        uint32_t count;
+        error = _fs_alloc_run_locked(fs, last_copy, 1, &copy, &count);
+        if (error != FS_OK) break;
+        
+        if (first_copy == FS_CLUSTER_INVALID) first_copy = copy;
+        last_copy = copy;
+        
+        error = _fs_read_disk_run(fs, data, FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, cluster)), fs->cluster_size);
+        if (error == FS_OK) error = _fs_write_disk_run(fs, data, FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, copy)), fs->cluster_size);
+        if (error == FS_OK && i < index) error = _fs_read_state(fs, cluster, &cluster);
+        if (error != FS_OK) break;
+    }
+    free(data);
+    
+    // the rest of shared chain gains a reference from the last copy, counter must not wrap around
+    uint32_t next_cluster = FS_CLUSTER_EOF;
+    uint16_t next_refs = 0;
+    if (error == FS_OK) error = _fs_read_state(fs, cluster, &next_cluster);
+    if (error == FS_OK && next_cluster != FS_CLUSTER_EOF) error = _fs_read_refs(fs, next_cluster, &next_refs);
+    if (error == FS_OK && next_refs == UINT16_MAX) error = FS_FULL;
+    
+    if (error != FS_OK)
+    {
+        // copies are not referenced from anywhere yet, file stays as it was
+        uint32_t copy = first_copy;
+        while (copy != FS_CLUSTER_INVALID && copy != FS_CLUSTER_EOF)
+        {
+            uint32_t next_copy;
+            if (_fs_read_state(fs, copy, &next_copy) != FS_OK) break;
+            if (_fs_write_state_locked(fs, copy, FS_CLUSTER_EMPTY) != FS_OK) break;
+            copy = next_copy;
+        }
+        return error;
+    }
+    
+    if (shared_index == 0)
+    {
+        _fs_node_t node_data;
+        FS_CHECK_ERROR(_fs_read_node(fs, file->node, &node_data));
+        node_data.cluster_index = first_copy;
+        FS_CHECK_ERROR(_fs_write_node_locked(fs, file->node, &node_data));
+        file->first_cluster = first_copy;
+    }
+    else
+    {
+        FS_CHECK_ERROR(_fs_write_state_locked(fs, prev_cluster, first_copy));
+    }
+    
+    // the last copy continues with the rest of shared chain, which gains a reference from it,
+    // while the first shared cluster is not referenced from this chain any more
+    FS_CHECK_ERROR(_fs_write_state_locked(fs, last_copy, next_cluster));
+    
+    if (next_cluster != FS_CLUSTER_EOF) FS_CHECK_ERROR(_fs_write_refs_locked(fs, next_cluster, next_refs + 1));
+    
+    uint16_t refs;
+    FS_CHECK_ERROR(_fs_read_refs(fs, shared_cluster, &refs));
+    FS_CHECK_ERROR(_fs_write_refs_locked(fs, shared_cluster, refs - 1));
+    
+    // chain map and other handles of the file refer to replaced clusters
+    if (shared_index == 0)
+    {
+        file->chain_map_count = 0;
+    }
+    else
+    {
+        _fs_chain_map_truncate(file, shared_index - 1);
+    }
+    
+    file->current_cluster = last_copy;
+    file->private_clusters = index + 1;
+    file->private_last_cluster = last_copy;
+    file->relink_version = ++fs->node_relinks[FS_NODE_STRIPE(file->node)];
+    
+    return FS_OK;
+}
+
+int fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos)
+{
+    // held data is written before leaving the end of file
+    uint8_t is_flushing = file->delayed_size != 0;
+    
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, is_flushing);
+    int error = is_flushing ? _fs_file_flush(fs, file) : FS_OK;
+    if (error == FS_OK) error = _fs_file_seek(fs, file, mode, pos);
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return is_flushing ? _fs_journal_check(fs, error) : error;
+}
+
+static int _fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos)
+{
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    FS_CHECK_ERROR(_fs_file_revalidate(fs, file));
+    
+    switch (mode)
+    {
+        case FS_SEEK_CURRENT: pos = file->pos + pos; break;
+        case FS_SEEK_END: pos = file->size - pos; break;
+    }
+    
+    if (pos < 0) return FS_EOF;
+    if (pos > file->size) return FS_EOF;
+    
+    // position at cluster boundary is kept at the end of previous cluster, like after writing up to it,
+    // so seeking to the end of file never needs a cluster which is not allocated yet
+    uint32_t target_index = pos / fs->cluster_size;
+    uint32_t target_pos = pos % fs->cluster_size;
+    if (target_pos == 0 && target_index > 0)
+    {
+        target_index--;
+        target_pos = fs->cluster_size;
+    }
+    
+    // start from the closest known cluster before target, either from chain map or current one
+    uint32_t current_index;
+    uint32_t current_cluster;
+    _fs_chain_map_lookup(file, target_index, &current_index, &current_cluster);
+    
+    uint32_t file_index = (file->pos - file->current_cluster_pos) / fs->cluster_size;
+    if (file_index > current_index && file_index <= target_index)
+    {
+        current_index = file_index;
+        current_cluster = file->current_cluster;
+    }
+    
+    _fs_chain_map_note(file, current_index, current_cluster, 1);
+    while (current_index < target_index)
+    {
+        uint32_t next_cluster;
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &next_cluster));
+        if (next_cluster == FS_CLUSTER_EOF) return FS_EOF;
+        
+        current_cluster = next_cluster;
+        current_index++;
+        
+        _fs_chain_map_note(file, current_index, current_cluster, 1);
+    }
+    
+    file->current_cluster = current_cluster;
+    file->current_cluster_pos = target_pos;
+    file->pos = pos;
+    
+    return FS_OK;
+}
+
+int fs_file_discard(fs_t* fs, fs_file_t* file)
+{
+    if (fs->is_read_only) return FS_READ_ONLY;
+    
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 1);
+    int error = _fs_file_discard(fs, file);
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_file_discard(fs_t* fs, fs_file_t* file)
+{
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    // held data ends at current position, nothing follows it
+    if (file->delayed_size != 0) return FS_OK;
+    
+    FS_CHECK_ERROR(_fs_file_revalidate(fs, file));
+    
+    // current cluster becomes the last one, so it cannot be shared
+    FS_CHECK_ERROR(_fs_file_unshare(fs, file));
+    
+    uint32_t index = (file->pos - file->current_cluster_pos) / fs->cluster_size;
+    if (file->private_clusters > index + 1)
+    {
+        file->private_clusters = index + 1;
+        file->private_last_cluster = file->current_cluster;
+    }
+    
+    _fs_node_changed(fs, file->node);
+    file->size = file->pos;
+    
+    _fs_chain_map_truncate(file, (file->pos - file->current_cluster_pos) / fs->cluster_size);
+    
+    // node must not keep the old size past the end of shortened chain until the file is closed
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, file->node, &node_data));
+    node_data.size = file->size;
+    FS_CHECK_ERROR(_fs_write_node(fs, file->node, &node_data));
+    
+    // free up all following current
+    return _fs_release_chain(fs, file->current_cluster, FS_CLUSTER_EOF);
+}
+
+int fs_file_flush(fs_t* fs, fs_file_t* file)
+{
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 1);
+    int error = file->is_opened ? _fs_file_flush(fs, file) : FS_FILE_CLOSED;
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+int fs_file_advise(fs_t* fs, fs_file_t* file, uint8_t advice)
+{
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    int error = FS_OK;
+    switch (advice)
+    {
+    case FS_ADVISE_NORMAL:
+        file->ahead_next_size = 4 * fs->cluster_size;
+        break;
+    case FS_ADVISE_SEQUENTIAL:
+        file->ahead_next_size = FS_READ_AHEAD_MAX_SIZE;
+        break;
+    case FS_ADVISE_RANDOM:
+        _fs_read_ahead_free(file);
+        break;
+    case FS_ADVISE_WILLNEED:
+        _fs_volume_lock(fs, 0);
+        _fs_node_lock(fs, file->node, 0);
+        error = _fs_file_revalidate(fs, file);
+        if (error == FS_OK) error = _fs_read_ahead(fs, file, FS_READ_AHEAD_MAX_SIZE);
+        _fs_node_unlock(fs, file->node);
+        _fs_volume_unlock(fs);
+        return error;
+    default:
+        return FS_INVALID_PARAMETER;
+    }
+    
+    file->advice = advice;
+    
+    return error;
+}
+
+int fs_file_read_view(fs_t* fs, fs_file_t* file, size_t size, const void** result_data, size_t* result_size)
+{
+    if (file->is_viewed) return FS_INVALID_PARAMETER;
+    
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 0);
+    int error = _fs_file_read_view(fs, file, size, result_data, result_size);
+    
+    // locks are kept until the view is released, so its data is neither changed nor reused
+    if (error == FS_OK)
+    {
+        file->is_viewed = 1;
+        return FS_OK;
+    }
+    
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_file_read_view(fs_t* fs, fs_file_t* file, size_t size, const void** result_data, size_t* result_size)
+{
+    *result_size = 0;
+    
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    FS_CHECK_ERROR(_fs_file_revalidate(fs, file));
+    
+    if (file->pos >= file->size) return FS_EOF;
+    
+    if (file->pos + size > file->size) size = file->size - file->pos;
+    
+    if (fs->operations.map != NULL)
+    {
+        if (file->current_cluster_pos == fs->cluster_size)
+        {
+            uint32_t cluster_state;
+            FS_CHECK_ERROR(_fs_read_state(fs, file->current_cluster, &cluster_state));
+            
+            if (cluster_state == FS_CLUSTER_EOF) return FS_EOF;
+            
+            file->current_cluster = cluster_state;
+            file->current_cluster_pos = 0;
+        }
+        
+        // view covers one run of physically adjacent clusters
+        uint32_t last_cluster;
+        size_t run_size;
+        FS_CHECK_ERROR(_fs_file_run(fs, file, size, &last_cluster, &run_size));
+        
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, file->current_cluster));
+        disk_pos += file->current_cluster_pos;
+        
+        FS_CHECK_ERROR(_fs_map_disk(fs, result_data, disk_pos, run_size));
+        
+        _fs_file_advance(fs, file, last_cluster, run_size);
+        *result_size = run_size;
+    }
+    else
+    {
+        // without disk mapping the view points into read-ahead window, which is read when it does not cover position
+        *result_size = _fs_read_ahead_take(fs, file, size, result_data);
+        if (*result_size == 0)
+        {
+            uint32_t window_size = size > file->ahead_next_size ? (uint32_t)size : file->ahead_next_size;
+            if (window_size > FS_READ_AHEAD_MAX_SIZE) window_size = FS_READ_AHEAD_MAX_SIZE;
+            
+            FS_CHECK_ERROR(_fs_read_ahead(fs, file, window_size));
+            
+            file->ahead_next_size *= 2;
+            if (file->ahead_next_size > FS_READ_AHEAD_MAX_SIZE) file->ahead_next_size = FS_READ_AHEAD_MAX_SIZE;
+            
+            *result_size = _fs_read_ahead_take(fs, file, size, result_data);
+            if (*result_size == 0) return FS_OUT_OF_MEMORY;
+        }
+    }
+    
+    file->ahead_read_end = file->pos;
+    
+    return FS_OK;
+}
+
+int fs_file_release_view(fs_t* fs, fs_file_t* file)
+{
+    if (!file->is_viewed) return FS_INVALID_PARAMETER;
+    
+    file->is_viewed = 0;
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return FS_OK;
+}
+
+int fs_file_close(fs_t* fs, fs_file_t* file)
+{
+    _fs_volume_lock(fs, 0);
+    _fs_node_lock(fs, file->node, 1);
+    int error = _fs_file_close(fs, file);
+    _fs_node_unlock(fs, file->node);
+    _fs_volume_unlock(fs);
+    
+    return _fs_journal_check(fs, error);
+}
+
+static int _fs_file_close(fs_t* fs, fs_file_t* file)
+{
+    if (!file->is_opened) return FS_FILE_CLOSED;
+    
+    // handle stays open with its held data if it cannot be written, so closing may be retried
+    FS_CHECK_ERROR(_fs_file_flush(fs, file));
+    free(file->delayed_data);
+    file->delayed_data = NULL;
+    file->delayed_capacity = 0;
+    _fs_read_ahead_free(file);
+    
+    if (fs->is_read_only)
+    {
+        _fs_chain_map_free(file);
+        file->is_opened = 0;
+        return FS_OK;
+    }
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, file->node, &node_data));
+    
+    node_data.size = file->size;
+    node_data.modification_time = (uint32_t)time(NULL);
+    
+    FS_CHECK_ERROR(_fs_write_node(fs, file->node, &node_data));
+    
+    _fs_chain_map_free(file);
+    file->is_opened = 0;
+    
+    return FS_OK;
+}
+
+
+static int _fs_find_free_cluster(fs_t* fs, uint32_t* result)
+{
+    FS_CHECK_ERROR(_fs_allocation_load(fs));
+    
+    if (fs->free_clusters == 0) return FS_FULL;
+    
+    // next-fit search starting at cursor, whole words without free clusters are skipped at once
+    uint32_t words_count = FS_BITMAP_WORDS(fs->clusters_count);
+    uint32_t word_index = fs->free_cursor / 32;
+    uint32_t word_mask = ~(uint32_t)0 << (fs->free_cursor % 32);
+    
+    for (uint32_t i = 0; i <= words_count; i++)
+    {
+        uint32_t word = fs->free_bitmap[word_index] & word_mask;
+        if (word != 0)
+        {
+            *result = word_index * 32 + _fs_lowest_bit(word);
+            fs->free_cursor = *result + 1;
+            if (fs->free_cursor >= fs->clusters_count) fs->free_cursor = 0;
+            
+            return FS_OK;
+        }
+        
+        word_mask = ~(uint32_t)0;
+        word_index++;
+        if (word_index == words_count) word_index = 0;
+    }
+    
+    // the rest of free clusters waits for journal commit, which happens only between operations
+    return FS_FULL;
+}
+
+static int _fs_alloc_cluster(fs_t* fs, uint32_t new_state, uint32_t* result)
+{
+    // cluster has to be taken before anyone else finds it
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_find_free_cluster(fs, result);
+    if (error == FS_OK) error = _fs_write_state_locked(fs, *result, new_state);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_alloc_run(fs_t* fs, uint32_t prev_cluster, uint32_t count, uint32_t* result_first, uint32_t* result_count)
+{
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_alloc_run_locked(fs, prev_cluster, count, result_first, result_count);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_alloc_run_locked(fs_t* fs, uint32_t prev_cluster, uint32_t count, uint32_t* result_first, uint32_t* result_count)
+{
+    FS_CHECK_ERROR(_fs_allocation_load(fs));
+    FS_CHECK_ERROR(_fs_summary_mark_dirty(fs));
+    
+    if (fs->free_clusters == 0) return FS_FULL;
+    if (count > fs->free_clusters) count = fs->free_clusters;
+    
+    uint32_t first = FS_CLUSTER_INVALID;
+    uint32_t length = 0;
+    
+    if (prev_cluster != FS_CLUSTER_INVALID && prev_cluster + 1 < fs->clusters_count)
+    {
+        // extend chain in place if cluster right after it is free
+        length = _fs_bitmap_run_length(fs, prev_cluster + 1, count);
+        if (length != 0) first = prev_cluster + 1;
+    }
+    
+    if (length == 0)
+    {
+        // next-fit search for first run long enough, remember the longest one in case there is none
+        uint32_t position = fs->free_cursor;
+        uint8_t wrapped = 0;
+        for (;;)
+        {
+            uint32_t start = _fs_bitmap_next_free(fs, position);
+            if (wrapped && start >= fs->free_cursor) break;
+            if (start >= fs->clusters_count)
+            {
+                if (wrapped) break;
+                wrapped = 1;
+                position = 0;
+                continue;
+            }
+            
+            uint32_t run_length = _fs_bitmap_run_length(fs, start, count);
+            if (run_length > length)
+            {
+                first = start;
+                length = run_length;
+                if (length == count) break;
+            }
+            
+            position = start + run_length;
+        }
+        
+        if (length == 0) return FS_FULL;
+    }
+    
+    // link whole run with one pass over its allocation table entries
+    uint32_t states[FS_MAX_SECTOR_SIZE / sizeof(uint32_t)];
+    uint32_t states_in_buffer = FS_MAX_SECTOR_SIZE / sizeof(uint32_t);
+    for (uint32_t done = 0; done < length; )
+    {
+        uint32_t chunk = length - done;
+        if (chunk > states_in_buffer) chunk = states_in_buffer;
+        
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            uint32_t cluster = first + done + i;
+            states[i] = done + i + 1 == length ? FS_CLUSTER_EOF : cluster + 1;
+            _fs_bitmap_update(fs, cluster, states[i]);
+            _fs_summary_update_state(fs, FS_CLUSTER_EMPTY, states[i]);
+        }
+        
+        FS_CHECK_ERROR(_fs_write_metadata(fs, states, _fs_cluster_state_pos(fs, first + done), chunk * sizeof(uint32_t)));
+        done += chunk;
+    }
+    
+    if (prev_cluster != FS_CLUSTER_INVALID)
+    {
+        FS_CHECK_ERROR(_fs_write_state_locked(fs, prev_cluster, first));
+    }
+    
+    fs->free_cursor = first + length;
+    if (fs->free_cursor >= fs->clusters_count) fs->free_cursor = 0;
+    
+    *result_first = first;
+    *result_count = length;
+    
+    return FS_OK;
+}
+
+static int _fs_release_chain(fs_t* fs, uint32_t cluster, uint32_t new_state)
+{
+    // cluster gets new state and all clusters following it are freed, chain is followed through
+    // a copy of one allocation table sector which is written back once chain leaves it
+    uint32_t states[FS_MAX_SECTOR_SIZE / sizeof(uint32_t)];
+    uint32_t states_in_sector = FS_STATES_IN_SECTOR(fs);
+    uint16_t refs[FS_MAX_SECTOR_SIZE / sizeof(uint16_t)];
+    uint32_t refs_in_sector = fs->sector_size / sizeof(uint16_t);
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = FS_OK;
+    if (fs->journal_sectors_count != 0) error = _fs_allocation_load(fs);
+    if (error == FS_OK) error = _fs_summary_mark_dirty(fs);
+    
+    uint32_t table_sector = FS_CLUSTER_INVALID;
+    uint32_t refs_sector = FS_CLUSTER_INVALID;
+    while (error == FS_OK && cluster != FS_CLUSTER_EOF)
+    {
+        if (new_state == FS_CLUSTER_EMPTY && fs->refs_sectors_count != 0)
+        {
+            // cluster referenced by other chain loses one reference and stays, so does the rest reached through it
+            if (cluster / refs_in_sector != refs_sector)
+            {
+                refs_sector = cluster / refs_in_sector;
+                error = _fs_read_disk(fs, refs, FS_SECTOR_POS(fs, fs->refs_sector_start + refs_sector), fs->sector_size);
+                if (error != FS_OK) break;
+            }
+            
+            uint16_t* cluster_refs = &refs[cluster % refs_in_sector];
+            if (*cluster_refs != 0)
+            {
+                (*cluster_refs)--;
+                error = _fs_write_metadata(fs, cluster_refs, _fs_cluster_refs_pos(fs, cluster), sizeof(uint16_t));
+                break;
+            }
+        }
+        
+        uint32_t cluster_sector = cluster / states_in_sector;
+        if (cluster_sector != table_sector)
+        {
+            if (table_sector != FS_CLUSTER_INVALID)
+            {
+                error = _fs_write_metadata(fs, states, FS_SECTOR_POS(fs, fs->table_sector_start + table_sector), fs->sector_size);
+                if (error != FS_OK) break;
+            }
+            
+            table_sector = cluster_sector;
+            error = _fs_read_disk(fs, states, FS_SECTOR_POS(fs, fs->table_sector_start + table_sector), fs->sector_size);
+            if (error != FS_OK) break;
+        }
+        
+        uint32_t* state = &states[cluster % states_in_sector];
+        uint32_t next_cluster = *state;
+        
+        _fs_bitmap_update(fs, cluster, new_state);
+        _fs_summary_update_state(fs, *state, new_state);
+        *state = new_state;
+        
+        cluster = next_cluster;
+        new_state = FS_CLUSTER_EMPTY;
+    }
+    
+    if (error == FS_OK && table_sector != FS_CLUSTER_INVALID)
+    {
+        error = _fs_write_metadata(fs, states, FS_SECTOR_POS(fs, fs->table_sector_start + table_sector), fs->sector_size);
+    }
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_create_node(fs_t* fs, uint32_t* result_node_number)
+{
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_create_node_locked(fs, result_node_number);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_create_node_locked(fs_t* fs, uint32_t* result_node_number)
+{
+    FS_CHECK_ERROR(_fs_allocation_load(fs));
+    
+    if (fs->node_index_count == 0)
+    {
+        // no node cluster with free places, start new cluster
+        uint32_t cluster;
+        FS_CHECK_ERROR(_fs_find_free_cluster(fs, &cluster));
+        
+        FS_CHECK_ERROR(_fs_zero_cluster(fs, cluster));
+        
+        FS_CHECK_ERROR(_fs_node_index_add(fs, cluster, 0, 1));
+    }
+    
+    uint32_t position = fs->node_index_count - 1;
+    _fs_node_slots_t* slots = &((_fs_node_slots_t*)fs->node_index)[position];
+    FS_CHECK_ERROR(_fs_node_index_load_mask(fs, slots));
+    
+    uint32_t cluster = slots->cluster;
+    uint32_t word_index = 0;
+    while (slots->used_mask[word_index] == ~(uint32_t)0) word_index++;
+    uint32_t index = word_index * 32 + _fs_lowest_bit(~slots->used_mask[word_index]);
+    slots->used_mask[word_index] |= (uint32_t)1 << (index % 32);
+    slots->used_count++;
+    
+    FS_CHECK_ERROR(_fs_write_state_locked(fs, cluster, FS_CLUSTER_NODE_BEGIN + slots->used_count));
+    
+    if (slots->used_count == fs->nodes_in_cluster) _fs_node_index_remove(fs, position);
+    
+    _fs_node_t node;
+    memset(&node, 0, sizeof(_fs_node_t));
+    node.flags |= FS_NODE_FLAGS_INUSE;
+    
+    *result_node_number = (cluster << 8) | index;
+    
+    FS_CHECK_ERROR(_fs_write_node_locked(fs, *result_node_number, &node));
+    
+    return FS_OK;
+}
+
+static int _fs_create_dir(fs_t* fs, uint32_t node, uint32_t parent_node, uint32_t* result_cluster)
+{
+    FS_CHECK_ERROR(_fs_alloc_cluster(fs, FS_CLUSTER_EOF, result_cluster));
+    
+    FS_CHECK_ERROR(_fs_zero_cluster(fs, *result_cluster));
+    
+    _fs_reference_t dir[2];
+    memset(dir, 0, sizeof(dir));
+    strcpy(dir[0].name, ".");
+    dir[0].node = node;
+    
+    strcpy(dir[1].name, "..");
+    dir[1].node = parent_node;
+    
+    size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, *result_cluster));
+    FS_CHECK_ERROR(_fs_write_metadata(fs, dir, disk_pos, sizeof(dir)));
+    
+    return 0;
+}
+
+static int _fs_create_dir_node(fs_t* fs, uint32_t parent_node, uint32_t* result_node)
+{
+    // new directory node without entry in parent, FS_CLUSTER_INVALID parent makes it its own parent
+    FS_CHECK_ERROR(_fs_create_node(fs, result_node));
+    
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, *result_node, &node_data));
+    node_data.type = FS_NODE_TYPE_DIR;
+    node_data.links_count = 2;
+    node_data.modification_time = (uint32_t)time(NULL);
+    node_data.size = fs->cluster_size;
+    
+    if (parent_node == FS_CLUSTER_INVALID) parent_node = *result_node;
+    int error = _fs_create_dir(fs, *result_node, parent_node, &node_data.cluster_index);
+    if (error != FS_OK)
+    {
+        _fs_discard_node(fs, *result_node);
+        return error;
+    }
+    
+    FS_CHECK_ERROR(_fs_write_node(fs, *result_node, &node_data));
+    
+    if (parent_node != *result_node)
+    {
+        _fs_node_t parent_data;
+        FS_CHECK_ERROR(_fs_read_node(fs, parent_node, &parent_data));
+        parent_data.links_count++;
+        FS_CHECK_ERROR(_fs_write_node(fs, parent_node, &parent_data));
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_dir_find_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint8_t* result_code, uint32_t* result_node)
+{
+    FS_MUTEX_LOCK(fs, dentry_lock);
+    fs_dentry_t* dentry = _fs_dentry_slot(fs, dir_node, entry_name);
+    uint8_t is_cached = dentry->status != 0 && dentry->parent_node == dir_node && strcmp(dentry->name, entry_name) == 0;
+    if (is_cached)
+    {
+        *result_code = dentry->status;
+        *result_node = dentry->node;
+    }
+    FS_MUTEX_UNLOCK(fs, dentry_lock);
+    
+    if (is_cached) return FS_OK;
+    
+    _fs_node_t node_data;
+    
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t current_cluster = node_data.cluster_index;
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    do
+    {
+        for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+        {
+            FS_CHECK_ERROR(_fs_read_cluster_sector(fs, current_cluster, sector, dir));
+            
+            for (size_t i = 0; i < FS_REFERENCES_IN_SECTOR(fs); i++)
+            {
+                if (strcmp(dir[i].name, entry_name) == 0)
+                {
+                    _fs_node_t entry_node_data;
+                    FS_CHECK_ERROR(_fs_read_node(fs, dir[i].node, &entry_node_data));
+                
+                    switch (entry_node_data.type)
+                    {
+                        case FS_NODE_TYPE_FILE: *result_code = FS_FIND_FILE; break;
+                        case FS_NODE_TYPE_DIR: *result_code = FS_FIND_DIR; break;
+                    }
+                    
+                    *result_node = dir[i].node;
+                    
+                    _fs_dentry_store(fs, dir_node, entry_name, *result_code, *result_node);
+                
+                    return FS_OK;
+                }
+            }
+        }
+        
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    } while (current_cluster != FS_CLUSTER_EOF);
+    
+    *result_code = FS_FIND_NOT_EXISTS;
+    _fs_dentry_store(fs, dir_node, entry_name, FS_FIND_NOT_EXISTS, 0);
+    
+    return FS_OK;
+}
+
+static int _fs_dir_add_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t entry_node)
+{
+    _fs_node_t node_data;
+    
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    _fs_dentry_invalidate(fs, dir_node, entry_name);
+    
+    uint32_t current_cluster = node_data.cluster_index;
+    uint32_t prev_cluster = FS_CLUSTER_INVALID;
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    do
+    {
+        for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+        {
+            FS_CHECK_ERROR(_fs_read_cluster_sector(fs, current_cluster, sector, dir));
+            
+            for (size_t i = 0; i < FS_REFERENCES_IN_SECTOR(fs); i++)
+            {
+                if (dir[i].name[0] == 0)
+                {
+                    // found free entry
+                    strcpy(dir[i].name, entry_name);
+                    dir[i].node = entry_node;
+                    
+                    FS_CHECK_ERROR(_fs_write_cluster_sector(fs, current_cluster, sector, dir));
+                    
+                    node_data.modification_time = (uint32_t)time(NULL);
+                    FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
+                    
+                    return FS_OK;
+                }
+            }
+        }
+        
+        prev_cluster = current_cluster;
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    } while (current_cluster != FS_CLUSTER_EOF);
+    
+    // all entries in directory clusters are occupied
+    // allocate next cluster
+    
+    uint32_t new_cluster;
+    FS_CHECK_ERROR(_fs_alloc_cluster(fs, FS_CLUSTER_EOF, &new_cluster));
+    
+    node_data.size += fs->cluster_size;
+    node_data.modification_time = (uint32_t)time(NULL);
+    FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
+    
+    FS_CHECK_ERROR(_fs_write_state(fs, prev_cluster, new_cluster)); // link to next cluster
+    
+    FS_CHECK_ERROR(_fs_zero_cluster(fs, new_cluster));
+    
+    memset(dir, 0, fs->sector_size);
+    strcpy(dir[0].name, entry_name);
+    dir[0].node = entry_node;
+    
+    FS_CHECK_ERROR(_fs_write_cluster_sector(fs, new_cluster, 0, dir));
+    
+    return FS_OK;
+}
+
+static int _fs_dir_remove_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, uint32_t* removed_entry_node)
+{
+    _fs_node_t node_data;
+    
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t current_cluster = node_data.cluster_index;
+    uint32_t prev_cluster = FS_CLUSTER_INVALID;
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    do
+    {
+        for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+        {
+            FS_CHECK_ERROR(_fs_read_cluster_sector(fs, current_cluster, sector, dir));
+            
+            for (size_t i = 0; i < FS_REFERENCES_IN_SECTOR(fs); i++)
+            {
+                if (strcmp(dir[i].name, entry_name) == 0)
+                {
+                    *removed_entry_node = dir[i].node;
+                    memset(&dir[i], 0, sizeof(_fs_reference_t));
+                    
+                    _fs_dentry_store(fs, dir_node, entry_name, FS_FIND_NOT_EXISTS, 0);
+                    
+                    FS_CHECK_ERROR(_fs_write_cluster_sector(fs, current_cluster, sector, dir));
+                    
+                    node_data.modification_time = (uint32_t)time(NULL);
+                    FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
+                    
+                    return FS_OK;
+                }
+            }
+        }
+        
+        prev_cluster = current_cluster;
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    } while (current_cluster != FS_CLUSTER_EOF);
+    
+    return FS_NOT_EXISTS;
+}
+
+static int _fs_dir_rename_entry(fs_t* fs, uint32_t dir_node, const char* entry_name, const char* new_name)
+{
+    _fs_node_t node_data;
+    
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    uint32_t current_cluster = node_data.cluster_index;
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    do
+    {
+        for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+        {
+            FS_CHECK_ERROR(_fs_read_cluster_sector(fs, current_cluster, sector, dir));
+            
+            for (size_t i = 0; i < FS_REFERENCES_IN_SECTOR(fs); i++)
+            {
+                if (strcmp(dir[i].name, entry_name) == 0)
+                {
+                    memset(dir[i].name, 0, sizeof(dir[i].name));
+                    strcpy(dir[i].name, new_name);
+                    
+                    _fs_dentry_store(fs, dir_node, entry_name, FS_FIND_NOT_EXISTS, 0);
+                    _fs_dentry_invalidate(fs, dir_node, new_name);
+                    
+                    FS_CHECK_ERROR(_fs_write_cluster_sector(fs, current_cluster, sector, dir));
+                    
+                    node_data.modification_time = (uint32_t)time(NULL);
+                    FS_CHECK_ERROR(_fs_write_node(fs, dir_node, &node_data));
+                    
+                    return FS_OK;
+                }
+            }
+        }
+        
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    } while (current_cluster != FS_CLUSTER_EOF);
+    
+    return FS_NOT_EXISTS;
+}
+
+static int _fs_dir_set_parent(fs_t* fs, uint32_t dir_node, uint32_t parent_node)
+{
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, dir_node, &node_data));
+    
+    // ".." is always the second entry of the first sector written by _fs_create_dir
+    _fs_reference_t dir[FS_MAX_SECTOR_SIZE / sizeof(_fs_reference_t)];
+    FS_CHECK_ERROR(_fs_read_cluster_sector(fs, node_data.cluster_index, 0, dir));
+    if (strcmp(dir[1].name, "..") != 0) return FS_NOT_A_DIRECTORY;
+    dir[1].node = parent_node;
+    FS_CHECK_ERROR(_fs_write_cluster_sector(fs, node_data.cluster_index, 0, dir));
+    
+    _fs_dentry_invalidate(fs, dir_node, "..");
+    
+    return FS_OK;
+}
+
+static int _fs_find_node(fs_t* fs, const char* path, uint32_t* result_node, uint8_t* result_code)
+{
+    if (path[0] != '/') return FS_WRONG_PATH;
+    
+    *result_node = fs->root_node;
+    *result_code = FS_FIND_DIR;
+    
+    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
+    
+    char pathBuffer[FS_PATH_MAX_LENGTH + 1];
+    strcpy(pathBuffer, path);
+    // strtok keeps its position in static state, lookups run concurrently
+    char* save_pointer;
+    char* name = strtok_r(pathBuffer, "/", &save_pointer);
+    while (name != NULL)
+    {
+        if (strlen(name) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
+        
+        uint8_t find_status;
+        uint32_t find_node;
+        FS_CHECK_ERROR(_fs_dir_find_entry(fs, *result_node, name, &find_status, &find_node));
+        
+        name = strtok_r(NULL, "/", &save_pointer);
+        
+        if (name != NULL)
+        {
+            // element in the middle of path should be directory
+            if (find_status != FS_FIND_DIR) return FS_NOT_A_DIRECTORY;
+        }
+        else
+        {
+            *result_code = find_status;
+        }
+        
+        *result_node = find_node;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_free_node(fs_t* fs, uint32_t node)
+{
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    
+    // free up all clusters
+    FS_CHECK_ERROR(_fs_release_chain(fs, node_data.cluster_index, FS_CLUSTER_EMPTY));
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_release_node_locked(fs, node);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    if (error != FS_OK) return error;
+    
+    // node number may be reused, drop every cached entry referring to it
+    _fs_dentry_invalidate_node(fs, node);
+    
+    return FS_OK;
+}
+
+static void _fs_discard_node(fs_t* fs, uint32_t node)
+{
+    // node is released after failed creation, it does not hold any clusters and is not linked anywhere
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    _fs_release_node_locked(fs, node);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    _fs_dentry_invalidate_node(fs, node);
+}
+
+static int _fs_release_node_locked(fs_t* fs, uint32_t node)
+{
+    FS_CHECK_ERROR(_fs_allocation_load(fs));
+    
+    // change state of node cluster
+    uint32_t cluster_node = node >> 8;
+    uint32_t position = fs->node_index_count;
+    if (fs->node_index_capacity != 0)
+    {
+        uint32_t entry = fs->node_index_table[_fs_node_index_find(fs, cluster_node)];
+        if (entry != 0) position = entry - 1;
+    }
+    
+    if (position == fs->node_index_count)
+    {
+        // cluster was full so it was not indexed
+        FS_CHECK_ERROR(_fs_node_index_add(fs, cluster_node, fs->nodes_in_cluster, 1));
+    }
+    
+    _fs_node_slots_t* slots = &((_fs_node_slots_t*)fs->node_index)[position];
+    FS_CHECK_ERROR(_fs_node_index_load_mask(fs, slots));
+    slots->used_mask[(node & 0xFF) / 32] &= ~((uint32_t)1 << ((node & 0xFF) % 32));
+    slots->used_count--;
+    
+    if (slots->used_count == 0)
+    {
+        _fs_node_index_remove(fs, position);
+        FS_CHECK_ERROR(_fs_write_state_locked(fs, cluster_node, FS_CLUSTER_EMPTY));
+    }
+    else
+    {
+        FS_CHECK_ERROR(_fs_write_state_locked(fs, cluster_node, FS_CLUSTER_NODE_BEGIN + slots->used_count));
+    }
+    
+    _fs_node_t node_data;
+    memset(&node_data, 0,  sizeof(_fs_node_t));
+    
+    return _fs_write_node_locked(fs, node, &node_data);
+}
+
+static int _fs_recursive_remove(fs_t* fs, uint32_t node)
+{
+    _fs_node_t node_data;
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    
+    if (node_data.type != FS_NODE_TYPE_DIR) return FS_NOT_A_DIRECTORY;
+    
+    node_data.links_count--;
+    FS_CHECK_ERROR(_fs_write_node(fs, node, &node_data));
+    
+    _fs_reference_t ref;
+
+    uint32_t current_cluster = node_data.cluster_index;
+    do
+    {
+        size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, current_cluster));
+
+        for (size_t i = 0; i < FS_REFERENCES_IN_CLUSTER(fs); i++)
+        {
+            FS_CHECK_ERROR(_fs_read_disk(fs, &ref, disk_pos + i * sizeof(_fs_reference_t), sizeof(_fs_reference_t)));
+            if (ref.name[0] != 0)
+            { 
+                if (strcmp(ref.name, ".") == 0) continue;
+                
+                _fs_node_t child_node_data;
+                FS_CHECK_ERROR(_fs_read_node(fs, ref.node, &child_node_data));
+                child_node_data.links_count--;
+                FS_CHECK_ERROR(_fs_write_node(fs, ref.node, &child_node_data));
+                
+                if (strcmp(ref.name, "..") == 0) continue; // do not remove parent recursively
+                
+                if (child_node_data.type == FS_NODE_TYPE_DIR)
+                {
+                    FS_CHECK_ERROR(_fs_recursive_remove(fs, ref.node));
+                }
+                else if (child_node_data.type == FS_NODE_TYPE_FILE)
+                {
+                    if (child_node_data.links_count == 0)
+                    {
+                        FS_CHECK_ERROR(_fs_free_node(fs, ref.node));
+                    }
+                }
+            }
+        }
+    
+        FS_CHECK_ERROR(_fs_read_state(fs, current_cluster, &current_cluster));
+    }
+    while (current_cluster != FS_CLUSTER_EOF);
+    
+    FS_CHECK_ERROR(_fs_read_node(fs, node, &node_data));
+    if (node_data.links_count == 0)
+    {
+        FS_CHECK_ERROR(_fs_free_node(fs, node));
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_file_run(fs_t* fs, fs_file_t* file, size_t size, uint32_t* result_last_cluster, size_t* result_size)
+{
+    // follow chain from current cluster as long as next cluster is physically adjacent
+    uint32_t last_cluster = file->current_cluster;
+    size_t run_size = fs->cluster_size - file->current_cluster_pos;
+    while (run_size < size)
+    {
+        uint32_t next_cluster;
+        FS_CHECK_ERROR(_fs_read_state(fs, last_cluster, &next_cluster));
+        if (next_cluster != last_cluster + 1) break;
+        
+        last_cluster = next_cluster;
+        run_size += fs->cluster_size;
+    }
+    
+    if (run_size > size) run_size = size;
+    
+    *result_last_cluster = last_cluster;
+    *result_size = run_size;
+    
+    return FS_OK;
+}
+
+static void _fs_file_advance(fs_t* fs, fs_file_t* file, uint32_t last_cluster, size_t size)
+{
+    // run consists of physically adjacent clusters, so all of them can be noted in chain map
+    uint32_t index = (file->pos - file->current_cluster_pos) / fs->cluster_size;
+    _fs_chain_map_note(file, index, file->current_cluster, last_cluster - file->current_cluster + 1);
+    
+    file->current_cluster_pos += size - (last_cluster - file->current_cluster) * fs->cluster_size;
+    file->current_cluster = last_cluster;
+    file->pos += size;
+}
+
+static void _fs_chain_map_init(fs_file_t* file)
+{
+    file->chain_map = NULL;
+    file->chain_map_count = 0;
+    file->chain_map_capacity = 0;
+    file->chain_map_stride = 1;
+}
+
+static void _fs_chain_map_note(fs_file_t* file, uint32_t index, uint32_t cluster, uint32_t clusters_count)
+{
+    // clusters from index to index + clusters_count - 1 are adjacent, entries are appended only in order
+    for (;;)
+    {
+        uint32_t next_index = file->chain_map_count * file->chain_map_stride;
+        if (next_index < index || next_index - index >= clusters_count) return;
+        
+        if (file->chain_map_count == file->chain_map_capacity)
+        {
+            if (file->chain_map_capacity < FS_CHAIN_MAP_MAX_ENTRIES)
+            {
+                uint32_t new_capacity = file->chain_map_capacity == 0 ? 16 : file->chain_map_capacity * 2;
+                if (new_capacity > FS_CHAIN_MAP_MAX_ENTRIES) new_capacity = FS_CHAIN_MAP_MAX_ENTRIES;
+                
+                // chain map is only an optimization, seeks keep working without it
+                uint32_t* new_map = (uint32_t*)realloc(file->chain_map, new_capacity * sizeof(uint32_t));
+                if (new_map == NULL) return;
+                
+                file->chain_map = new_map;
+                file->chain_map_capacity = new_capacity;
+            }
+            else
+            {
+                // map is full, keep every second entry
+                for (uint32_t i = 0; i < file->chain_map_count / 2; i++)
+                {
+                    file->chain_map[i] = file->chain_map[i * 2];
+                }
+                file->chain_map_count = (file->chain_map_count + 1) / 2;
+                file->chain_map_stride *= 2;
+                continue;
+            }
+        }
+        
+        file->chain_map[file->chain_map_count++] = cluster + (next_index - index);
+    }
+}
+
+static void _fs_chain_map_lookup(fs_file_t* file, uint32_t index, uint32_t* result_index, uint32_t* result_cluster)
+{
+    if (file->chain_map_count == 0)
+    {
+        *result_index = 0;
+        *result_cluster = file->first_cluster;
+        return;
+    }
+    
+    uint32_t entry = index / file->chain_map_stride;
+    if (entry >= file->chain_map_count) entry = file->chain_map_count - 1;
+    
+    *result_index = entry * file->chain_map_stride;
+    *result_cluster = file->chain_map[entry];
+}
+
+static void _fs_chain_map_truncate(fs_file_t* file, uint32_t last_index)
+{
+    uint32_t count = last_index / file->chain_map_stride + 1;
+    if (file->chain_map_count > count) file->chain_map_count = count;
+}
+
+static void _fs_chain_map_free(fs_file_t* file)
+{
+    free(file->chain_map);
+    _fs_chain_map_init(file);
+}
+
+static uint32_t _fs_cluster_to_sector(fs_t* fs, uint32_t cluster)
+{
+    return fs->clusters_sector_start + cluster * fs->sectors_per_cluster;
+}
+
+static size_t _fs_cluster_state_pos(fs_t* fs, uint32_t cluster)
+{
+    return FS_SECTOR_POS(fs, fs->table_sector_start) + cluster * sizeof(uint32_t);
+}
+
+static size_t _fs_cluster_refs_pos(fs_t* fs, uint32_t cluster)
+{
+    return FS_SECTOR_POS(fs, fs->refs_sector_start) + cluster * sizeof(uint16_t);
+}
+
+static size_t _fs_node_pos(fs_t* fs, uint32_t node_number)
+{
+    size_t index = node_number & 0x000000FF;
+    uint32_t cluster = node_number >> 8;
+    uint32_t sector = _fs_cluster_to_sector(fs, cluster);
+    
+    return FS_SECTOR_POS(fs, sector) + index * sizeof(_fs_node_t);
+}
+
+static int _fs_split_path(const char* path, char* dirpath, char* filename)
+{
+    if (strlen(path) > FS_PATH_MAX_LENGTH) return FS_PATH_TOO_LONG;
+        
+    strcpy(dirpath, path);
+    char* separator = strrchr(dirpath, '/');
+        
+    strcpy(filename, separator + 1);
+        
+    *(separator + 1) = 0;
+        
+    if (strlen(filename) > FS_NAME_MAX_LENGTH) return FS_NAME_TOO_LONG;
+    
+    return FS_OK;
+}
+
+static int _fs_write_state(fs_t* fs, uint32_t cluster, uint32_t new_state)
+{
+    // bitmap and summary have to follow allocation table
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_write_state_locked(fs, cluster, new_state);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_write_state_locked(fs_t* fs, uint32_t cluster, uint32_t new_state)
+{
+    size_t pos = _fs_cluster_state_pos(fs, cluster);
+    
+    // bitmap is built from the disk, with journal the table there lags behind until commit
+    if (fs->journal_sectors_count != 0) FS_CHECK_ERROR(_fs_allocation_load(fs));
+    FS_CHECK_ERROR(_fs_summary_mark_dirty(fs));
+    
+    uint32_t old_state;
+    FS_CHECK_ERROR(_fs_read_disk(fs, &old_state, pos, sizeof(uint32_t)));
+    
+    _fs_bitmap_update(fs, cluster, new_state);
+    _fs_summary_update_state(fs, old_state, new_state);
+    
+    return _fs_write_metadata(fs, &new_state, pos, sizeof(uint32_t));
+}
+
+static int _fs_write_refs_locked(fs_t* fs, uint32_t cluster, uint16_t refs)
+{
+    FS_CHECK_ERROR(_fs_summary_mark_dirty(fs));
+    
+    return _fs_write_metadata(fs, &refs, _fs_cluster_refs_pos(fs, cluster), sizeof(uint16_t));
+}
+
+static int _fs_write_node(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data)
+{
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = _fs_write_node_locked(fs, node_number, node_data);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    return error;
+}
+
+static int _fs_write_node_locked(fs_t* fs, uint32_t node_number, const _fs_node_t* node_data)
+{
+    size_t pos = _fs_node_pos(fs, node_number);
+    
+    FS_CHECK_ERROR(_fs_summary_mark_dirty(fs));
+    
+    _fs_node_t old_node_data;
+    FS_CHECK_ERROR(_fs_read_disk(fs, &old_node_data, pos, sizeof(_fs_node_t)));
+    
+    _fs_summary_update_node(fs, &old_node_data, -1);
+    _fs_summary_update_node(fs, node_data, 1);
+    
+    return _fs_write_metadata(fs, node_data, pos, sizeof(_fs_node_t));
+}
+
+static int _fs_write_cluster_sector(fs_t* fs, uint32_t cluster, uint32_t sector, const void* buffer)
+{
+    size_t sector_index = _fs_cluster_to_sector(fs, cluster) + sector;
+    
+    return _fs_write_metadata(fs, buffer, FS_SECTOR_POS(fs, sector_index), fs->sector_size);
+}
+
+static int _fs_zero_cluster(fs_t* fs, uint32_t cluster)
+{
+    uint8_t zeros[FS_MAX_SECTOR_SIZE];
+    memset(zeros, 0, fs->sector_size);
+    
+    for (uint32_t sector = 0; sector < fs->sectors_per_cluster; sector++)
+    {
+        FS_CHECK_ERROR(_fs_write_cluster_sector(fs, cluster, sector, zeros));
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_write_metadata(fs_t* fs, const void* buffer, size_t position, size_t size)
+{
+    // allocation table, nodes and directories, with journal they reach the disk only through it
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_write(fs, buffer, position, size, 1);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return error;
+}
+
+static int _fs_write_disk(fs_t* fs, const void* buffer, size_t position, size_t size)
+{
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_write(fs, buffer, position, size, 0);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return error;
+}
+
+static int _fs_write_disk_raw(fs_t* fs, const void* buffer, size_t position, size_t size)
+{
+    _fs_disk_lock(fs);
+    int error = fs->operations.write(fs->state, buffer, position, size);
+    _fs_disk_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_write_disk_run(fs_t* fs, const void* buffer, size_t position, size_t size)
+{
+    if (size < 2 * fs->sector_size) return _fs_write_disk(fs, buffer, position, size);
+    
+    const uint8_t* byte_buffer = (const uint8_t*)buffer;
+    size_t end = position + size;
+    size_t head = position % fs->sector_size;
+    size_t tail = end % fs->sector_size;
+    size_t middle_start = head ? position - head + fs->sector_size : position;
+    size_t middle_end = end - tail;
+    
+    // partial sectors are merged in cache first, then written together with middle part in one request
+    uint8_t head_data[FS_MAX_SECTOR_SIZE];
+    uint8_t tail_data[FS_MAX_SECTOR_SIZE];
+    fs_disk_vector_t vectors[3];
+    size_t count = 0;
+    size_t disk_start = middle_start;
+    
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = FS_OK;
+    if (head)
+    {
+        error = _fs_cache_write(fs, byte_buffer, position, middle_start - position, 0);
+        if (error == FS_OK) memcpy(head_data, _fs_cache_find(fs, position / fs->sector_size)->data, fs->sector_size);
+        
+        vectors[count].buffer = head_data;
+        vectors[count].size = fs->sector_size;
+        count++;
+        disk_start = middle_start - fs->sector_size;
+    }
+    
+    if (middle_end > middle_start)
+    {
+        vectors[count].buffer = (void*)(byte_buffer + (middle_start - position));
+        vectors[count].size = middle_end - middle_start;
+        count++;
+    }
+    
+    if (tail)
+    {
+        if (error == FS_OK) error = _fs_cache_write(fs, byte_buffer + (middle_end - position), middle_end, tail, 0);
+        if (error == FS_OK) memcpy(tail_data, _fs_cache_find(fs, middle_end / fs->sector_size)->data, fs->sector_size);
+        
+        vectors[count].buffer = tail_data;
+        vectors[count].size = fs->sector_size;
+        count++;
+    }
+    
+    // cached copies of overwritten sectors are dropped, so their write back can not overtake the request
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (!entry->is_valid) continue;
+        
+        size_t sector_pos = FS_SECTOR_POS(fs, (size_t)entry->sector);
+        if (sector_pos >= middle_start && sector_pos < middle_end) entry->is_valid = 0;
+    }
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    if (error != FS_OK) return error;
+    
+    // disk is written without holding the cache, other writers of the same file are excluded by node lock
+    FS_CHECK_ERROR(_fs_write_disk_vector(fs, vectors, count, disk_start));
+    
+    // partial sectors in cache hold the same data as the disk now
+    FS_MUTEX_LOCK(fs, cache_lock);
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (!entry->is_valid) continue;
+        
+        if ((head && entry->sector == position / fs->sector_size) || (tail && entry->sector == middle_end / fs->sector_size)) entry->is_dirty = 0;
+    }
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return FS_OK;
+}
+
+static int _fs_write_disk_vector(fs_t* fs, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    if (count == 1) return _fs_write_disk_raw(fs, vectors[0].buffer, position, vectors[0].size);
+    
+    if (fs->operations.writev != NULL)
+    {
+        _fs_disk_lock(fs);
+        int error = fs->operations.writev(fs->state, vectors, count, position);
+        _fs_disk_unlock(fs);
+        
+        return error;
+    }
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(_fs_write_disk_raw(fs, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_read_state(fs_t* fs, uint32_t cluster, uint32_t* result_state)
+{
+    size_t pos = _fs_cluster_state_pos(fs, cluster);
+    
+    return _fs_read_disk(fs, result_state, pos, sizeof(uint32_t));
+}
+
+static int _fs_read_refs(fs_t* fs, uint32_t cluster, uint16_t* result_refs)
+{
+    // references other than the first one, clusters are not shared without reference count table
+    *result_refs = 0;
+    if (fs->refs_sectors_count == 0) return FS_OK;
+    
+    return _fs_read_disk(fs, result_refs, _fs_cluster_refs_pos(fs, cluster), sizeof(uint16_t));
+}
+
+static int _fs_read_node(fs_t* fs, uint32_t node_number, _fs_node_t* node_data)
+{
+    size_t pos = _fs_node_pos(fs, node_number);
+    
+    return _fs_read_disk(fs, node_data, pos, sizeof(_fs_node_t));
+}
+
+static int _fs_read_cluster_sector(fs_t* fs, uint32_t cluster, uint32_t sector, void* buffer)
+{
+    size_t sector_index = _fs_cluster_to_sector(fs, cluster) + sector;
+    
+    return _fs_read_disk(fs, buffer, FS_SECTOR_POS(fs, sector_index), fs->sector_size);
+}
+
+static int _fs_read_disk(fs_t* fs, void* buffer, size_t position, size_t size)
+{
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_read(fs, buffer, position, size);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return error;
+}
+
+static int _fs_read_disk_raw(fs_t* fs, void* buffer, size_t position, size_t size)
+{
+    _fs_disk_lock(fs);
+    int error = fs->operations.read(fs->state, buffer, position, size);
+    _fs_disk_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_map_disk(fs_t* fs, const void** result_address, size_t position, size_t size)
+{
+    // disk content of sectors modified in cache is outdated, they are written back first
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_write_back(fs, (uint32_t)(position / fs->sector_size), (uint32_t)((position + size + fs->sector_size - 1) / fs->sector_size));
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    if (error != FS_OK) return error;
+    
+    _fs_disk_lock(fs);
+    error = fs->operations.map(fs->state, result_address, position, size);
+    _fs_disk_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_read_disk_run(fs_t* fs, void* buffer, size_t position, size_t size)
+{
+    if (size < 2 * fs->sector_size) return _fs_read_disk(fs, buffer, position, size);
+    
+    uint8_t* byte_buffer = (uint8_t*)buffer;
+    size_t end = position + size;
+    size_t head = position % fs->sector_size;
+    size_t tail = end % fs->sector_size;
+    size_t middle_start = head ? position - head + fs->sector_size : position;
+    size_t middle_end = end - tail;
+    uint32_t head_sector = (uint32_t)(position / fs->sector_size);
+    uint32_t tail_sector = (uint32_t)(middle_end / fs->sector_size);
+    
+    // partial sectors which are not cached yet are read together with middle part in one request
+    uint8_t head_data[FS_MAX_SECTOR_SIZE];
+    uint8_t tail_data[FS_MAX_SECTOR_SIZE];
+    fs_disk_vector_t vectors[3];
+    size_t count = 0;
+    size_t disk_start = middle_start;
+    uint8_t read_head = 0;
+    uint8_t read_tail = 0;
+    
+    // disk content of sectors modified in cache is outdated, they are written back first
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_write_back(fs, (uint32_t)(middle_start / fs->sector_size), tail_sector);
+    if (head)
+    {
+        fs_cache_entry_t* entry = _fs_cache_find(fs, head_sector);
+        if (entry != NULL) memcpy(byte_buffer, entry->data + head, middle_start - position);
+        read_head = entry == NULL;
+    }
+    if (tail)
+    {
+        fs_cache_entry_t* entry = _fs_cache_find(fs, tail_sector);
+        if (entry != NULL) memcpy(byte_buffer + (middle_end - position), entry->data, tail);
+        read_tail = entry == NULL;
+    }
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    if (error != FS_OK) return error;
+    
+    if (read_head)
+    {
+        vectors[count].buffer = head_data;
+        vectors[count].size = fs->sector_size;
+        count++;
+        disk_start = middle_start - fs->sector_size;
+    }
+    
+    if (middle_end > middle_start)
+    {
+        vectors[count].buffer = byte_buffer + (middle_start - position);
+        vectors[count].size = middle_end - middle_start;
+        count++;
+    }
+    
+    if (read_tail)
+    {
+        vectors[count].buffer = tail_data;
+        vectors[count].size = fs->sector_size;
+        count++;
+    }
+    
+    // disk is read without holding the cache, writers of the same file are excluded by node lock
+    FS_CHECK_ERROR(_fs_read_disk_vector(fs, vectors, count, disk_start));
+    
+    if (read_head) memcpy(byte_buffer, head_data + head, middle_start - position);
+    if (read_tail) memcpy(byte_buffer + (middle_end - position), tail_data, tail);
+    
+    // partial sectors are kept in cache for following reads
+    FS_MUTEX_LOCK(fs, cache_lock);
+    if (read_head) error = _fs_cache_fill(fs, head_sector, head_data);
+    if (read_tail && error == FS_OK) error = _fs_cache_fill(fs, tail_sector, tail_data);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return error;
+}
+
+static int _fs_read_disk_vector(fs_t* fs, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    if (count == 1) return _fs_read_disk_raw(fs, vectors[0].buffer, position, vectors[0].size);
+    
+    if (fs->operations.readv != NULL)
+    {
+        _fs_disk_lock(fs);
+        int error = fs->operations.readv(fs->state, vectors, count, position);
+        _fs_disk_unlock(fs);
+        
+        return error;
+    }
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(_fs_read_disk_raw(fs, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_sync_disk(fs_t* fs)
+{
+    if (fs->operations.sync == NULL) return FS_OK;
+    
+    _fs_disk_lock(fs);
+    int error = fs->operations.sync(fs->state);
+    _fs_disk_unlock(fs);
+    
+    return error;
+}
+
+static int _fs_allocation_init(fs_t* fs, uint8_t scan_table, uint8_t rebuild_summary)
+{
+    uint32_t words_count = FS_BITMAP_WORDS(fs->clusters_count);
+    
+    fs->node_index = NULL;
+    fs->node_index_count = 0;
+    fs->node_index_capacity = 0;
+    fs->node_index_table = NULL;
+    
+    fs->free_bitmap = (uint32_t*)calloc(words_count, sizeof(uint32_t));
+    if (fs->free_bitmap == NULL) return FS_OUT_OF_MEMORY;
+    
+    fs->free_cursor = 0;
+    fs->free_clusters = 0;
+    
+    if (!scan_table)
+    {
+        // freshly formatted disk - every cluster is free
+        memset(fs->free_bitmap, 0xFF, words_count * sizeof(uint32_t));
+        if (fs->clusters_count % 32 != 0)
+        {
+            fs->free_bitmap[words_count - 1] = ((uint32_t)1 << (fs->clusters_count % 32)) - 1;
+        }
+        fs->free_clusters = fs->clusters_count;
+        
+        return FS_OK;
+    }
+    
+    return _fs_scan(fs, 1, rebuild_summary);
+}
+
+static int _fs_allocation_load(fs_t* fs)
+{
+    if (fs->free_bitmap != NULL) return FS_OK;
+    
+    return _fs_allocation_init(fs, 1, 0);
+}
+
+static void _fs_allocation_free(fs_t* fs)
+{
+    free(fs->free_bitmap);
+    fs->free_bitmap = NULL;
+    
+    free(fs->node_index);
+    fs->node_index = NULL;
+    fs->node_index_count = 0;
+    fs->node_index_capacity = 0;
+    free(fs->node_index_table);
+    fs->node_index_table = NULL;
+}
+
+static void _fs_bitmap_update(fs_t* fs, uint32_t cluster, uint32_t new_state)
+{
+    // not loaded yet, it will be built from the allocation table including this change
+    if (fs->free_bitmap == NULL) return;
+    
+    uint32_t* word = &fs->free_bitmap[cluster / 32];
+    uint32_t bit = (uint32_t)1 << (cluster % 32);
+    
+    if (new_state == FS_CLUSTER_EMPTY)
+    {
+        // with journal, cluster is reused after commit, so its contents stay valid for the committed state
+        if (fs->journal_sectors_count != 0 && _fs_journal_free_cluster(fs, cluster) == FS_OK) return;
+        
+        *word |= bit;
+    }
+    else
+    {
+        *word &= ~bit;
+    }
+}
+
+static uint32_t _fs_bitmap_next_free(fs_t* fs, uint32_t from)
+{
+    // returns clusters_count if there is no free cluster at or after from
+    uint32_t words_count = FS_BITMAP_WORDS(fs->clusters_count);
+    uint32_t word_index = from / 32;
+    if (word_index >= words_count) return fs->clusters_count;
+    
+    uint32_t word = fs->free_bitmap[word_index] & (~(uint32_t)0 << (from % 32));
+    while (word == 0)
+    {
+        if (++word_index == words_count) return fs->clusters_count;
+        word = fs->free_bitmap[word_index];
+    }
+    
+    return word_index * 32 + _fs_lowest_bit(word);
+}
+
+static uint32_t _fs_bitmap_run_length(fs_t* fs, uint32_t start, uint32_t max)
+{
+    uint32_t length = 0;
+    uint32_t cluster = start;
+    while (length < max && cluster < fs->clusters_count)
+    {
+        uint32_t word = fs->free_bitmap[cluster / 32];
+        if (cluster % 32 == 0 && word == ~(uint32_t)0)
+        {
+            // whole word of free clusters
+            length += 32;
+            cluster += 32;
+            continue;
+        }
+        
+        if (!(word & ((uint32_t)1 << (cluster % 32)))) break;
+        length++;
+        cluster++;
+    }
+    
+    if (length > max) length = max;
+    if (start + length > fs->clusters_count) length = fs->clusters_count - start;
+    
+    return length;
+}
+
+static uint32_t _fs_lowest_bit(uint32_t value)
+{
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctz(value);
+#else
+    uint32_t bit = 0;
+    while (!(value & 1))
+    {
+        value >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static int _fs_node_index_add(fs_t* fs, uint32_t cluster, uint8_t used_count, uint8_t is_mask_loaded)
+{
+    if (fs->node_index_count == fs->node_index_capacity)
+    {
+        uint32_t new_capacity = fs->node_index_capacity == 0 ? 16 : fs->node_index_capacity * 2;
+        uint32_t* new_table = (uint32_t*)calloc((size_t)new_capacity * 2, sizeof(uint32_t));
+        if (new_table == NULL) return FS_OUT_OF_MEMORY;
+        void* new_index = realloc(fs->node_index, new_capacity * sizeof(_fs_node_slots_t));
+        if (new_index == NULL)
+        {
+            free(new_table);
+            return FS_OUT_OF_MEMORY;
+        }
+        
+        fs->node_index = new_index;
+        fs->node_index_capacity = new_capacity;
+        free(fs->node_index_table);
+        fs->node_index_table = new_table;
+        
+        // table size depends on capacity, every position is hashed again
+        _fs_node_slots_t* index = (_fs_node_slots_t*)fs->node_index;
+        for (uint32_t position = 0; position < fs->node_index_count; position++)
+        {
+            fs->node_index_table[_fs_node_index_find(fs, index[position].cluster)] = position + 1;
+        }
+    }
+    
+    uint32_t position = fs->node_index_count++;
+    _fs_node_slots_t* slots = &((_fs_node_slots_t*)fs->node_index)[position];
+    slots->cluster = cluster;
+    slots->used_count = used_count;
+    
+    // loaded mask is known only for empty and full clusters
+    memset(slots->used_mask, 0, sizeof(slots->used_mask));
+    if (is_mask_loaded && used_count == fs->nodes_in_cluster)
+    {
+        for (uint32_t i = 0; i < fs->nodes_in_cluster; i++) slots->used_mask[i / 32] |= (uint32_t)1 << (i % 32);
+    }
+    slots->is_mask_loaded = is_mask_loaded;
+    fs->node_index_table[_fs_node_index_find(fs, cluster)] = position + 1;
+    
+    return FS_OK;
+}
+
+static void _fs_node_index_remove(fs_t* fs, uint32_t position)
+{
+    _fs_node_slots_t* index = (_fs_node_slots_t*)fs->node_index;
+    uint32_t* table = fs->node_index_table;
+    uint32_t mask = fs->node_index_capacity * 2 - 1;
+    
+    // linear probing without tombstones: following entries move back to the hole unless it is before their hash slot
+    uint32_t hole = _fs_node_index_find(fs, index[position].cluster);
+    for (uint32_t i = (hole + 1) & mask; table[i] != 0; i = (i + 1) & mask)
+    {
+        uint32_t home = _fs_node_index_hash(fs, index[table[i] - 1].cluster);
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole] = 0;
+    
+    uint32_t last = --fs->node_index_count;
+    if (position != last)
+    {
+        index[position] = index[last];
+        table[_fs_node_index_find(fs, index[position].cluster)] = position + 1;
+    }
+}
+
+static uint32_t _fs_node_index_hash(fs_t* fs, uint32_t cluster)
+{
+    return (cluster * 2654435761u) & (fs->node_index_capacity * 2 - 1);
+}
+
+static uint32_t _fs_node_index_find(fs_t* fs, uint32_t cluster)
+{
+    // table slot holding the cluster or empty slot where it would be added
+    _fs_node_slots_t* index = (_fs_node_slots_t*)fs->node_index;
+    uint32_t mask = fs->node_index_capacity * 2 - 1;
+    uint32_t i = _fs_node_index_hash(fs, cluster);
+    while (fs->node_index_table[i] != 0 && index[fs->node_index_table[i] - 1].cluster != cluster) i = (i + 1) & mask;
+    
+    return i;
+}
+
+static int _fs_node_index_load_mask(fs_t* fs, _fs_node_slots_t* slots)
+{
+    if (slots->is_mask_loaded) return FS_OK;
+    
+    _fs_node_t nodes[FS_NODES_MAX_IN_CLUSTER];
+    size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, slots->cluster));
+    FS_CHECK_ERROR(_fs_read_disk(fs, nodes, disk_pos, fs->nodes_in_cluster * sizeof(_fs_node_t)));
+    
+    memset(slots->used_mask, 0, sizeof(slots->used_mask));
+    for (uint32_t i = 0; i < fs->nodes_in_cluster; i++)
+    {
+        if (nodes[i].flags & FS_NODE_FLAGS_INUSE) slots->used_mask[i / 32] |= (uint32_t)1 << (i % 32);
+    }
+    slots->is_mask_loaded = 1;
+    
+    return FS_OK;
+}
+
+static void _fs_dentry_init(fs_t* fs)
+{
+    memset(fs->dentries, 0, sizeof(fs->dentries));
+}
+
+static fs_dentry_t* _fs_dentry_slot(fs_t* fs, uint32_t parent_node, const char* name)
+{
+    // FNV-1a hash of parent node and name, cache is direct mapped
+    uint32_t hash = 2166136261u ^ parent_node;
+    hash *= 16777619u;
+    while (*name)
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    
+    return &fs->dentries[hash % FS_DENTRY_CACHE_SIZE];
+}
+
+static void _fs_dentry_store(fs_t* fs, uint32_t parent_node, const char* name, uint8_t status, uint32_t node)
+{
+    FS_MUTEX_LOCK(fs, dentry_lock);
+    fs_dentry_t* dentry = _fs_dentry_slot(fs, parent_node, name);
+    
+    dentry->parent_node = parent_node;
+    dentry->node = node;
+    dentry->status = status;
+    strcpy(dentry->name, name);
+    FS_MUTEX_UNLOCK(fs, dentry_lock);
+}
+
+static void _fs_dentry_invalidate(fs_t* fs, uint32_t parent_node, const char* name)
+{
+    FS_MUTEX_LOCK(fs, dentry_lock);
+    fs_dentry_t* dentry = _fs_dentry_slot(fs, parent_node, name);
+    
+    if (dentry->parent_node == parent_node && strcmp(dentry->name, name) == 0) dentry->status = 0;
+    FS_MUTEX_UNLOCK(fs, dentry_lock);
+}
+
+static void _fs_dentry_invalidate_node(fs_t* fs, uint32_t node)
+{
+    FS_MUTEX_LOCK(fs, dentry_lock);
+    for (size_t i = 0; i < FS_DENTRY_CACHE_SIZE; i++)
+    {
+        fs_dentry_t* dentry = &fs->dentries[i];
+        if (dentry->status == 0) continue;
+        
+        if (dentry->parent_node == node || (dentry->status != FS_FIND_NOT_EXISTS && dentry->node == node)) dentry->status = 0;
+    }
+    FS_MUTEX_UNLOCK(fs, dentry_lock);
+}
+
+static int _fs_summary_write(fs_t* fs, uint8_t is_clean)
+{
+    _fs_summary_t summary;
+    summary.magic = FS_SUMMARY_MAGIC;
+    summary.is_clean = is_clean;
+    summary.free_clusters = fs->free_clusters;
+    summary.node_clusters = fs->node_clusters;
+    summary.nodes = fs->nodes;
+    summary.files_size = fs->files_size;
+    summary.dir_structures_size = fs->dir_structures_size;
+    
+    return _fs_write_metadata(fs, &summary, FS_SUMMARY_POS, sizeof(_fs_summary_t));
+}
+
+static int _fs_summary_mark_dirty(fs_t* fs)
+{
+    // journal commits summary together with changes, so it never covers a change it does not include
+    if (fs->journal_sectors_count != 0) return FS_OK;
+    
+    if (fs->is_summary_dirty) return FS_OK;
+    fs->is_summary_dirty = 1;
+    
+    // dirty mark has to reach the disk before any change it covers
+    FS_CHECK_ERROR(_fs_summary_write(fs, 0));
+    FS_CHECK_ERROR(_fs_cache_flush(fs));
+    
+    return _fs_sync_disk(fs);
+}
+
+static int _fs_summary_commit(fs_t* fs)
+{
+    if (fs->journal_sectors_count != 0)
+    {
+        FS_MUTEX_LOCK(fs, alloc_lock);
+        int error = _fs_journal_commit_locked(fs, 1);
+        FS_MUTEX_UNLOCK(fs, alloc_lock);
+        
+        return error;
+    }
+    
+    FS_CHECK_ERROR(_fs_cache_flush(fs));
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int error = FS_OK;
+    if (fs->is_summary_dirty)
+    {
+        // summary may be marked clean only after everything it covers is on the disk
+        error = _fs_sync_disk(fs);
+        if (error == FS_OK) error = _fs_summary_write(fs, 1);
+        if (error == FS_OK) error = _fs_cache_flush(fs);
+        if (error == FS_OK) fs->is_summary_dirty = 0;
+    }
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    if (error != FS_OK) return error;
+    
+    return _fs_sync_disk(fs);
+}
+
+static void _fs_summary_update_state(fs_t* fs, uint32_t old_state, uint32_t new_state)
+{
+    uint8_t was_node_cluster = old_state >= FS_CLUSTER_NODE_BEGIN && old_state <= FS_CLUSTER_NODE_FULL(fs);
+    uint8_t is_node_cluster = new_state >= FS_CLUSTER_NODE_BEGIN && new_state <= FS_CLUSTER_NODE_FULL(fs);
+    
+    if (old_state == FS_CLUSTER_EMPTY && new_state != FS_CLUSTER_EMPTY) fs->free_clusters--;
+    else if (old_state != FS_CLUSTER_EMPTY && new_state == FS_CLUSTER_EMPTY) fs->free_clusters++;
+    
+    if (!was_node_cluster && is_node_cluster) fs->node_clusters++;
+    else if (was_node_cluster && !is_node_cluster) fs->node_clusters--;
+}
+
+static void _fs_summary_update_node(fs_t* fs, const _fs_node_t* node_data, int8_t sign)
+{
+    if (!(node_data->flags & FS_NODE_FLAGS_INUSE)) return;
+    
+    fs->nodes += sign;
+    
+    if (node_data->type == FS_NODE_TYPE_FILE)
+    {
+        fs->files_size += sign * (int64_t)node_data->size;
+    }
+    else if (node_data->type == FS_NODE_TYPE_DIR)
+    {
+        fs->dir_structures_size += sign * (int64_t)node_data->size;
+    }
+}
+
+static int _fs_scan(fs_t* fs, uint8_t build_allocation, uint8_t count_nodes)
+{
+    // workers read the disk directly, so it has to be up to date
+    FS_CHECK_ERROR(_fs_cache_flush(fs));
+    
+    _fs_scan_worker_t workers[FS_SCAN_MAX_THREADS];
+    uint32_t threads = _fs_scan_threads(fs);
+    
+    // ranges are aligned to table sectors, so workers never share bitmap words or table sectors
+    uint32_t states_in_sector = FS_STATES_IN_SECTOR(fs);
+    uint32_t sectors_per_worker = (fs->table_sectors_count + threads - 1) / threads;
+    
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        _fs_scan_worker_t* worker = &workers[i];
+        memset(worker, 0, sizeof(_fs_scan_worker_t));
+        worker->fs = fs;
+        worker->build_allocation = build_allocation;
+        worker->count_nodes = count_nodes;
+        
+        uint64_t first_cluster = (uint64_t)i * sectors_per_worker * states_in_sector;
+        uint64_t end_cluster = first_cluster + (uint64_t)sectors_per_worker * states_in_sector;
+        worker->first_cluster = first_cluster < fs->clusters_count ? (uint32_t)first_cluster : fs->clusters_count;
+        worker->end_cluster = end_cluster < fs->clusters_count ? (uint32_t)end_cluster : fs->clusters_count;
+    }
+    
+#if FS_SCAN_MAX_THREADS > 1
+    pthread_t thread_ids[FS_SCAN_MAX_THREADS];
+    uint32_t started = 1;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&thread_ids[started], NULL, &_fs_scan_worker, &workers[started]) != 0) break;
+    }
+    
+    _fs_scan_worker(&workers[0]);
+    
+    // ranges of threads which could not be started are scanned here
+    for (uint32_t i = started; i < threads; i++) _fs_scan_worker(&workers[i]);
+    for (uint32_t i = 1; i < started; i++) pthread_join(thread_ids[i], NULL);
+#else
+    _fs_scan_worker(&workers[0]);
+#endif
+    
+    // merge results in order of clusters
+    int error = FS_OK;
+    if (build_allocation) fs->free_clusters = 0;
+    if (count_nodes)
+    {
+        fs->node_clusters = 0;
+        fs->nodes = 0;
+        fs->files_size = 0;
+        fs->dir_structures_size = 0;
+    }
+    
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        _fs_scan_worker_t* worker = &workers[i];
+        if (error == FS_OK) error = worker->error;
+        
+        if (build_allocation)
+        {
+            fs->free_clusters += worker->free_clusters;
+            
+            for (uint32_t n = 0; n < worker->node_index_count && error == FS_OK; n++)
+            {
+                _fs_node_slots_t* slots = &worker->node_index[n];
+                error = _fs_node_index_add(fs, slots->cluster, slots->used_count, 0);
+            }
+        }
+        
+        if (count_nodes)
+        {
+            fs->node_clusters += worker->node_clusters;
+            fs->nodes += worker->nodes;
+            fs->files_size += worker->files_size;
+            fs->dir_structures_size += worker->dir_structures_size;
+        }
+        
+        free(worker->node_index);
+    }
+    
+    return error;
+}
+
+static void* _fs_scan_worker(void* argument)
+{
+    _fs_scan_worker_t* worker = (_fs_scan_worker_t*)argument;
+    
+    worker->error = _fs_scan_range(worker);
+    
+    return NULL;
+}
+
+static int _fs_scan_range(_fs_scan_worker_t* worker)
+{
+    fs_t* fs = worker->fs;
+    if (worker->first_cluster >= worker->end_cluster) return FS_OK;
+    
+    uint32_t states_in_sector = FS_STATES_IN_SECTOR(fs);
+    uint32_t batch_sectors = FS_SCAN_BATCH_SIZE / fs->sector_size;
+    if (batch_sectors == 0) batch_sectors = 1;
+    
+    uint32_t* states = (uint32_t*)malloc((size_t)batch_sectors * fs->sector_size);
+    if (states == NULL) return FS_OUT_OF_MEMORY;
+    
+    int error = FS_OK;
+    uint32_t cluster = worker->first_cluster;
+    while (cluster < worker->end_cluster && error == FS_OK)
+    {
+        // several table sectors with single request
+        uint32_t sector = fs->table_sector_start + cluster / states_in_sector;
+        uint32_t count = worker->end_cluster - cluster;
+        if (count > batch_sectors * states_in_sector) count = batch_sectors * states_in_sector;
+        uint32_t sectors = (count + states_in_sector - 1) / states_in_sector;
+        
+        error = _fs_read_disk_raw(fs, states, FS_SECTOR_POS(fs, sector), (size_t)sectors * fs->sector_size);
+        
+        for (uint32_t i = 0; i < count && error == FS_OK; i++, cluster++)
+        {
+            uint32_t cluster_state = states[i];
+            if (cluster_state == FS_CLUSTER_EMPTY)
+            {
+                if (worker->build_allocation)
+                {
+                    fs->free_bitmap[cluster / 32] |= (uint32_t)1 << (cluster % 32);
+                    worker->free_clusters++;
+                }
+            }
+            else if (cluster_state >= FS_CLUSTER_NODE_BEGIN && cluster_state <= FS_CLUSTER_NODE_FULL(fs))
+            {
+                if (worker->build_allocation && cluster_state < FS_CLUSTER_NODE_FULL(fs))
+                {
+                    // slots mask is loaded from the cluster when it is needed for the first time
+                    if (worker->node_index_count == worker->node_index_capacity)
+                    {
+                        uint32_t new_capacity = worker->node_index_capacity == 0 ? 16 : worker->node_index_capacity * 2;
+                        _fs_node_slots_t* new_index = (_fs_node_slots_t*)realloc(worker->node_index, new_capacity * sizeof(_fs_node_slots_t));
+                        if (new_index == NULL)
+                        {
+                            error = FS_OUT_OF_MEMORY;
+                            break;
+                        }
+                        
+                        worker->node_index = new_index;
+                        worker->node_index_capacity = new_capacity;
+                    }
+                    
+                    _fs_node_slots_t* slots = &worker->node_index[worker->node_index_count++];
+                    slots->cluster = cluster;
+                    slots->used_count = cluster_state & 0xFF;
+                }
+                
+                if (worker->count_nodes)
+                {
+                    worker->node_clusters++;
+                    
+                    _fs_node_t nodes[FS_NODES_MAX_IN_CLUSTER];
+                    size_t disk_pos = FS_SECTOR_POS(fs, _fs_cluster_to_sector(fs, cluster));
+                    error = _fs_read_disk_raw(fs, nodes, disk_pos, fs->nodes_in_cluster * sizeof(_fs_node_t));
+                    
+                    for (size_t ni = 0; ni < fs->nodes_in_cluster && error == FS_OK; ni++)
+                    {
+                        _fs_node_t* node = &nodes[ni];
+                        if (!(node->flags & FS_NODE_FLAGS_INUSE)) continue;
+                        
+                        worker->nodes++;
+                        if (node->type == FS_NODE_TYPE_FILE)
+                        {
+                            worker->files_size += node->size;
+                        }
+                        else if (node->type == FS_NODE_TYPE_DIR)
+                        {
+                            worker->dir_structures_size += node->size;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    free(states);
+    
+    return error;
+}
+
+static uint32_t _fs_scan_threads(fs_t* fs)
+{
+#if FS_SCAN_MAX_THREADS > 1
+    if (!fs->operations.is_thread_safe) return 1;
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpus > 0 ? (uint32_t)cpus : 1;
+    if (threads > FS_SCAN_MAX_THREADS) threads = FS_SCAN_MAX_THREADS;
+    
+    // small tables are not worth starting threads
+    uint32_t useful_threads = fs->clusters_count / FS_SCAN_MIN_CLUSTERS + 1;
+    if (threads > useful_threads) threads = useful_threads;
+    if (threads > fs->table_sectors_count) threads = fs->table_sectors_count;
+    
+    return threads > 0 ? threads : 1;
+#else
+    (void)fs;
+    return 1;
+#endif
+}
+
+static void _fs_journal_init(fs_t* fs, uint32_t sector_start, uint32_t sectors_count)
+{
+    fs->journal_sector_start = sector_start;
+    fs->journal_sectors_count = sectors_count;
+    fs->journal_sequence = 1;
+    fs->journal_held_sectors = NULL;
+    fs->journal_held_data = NULL;
+    fs->journal_held_count = 0;
+    fs->journal_held_capacity = 0;
+    fs->journal_freed = NULL;
+    fs->journal_freed_count = 0;
+    fs->journal_freed_capacity = 0;
+}
+
+static int _fs_journal_check(fs_t* fs, int error)
+{
+    // called when operation ends, commits when transaction fills half of the journal
+    // or when clusters waiting for commit are needed; never in the middle of an operation,
+    // which fails with FS_FULL instead, so the next one finds the clusters free
+    if (fs->journal_sectors_count == 0) return error;
+    
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    uint8_t is_batch = fs->batch_depth != 0;
+    uint8_t is_due = !is_batch && fs->journal_freed_count != 0 && (error == FS_FULL || 2 * fs->journal_freed_count > fs->free_clusters);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    
+    // batch is committed when it ends, unless it does not fit in the journal
+    FS_MUTEX_LOCK(fs, cache_lock);
+    uint32_t changed_count = _fs_journal_changed_count(fs);
+    if ((is_batch ? changed_count : 2 * changed_count) >= _fs_journal_capacity(fs)) is_due = 1;
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    if (!is_due) return error;
+    
+    // no operation is in progress while volume is held exclusively
+    _fs_volume_lock(fs, 1);
+    FS_MUTEX_LOCK(fs, alloc_lock);
+    int commit_error = _fs_journal_commit_locked(fs, 1);
+    FS_MUTEX_UNLOCK(fs, alloc_lock);
+    _fs_volume_unlock(fs);
+    
+    return error != FS_OK ? error : commit_error;
+}
+
+static int _fs_journal_commit_locked(fs_t* fs, uint8_t is_complete)
+{
+    FS_MUTEX_LOCK(fs, cache_lock);
+    uint32_t changed_count = _fs_journal_changed_count(fs);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    // summary is committed together with changes it covers, it is clean only if no change is in progress
+    uint8_t has_summary = changed_count != 0 || fs->is_summary_dirty;
+    if (has_summary) FS_CHECK_ERROR(_fs_summary_write(fs, is_complete));
+    
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_journal_commit_cached(fs);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    if (error != FS_OK) return error;
+    
+    if (has_summary) fs->is_summary_dirty = !is_complete;
+    
+    // clusters freed by committed changes may be reused now
+    _fs_journal_release_freed(fs);
+    
+    return FS_OK;
+}
+
+static int _fs_journal_commit_cached(fs_t* fs)
+{
+    // file contents reach the disk before metadata pointing to them
+    FS_CHECK_ERROR(_fs_cache_write_back(fs, 0, 0xFFFFFFFF));
+    
+    uint32_t count = _fs_journal_changed_count(fs);
+    if (count == 0) return _fs_sync_disk(fs);
+    
+    _fs_journal_block_t* blocks = (_fs_journal_block_t*)malloc(count * sizeof(_fs_journal_block_t));
+    if (blocks == NULL) return FS_OUT_OF_MEMORY;
+    
+    uint32_t index = 0;
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (!entry->is_valid || !entry->is_dirty || !entry->is_metadata) continue;
+        
+        blocks[index].sector = entry->sector;
+        blocks[index].data = entry->data;
+        index++;
+    }
+    
+    for (uint32_t i = 0; i < fs->journal_held_count; i++)
+    {
+        blocks[index].sector = fs->journal_held_sectors[i];
+        blocks[index].data = fs->journal_held_data + (size_t)i * fs->sector_size;
+        index++;
+    }
+    
+    // sorted sectors are written in place in runs, bootstrap sector with summary comes first
+    qsort(blocks, count, sizeof(_fs_journal_block_t), _fs_journal_compare_blocks);
+    
+    int error = FS_OK;
+    uint32_t capacity = _fs_journal_capacity(fs);
+    if (count <= capacity)
+    {
+        error = _fs_journal_write(fs, blocks, count);
+    }
+    else if (blocks[0].sector != 0)
+    {
+        // parts can be told apart only by summary in bootstrap sector, which is committed with every change
+        error = FS_INVALID_PARAMETER;
+    }
+    else
+    {
+        // too many changes for one transaction, every part carries bootstrap sector
+        // and summary is marked clean only by the last one
+        char bootstrap_data[FS_MAX_SECTOR_SIZE];
+        uint32_t is_clean = 0;
+        memcpy(bootstrap_data, blocks[0].data, fs->sector_size);
+        memcpy(bootstrap_data + FS_SUMMARY_POS + offsetof(_fs_summary_t, is_clean), &is_clean, sizeof(uint32_t));
+        
+        _fs_journal_block_t* part = (_fs_journal_block_t*)malloc(capacity * sizeof(_fs_journal_block_t));
+        if (part == NULL) error = FS_OUT_OF_MEMORY;
+        
+        uint32_t done = 1;
+        while (error == FS_OK && count - done + 1 > capacity)
+        {
+            part[0].sector = 0;
+            part[0].data = bootstrap_data;
+            memcpy(part + 1, blocks + done, (capacity - 1) * sizeof(_fs_journal_block_t));
+            
+            error = _fs_journal_write(fs, part, capacity);
+            done += capacity - 1;
+        }
+        
+        if (error == FS_OK)
+        {
+            blocks[done - 1] = blocks[0];
+            error = _fs_journal_write(fs, blocks + done - 1, count - done + 1);
+        }
+        
+        free(part);
+    }
+    
+    free(blocks);
+    if (error != FS_OK) return error;
+    
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (entry->is_valid && entry->is_metadata) entry->is_dirty = 0;
+    }
+    fs->journal_held_count = 0;
+    
+    return FS_OK;
+}
+
+static int _fs_journal_write(fs_t* fs, const _fs_journal_block_t* blocks, uint32_t count)
+{
+    uint32_t entries = FS_JOURNAL_ENTRIES_IN_DESCRIPTOR(fs);
+    fs_disk_vector_t* vectors = (fs_disk_vector_t*)malloc((entries + 1) * sizeof(fs_disk_vector_t));
+    if (vectors == NULL) return FS_OUT_OF_MEMORY;
+    
+    // previous transaction may be overwritten only when its sectors are in place on the disk
+    int error = _fs_sync_disk(fs);
+    
+    uint32_t descriptor[FS_MAX_SECTOR_SIZE / sizeof(uint32_t)];
+    _fs_journal_descriptor_t* header = (_fs_journal_descriptor_t*)descriptor;
+    uint32_t* sectors = descriptor + sizeof(_fs_journal_descriptor_t) / sizeof(uint32_t);
+    
+    // every descriptor is followed by contents of sectors it lists
+    size_t position = FS_SECTOR_POS(fs, fs->journal_sector_start);
+    uint32_t checksum = FS_CHECKSUM_BASIS;
+    for (uint32_t done = 0; error == FS_OK && done < count; )
+    {
+        uint32_t chunk = count - done;
+        if (chunk > entries) chunk = entries;
+        
+        memset(descriptor, 0, fs->sector_size);
+        header->magic = FS_JOURNAL_DESCRIPTOR_MAGIC;
+        header->sequence = fs->journal_sequence;
+        header->count = chunk;
+        header->is_last = done + chunk == count;
+        
+        vectors[0].buffer = descriptor;
+        vectors[0].size = fs->sector_size;
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            sectors[i] = blocks[done + i].sector;
+            vectors[i + 1].buffer = (void*)blocks[done + i].data;
+            vectors[i + 1].size = fs->sector_size;
+        }
+        
+        for (uint32_t i = 0; i <= chunk; i++) checksum = _fs_checksum(checksum, vectors[i].buffer, fs->sector_size);
+        
+        error = _fs_write_disk_vector(fs, vectors, chunk + 1, position);
+        position += FS_SECTOR_POS(fs, chunk + 1);
+        done += chunk;
+    }
+    
+    if (error == FS_OK)
+    {
+        // transaction is replayed only if commit sector matches everything written before it
+        memset(descriptor, 0, fs->sector_size);
+        _fs_journal_commit_t* commit = (_fs_journal_commit_t*)descriptor;
+        commit->magic = FS_JOURNAL_COMMIT_MAGIC;
+        commit->sequence = fs->journal_sequence;
+        commit->count = count;
+        commit->checksum = checksum;
+        
+        error = _fs_write_disk_raw(fs, descriptor, position, fs->sector_size);
+    }
+    if (error == FS_OK) error = _fs_sync_disk(fs);
+    
+    free(vectors);
+    
+    // checkpoint, sync before next transaction makes it durable
+    if (error == FS_OK) error = _fs_write_blocks(fs, blocks, count);
+    if (error == FS_OK) fs->journal_sequence++;
+    
+    return error;
+}
+
+static int _fs_journal_replay(fs_t* fs)
+{
+    // the last committed transaction stays at the beginning of the journal, applying it again is harmless
+    size_t journal_size = FS_SECTOR_POS(fs, fs->journal_sectors_count);
+    char* journal = (char*)malloc(journal_size);
+    if (journal == NULL) return FS_OUT_OF_MEMORY;
+    
+    int error = _fs_read_disk_raw(fs, journal, FS_SECTOR_POS(fs, fs->journal_sector_start), journal_size);
+    if (error != FS_OK)
+    {
+        free(journal);
+        return error;
+    }
+    
+    const _fs_journal_descriptor_t* first = (const _fs_journal_descriptor_t*)journal;
+    uint8_t is_valid = first->magic == FS_JOURNAL_DESCRIPTOR_MAGIC;
+    uint32_t sequence = first->sequence;
+    fs->journal_sequence = is_valid ? sequence + 1 : 1;
+    
+    uint32_t entries = FS_JOURNAL_ENTRIES_IN_DESCRIPTOR(fs);
+    uint32_t journal_end = fs->journal_sector_start + fs->journal_sectors_count;
+    uint32_t position = 0;
+    uint32_t total = 0;
+    uint32_t checksum = FS_CHECKSUM_BASIS;
+    while (is_valid)
+    {
+        const _fs_journal_descriptor_t* header = (const _fs_journal_descriptor_t*)(journal + FS_SECTOR_POS(fs, position));
+        if (header->magic != FS_JOURNAL_DESCRIPTOR_MAGIC || header->sequence != sequence || header->count > entries ||
+            position + header->count + 1 >= fs->journal_sectors_count)
+        {
+            is_valid = 0;
+            break;
+        }
+        
+        const uint32_t* sectors = (const uint32_t*)(header + 1);
+        for (uint32_t i = 0; i < header->count; i++)
+        {
+            if (sectors[i] >= fs->sectors_count || (sectors[i] >= fs->journal_sector_start && sectors[i] < journal_end)) is_valid = 0;
+        }
+        
+        checksum = _fs_checksum(checksum, header, FS_SECTOR_POS(fs, header->count + 1));
+        total += header->count;
+        position += header->count + 1;
+        if (header->is_last) break;
+    }
+    
+    if (is_valid)
+    {
+        // transaction interrupted before its commit sector reached the disk is ignored
+        const _fs_journal_commit_t* commit = (const _fs_journal_commit_t*)(journal + FS_SECTOR_POS(fs, position));
+        is_valid = commit->magic == FS_JOURNAL_COMMIT_MAGIC && commit->sequence == sequence && commit->count == total && commit->checksum == checksum;
+    }
+    
+    position = 0;
+    while (is_valid && error == FS_OK)
+    {
+        const _fs_journal_descriptor_t* header = (const _fs_journal_descriptor_t*)(journal + FS_SECTOR_POS(fs, position));
+        const uint32_t* sectors = (const uint32_t*)(header + 1);
+        for (uint32_t i = 0; i < header->count && error == FS_OK; i++)
+        {
+            error = _fs_write_disk_raw(fs, journal + FS_SECTOR_POS(fs, position + 1 + i), FS_SECTOR_POS(fs, (size_t)sectors[i]), fs->sector_size);
+        }
+        
+        position += header->count + 1;
+        if (header->is_last) break;
+    }
+    
+    if (is_valid && error == FS_OK) error = _fs_sync_disk(fs);
+    
+    free(journal);
+    
+    return error;
+}
+
+static uint32_t _fs_journal_capacity(fs_t* fs)
+{
+    // sectors in one transaction, it needs descriptors listing them and commit sector as well
+    uint32_t entries = FS_JOURNAL_ENTRIES_IN_DESCRIPTOR(fs);
+    uint32_t capacity = fs->journal_sectors_count - 2;
+    while (capacity + (capacity + entries - 1) / entries + 1 > fs->journal_sectors_count) capacity--;
+    
+    return capacity;
+}
+
+static uint32_t _fs_journal_changed_count(fs_t* fs)
+{
+    uint32_t count = fs->journal_held_count;
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (entry->is_valid && entry->is_dirty && entry->is_metadata) count++;
+    }
+    
+    return count;
+}
+
+static int _fs_journal_hold(fs_t* fs, uint32_t sector, const char* data)
+{
+    if (fs->journal_held_count == fs->journal_held_capacity)
+    {
+        uint32_t new_capacity = fs->journal_held_capacity == 0 ? FS_CACHE_SECTORS : fs->journal_held_capacity * 2;
+        uint32_t* new_sectors = (uint32_t*)realloc(fs->journal_held_sectors, new_capacity * sizeof(uint32_t));
+        if (new_sectors == NULL) return FS_OUT_OF_MEMORY;
+        fs->journal_held_sectors = new_sectors;
+        
+        char* new_data = (char*)realloc(fs->journal_held_data, (size_t)new_capacity * fs->sector_size);
+        if (new_data == NULL) return FS_OUT_OF_MEMORY;
+        fs->journal_held_data = new_data;
+        
+        fs->journal_held_capacity = new_capacity;
+    }
+    
+    fs->journal_held_sectors[fs->journal_held_count] = sector;
+    memcpy(fs->journal_held_data + (size_t)fs->journal_held_count * fs->sector_size, data, fs->sector_size);
+    fs->journal_held_count++;
+    
+    return FS_OK;
+}
+
+static uint8_t _fs_journal_take_held(fs_t* fs, uint32_t sector, char* data)
+{
+    for (uint32_t i = 0; i < fs->journal_held_count; i++)
+    {
+        if (fs->journal_held_sectors[i] != sector) continue;
+        
+        memcpy(data, fs->journal_held_data + (size_t)i * fs->sector_size, fs->sector_size);
+        
+        // last held sector takes its place
+        uint32_t last = --fs->journal_held_count;
+        if (i != last)
+        {
+            fs->journal_held_sectors[i] = fs->journal_held_sectors[last];
+            memcpy(fs->journal_held_data + (size_t)i * fs->sector_size, fs->journal_held_data + (size_t)last * fs->sector_size, fs->sector_size);
+        }
+        
+        return 1;
+    }
+    
+    return 0;
+}
+
+static int _fs_journal_free_cluster(fs_t* fs, uint32_t cluster)
+{
+    if (fs->journal_freed_count == fs->journal_freed_capacity)
+    {
+        uint32_t new_capacity = fs->journal_freed_capacity == 0 ? 16 : fs->journal_freed_capacity * 2;
+        uint32_t* new_freed = (uint32_t*)realloc(fs->journal_freed, new_capacity * sizeof(uint32_t));
+        if (new_freed == NULL) return FS_OUT_OF_MEMORY;
+        
+        fs->journal_freed = new_freed;
+        fs->journal_freed_capacity = new_capacity;
+    }
+    
+    fs->journal_freed[fs->journal_freed_count++] = cluster;
+    
+    return FS_OK;
+}
+
+static void _fs_journal_release_freed(fs_t* fs)
+{
+    for (uint32_t i = 0; i < fs->journal_freed_count && fs->free_bitmap != NULL; i++)
+    {
+        uint32_t cluster = fs->journal_freed[i];
+        fs->free_bitmap[cluster / 32] |= (uint32_t)1 << (cluster % 32);
+    }
+    
+    fs->journal_freed_count = 0;
+}
+
+static void _fs_journal_free(fs_t* fs)
+{
+    free(fs->journal_held_sectors);
+    free(fs->journal_held_data);
+    free(fs->journal_freed);
+    
+    _fs_journal_init(fs, fs->journal_sector_start, fs->journal_sectors_count);
+}
+
+static int _fs_journal_compare_blocks(const void* a, const void* b)
+{
+    uint32_t sector_a = ((const _fs_journal_block_t*)a)->sector;
+    uint32_t sector_b = ((const _fs_journal_block_t*)b)->sector;
+    
+    return sector_a < sector_b ? -1 : sector_a > sector_b;
+}
+
+static int _fs_write_blocks(fs_t* fs, const _fs_journal_block_t* blocks, uint32_t count)
+{
+    // sorted sectors are written in place with adjacent ones merged
+    fs_disk_vector_t vectors[FS_CACHE_SECTORS];
+    uint32_t run_start = 0;
+    while (run_start < count)
+    {
+        uint32_t run_end = run_start + 1;
+        while (run_end < count && run_end - run_start < FS_CACHE_SECTORS && blocks[run_end].sector == blocks[run_end - 1].sector + 1) run_end++;
+        
+        for (uint32_t i = run_start; i < run_end; i++)
+        {
+            vectors[i - run_start].buffer = (void*)blocks[i].data;
+            vectors[i - run_start].size = fs->sector_size;
+        }
+        
+        FS_CHECK_ERROR(_fs_write_disk_vector(fs, vectors, run_end - run_start, FS_SECTOR_POS(fs, (size_t)blocks[run_start].sector)));
+        run_start = run_end;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_batch_write_held(fs_t* fs)
+{
+    if (fs->journal_held_count == 0) return FS_OK;
+    
+    _fs_journal_block_t* blocks = (_fs_journal_block_t*)malloc(fs->journal_held_count * sizeof(_fs_journal_block_t));
+    if (blocks == NULL) return FS_OUT_OF_MEMORY;
+    
+    for (uint32_t i = 0; i < fs->journal_held_count; i++)
+    {
+        blocks[i].sector = fs->journal_held_sectors[i];
+        blocks[i].data = fs->journal_held_data + (size_t)i * fs->sector_size;
+    }
+    qsort(blocks, fs->journal_held_count, sizeof(_fs_journal_block_t), _fs_journal_compare_blocks);
+    
+    int error = _fs_write_blocks(fs, blocks, fs->journal_held_count);
+    free(blocks);
+    if (error == FS_OK) fs->journal_held_count = 0;
+    
+    return error;
+}
+
+static uint32_t _fs_checksum(uint32_t hash, const void* data, size_t size)
+{
+    // FNV-1a
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+static int _fs_format_full(fs_t* fs, size_t size)
+{
+    // zero whole disk directly, cache is still empty at this point
+    uint8_t zeros[FS_MAX_SECTOR_SIZE];
+    memset(zeros, 0, fs->sector_size);
+    for (uint32_t i = 0; i < fs->sectors_count; i++)
+    {
+        FS_CHECK_ERROR(_fs_write_disk_raw(fs, zeros, FS_SECTOR_POS(fs, i), fs->sector_size));
+    }
+    
+    size_t remaining = size % fs->sector_size;
+    if (remaining != 0)
+    {
+        FS_CHECK_ERROR(_fs_write_disk_raw(fs, zeros, FS_SECTOR_POS(fs, fs->sectors_count), remaining));
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_format_fast(fs_t* fs, size_t size)
+{
+    if (fs->operations.zero != NULL)
+    {
+        // deallocates old contents of the whole disk, falls back to writing metadata when disk can't do it
+        int error = fs->operations.zero(fs->state, 0, size);
+        if (error != FS_NOT_SUPPORTED) return error;
+    }
+    
+    // only bootstrap sector and allocation table have to be zeroed, clusters are always
+    // initialized when they are allocated and never read past the data written to them
+    uint8_t zeros[FS_MAX_SECTOR_SIZE];
+    memset(zeros, 0, fs->sector_size);
+    for (uint32_t i = 0; i < fs->clusters_sector_start; i++)
+    {
+        FS_CHECK_ERROR(_fs_write_disk_raw(fs, zeros, FS_SECTOR_POS(fs, i), fs->sector_size));
+    }
+    
+    // last byte makes sure that disk backed by a file covers whole file system
+    return _fs_write_disk_raw(fs, zeros, size - 1, 1);
+}
+
+static int _fs_geometry_init(fs_t* fs, uint32_t sector_size, uint32_t sectors_per_cluster)
+{
+    if (!_fs_is_power_of_two(sector_size) || sector_size < FS_MIN_SECTOR_SIZE || sector_size > FS_MAX_SECTOR_SIZE) return FS_INVALID_PARAMETER;
+    if (!_fs_is_power_of_two(sectors_per_cluster) || sectors_per_cluster > FS_MAX_CLUSTER_SIZE / sector_size) return FS_INVALID_PARAMETER;
+    
+    fs->sector_size = sector_size;
+    fs->sectors_per_cluster = sectors_per_cluster;
+    fs->cluster_size = sector_size * sectors_per_cluster;
+    
+    fs->nodes_in_cluster = fs->cluster_size / sizeof(_fs_node_t);
+    if (fs->nodes_in_cluster > FS_NODES_MAX_IN_CLUSTER) fs->nodes_in_cluster = FS_NODES_MAX_IN_CLUSTER;
+    
+    fs->cache_data = (char*)malloc((size_t)FS_CACHE_SECTORS * sector_size);
+    if (fs->cache_data == NULL) return FS_OUT_OF_MEMORY;
+    
+    return FS_OK;
+}
+
+static void _fs_geometry_free(fs_t* fs)
+{
+    free(fs->cache_data);
+    fs->cache_data = NULL;
+}
+
+static uint8_t _fs_is_power_of_two(uint32_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+static void _fs_cache_init(fs_t* fs)
+{
+    memset(fs->cache, 0, sizeof(fs->cache));
+    for (uint32_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs->cache[i].data = fs->cache_data + (size_t)i * fs->sector_size;
+    }
+    fs->cache_clock = 0;
+}
+
+static int _fs_cache_read(fs_t* fs, void* buffer, size_t position, size_t size)
+{
+    uint8_t* byte_buffer = (uint8_t*)buffer;
+    
+    while (size)
+    {
+        uint32_t sector = position / fs->sector_size;
+        size_t offset = position % fs->sector_size;
+        size_t chunk = fs->sector_size - offset;
+        if (size < chunk) chunk = size;
+        
+        fs_cache_entry_t* entry;
+        FS_CHECK_ERROR(_fs_cache_get(fs, sector, 1, &entry));
+        
+        memcpy(byte_buffer, entry->data + offset, chunk);
+        
+        size -= chunk;
+        position += chunk;
+        byte_buffer += chunk;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_cache_write(fs_t* fs, const void* buffer, size_t position, size_t size, uint8_t is_metadata)
+{
+    const uint8_t* byte_buffer = (const uint8_t*)buffer;
+    
+    while (size)
+    {
+        uint32_t sector = position / fs->sector_size;
+        size_t offset = position % fs->sector_size;
+        size_t chunk = fs->sector_size - offset;
+        if (size < chunk) chunk = size;
+        
+        // whole sector is going to be overwritten so there is no need to load it
+        fs_cache_entry_t* entry;
+        FS_CHECK_ERROR(_fs_cache_get(fs, sector, chunk != fs->sector_size, &entry));
+        
+        memcpy(entry->data + offset, byte_buffer, chunk);
+        entry->is_metadata = is_metadata || (entry->is_dirty && entry->is_metadata);
+        entry->is_dirty = 1;
+        
+        size -= chunk;
+        position += chunk;
+        byte_buffer += chunk;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_cache_get(fs_t* fs, uint32_t sector, uint8_t load, fs_cache_entry_t** result_entry)
+{
+    fs_cache_entry_t* entry = _fs_cache_find(fs, sector);
+    if (entry != NULL)
+    {
+        *result_entry = entry;
+        return FS_OK;
+    }
+    
+    FS_CHECK_ERROR(_fs_cache_claim(fs, sector, &entry));
+    
+    // changed metadata evicted before journal commit is not on the disk yet
+    if (fs->journal_held_count != 0 && _fs_journal_take_held(fs, sector, entry->data))
+    {
+        entry->is_dirty = 1;
+        entry->is_metadata = 1;
+    }
+    else if (load)
+    {
+        int error = _fs_read_disk_raw(fs, entry->data, FS_SECTOR_POS(fs, (size_t)sector), fs->sector_size);
+        if (error != FS_OK)
+        {
+            entry->is_valid = 0;
+            return error;
+        }
+    }
+    
+    *result_entry = entry;
+    
+    return FS_OK;
+}
+
+static fs_cache_entry_t* _fs_cache_find(fs_t* fs, uint32_t sector)
+{
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (entry->is_valid && entry->sector == sector)
+        {
+            entry->last_use = ++fs->cache_clock;
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+static int _fs_cache_claim(fs_t* fs, uint32_t sector, fs_cache_entry_t** result_entry)
+{
+    // evict least recently used entry, entry is returned without content
+    fs_cache_entry_t* victim = NULL;
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (!entry->is_valid)
+        {
+            victim = entry;
+            break;
+        }
+        
+        if (victim == NULL || entry->last_use < victim->last_use) victim = entry;
+    }
+    
+    if (victim->is_valid && victim->is_dirty && victim->is_metadata && (fs->journal_sectors_count != 0 || fs->batch_depth != 0))
+    {
+        // metadata may be written in place only when it is committed
+        FS_CHECK_ERROR(_fs_journal_hold(fs, victim->sector, victim->data));
+    }
+    else if (victim->is_valid && victim->is_dirty)
+    {
+        FS_CHECK_ERROR(_fs_write_disk_raw(fs, victim->data, FS_SECTOR_POS(fs, (size_t)victim->sector), fs->sector_size));
+    }
+    
+    victim->sector = sector;
+    victim->is_valid = 1;
+    victim->is_dirty = 0;
+    victim->is_metadata = 0;
+    victim->last_use = ++fs->cache_clock;
+    
+    *result_entry = victim;
+    
+    return FS_OK;
+}
+
+static int _fs_cache_fill(fs_t* fs, uint32_t sector, const void* data)
+{
+    // sector read directly from the disk, another thread may have cached it in the meantime
+    if (_fs_cache_find(fs, sector) != NULL) return FS_OK;
+    
+    fs_cache_entry_t* entry;
+    FS_CHECK_ERROR(_fs_cache_claim(fs, sector, &entry));
+    memcpy(entry->data, data, fs->sector_size);
+    
+    return FS_OK;
+}
+
+static int _fs_cache_write_back(fs_t* fs, uint32_t first_sector, uint32_t end_sector)
+{
+    // write back dirty sectors in ascending order, adjacent sectors are written with single request
+    fs_cache_entry_t* dirty[FS_CACHE_SECTORS];
+    size_t dirty_count = 0;
+    for (size_t i = 0; i < FS_CACHE_SECTORS; i++)
+    {
+        fs_cache_entry_t* entry = &fs->cache[i];
+        if (!entry->is_valid || !entry->is_dirty) continue;
+        if (entry->sector < first_sector || entry->sector >= end_sector) continue;
+        if (entry->is_metadata && fs->journal_sectors_count != 0) continue; // written by journal commit
+        
+        size_t position = dirty_count++;
+        while (position > 0 && dirty[position - 1]->sector > entry->sector)
+        {
+            dirty[position] = dirty[position - 1];
+            position--;
+        }
+        dirty[position] = entry;
+    }
+    
+    fs_disk_vector_t vectors[FS_CACHE_SECTORS];
+    size_t run_start = 0;
+    while (run_start < dirty_count)
+    {
+        size_t run_end = run_start + 1;
+        while (run_end < dirty_count && dirty[run_end]->sector == dirty[run_end - 1]->sector + 1) run_end++;
+        
+        for (size_t i = run_start; i < run_end; i++)
+        {
+            vectors[i - run_start].buffer = dirty[i]->data;
+            vectors[i - run_start].size = fs->sector_size;
+        }
+        
+        FS_CHECK_ERROR(_fs_write_disk_vector(fs, vectors, run_end - run_start, FS_SECTOR_POS(fs, (size_t)dirty[run_start]->sector)));
+        
+        for (size_t i = run_start; i < run_end; i++) dirty[i]->is_dirty = 0;
+        
+        run_start = run_end;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_cache_flush(fs_t* fs)
+{
+    FS_MUTEX_LOCK(fs, cache_lock);
+    int error = _fs_cache_write_back(fs, 0, 0xFFFFFFFF);
+    // without journal, metadata held during batch is written together with the rest
+    if (error == FS_OK && fs->journal_sectors_count == 0) error = _fs_batch_write_held(fs);
+    FS_MUTEX_UNLOCK(fs, cache_lock);
+    
+    return error;
+}
+
+static int _fs_locks_init(fs_t* fs)
+{
+#if FS_THREAD_SAFE
+    if (pthread_rwlock_init(&fs->volume_lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    for (size_t i = 0; i < FS_NODE_LOCK_STRIPES; i++)
+    {
+        if (pthread_rwlock_init(&fs->node_locks[i], NULL) != 0) return FS_OUT_OF_MEMORY;
+    }
+    
+    if (pthread_mutex_init(&fs->alloc_lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    if (pthread_mutex_init(&fs->cache_lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    if (pthread_mutex_init(&fs->dentry_lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    if (pthread_mutex_init(&fs->disk_lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    fs->disk_mutex = &fs->disk_lock;
+#else
+    (void)fs;
+#endif
+    
+    return FS_OK;
+}
+
+static void _fs_locks_free(fs_t* fs)
+{
+#if FS_THREAD_SAFE
+    pthread_rwlock_destroy(&fs->volume_lock);
+    for (size_t i = 0; i < FS_NODE_LOCK_STRIPES; i++) pthread_rwlock_destroy(&fs->node_locks[i]);
+    
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->dentry_lock);
+    pthread_mutex_destroy(&fs->disk_lock);
+#else
+    (void)fs;
+#endif
+}
+
+static void _fs_volume_lock(fs_t* fs, uint8_t exclusive)
+{
+#if FS_THREAD_SAFE
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(&fs->volume_lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&fs->volume_lock);
+    }
+#else
+    (void)fs;
+    (void)exclusive;
+#endif
+}
+
+static void _fs_volume_unlock(fs_t* fs)
+{
+#if FS_THREAD_SAFE
+    pthread_rwlock_unlock(&fs->volume_lock);
+#else
+    (void)fs;
+#endif
+}
+
+static void _fs_node_lock(fs_t* fs, uint32_t node, uint8_t exclusive)
+{
+#if FS_THREAD_SAFE
+    // nodes share locks, every operation holds at most one of them
+    pthread_rwlock_t* lock = &fs->node_locks[FS_NODE_STRIPE(node)];
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(lock);
+    }
+#else
+    (void)fs;
+    (void)node;
+    (void)exclusive;
+#endif
+}
+
+static void _fs_node_unlock(fs_t* fs, uint32_t node)
+{
+#if FS_THREAD_SAFE
+    pthread_rwlock_unlock(&fs->node_locks[FS_NODE_STRIPE(node)]);
+#else
+    (void)fs;
+    (void)node;
+#endif
+}
+
+static void _fs_disk_lock(fs_t* fs)
+{
+#if FS_THREAD_SAFE
+    if (!fs->operations.is_thread_safe) pthread_mutex_lock(fs->disk_mutex);
+#else
+    (void)fs;
+#endif
+}
+
+static void _fs_disk_unlock(fs_t* fs)
+{
+#if FS_THREAD_SAFE
+    if (!fs->operations.is_thread_safe) pthread_mutex_unlock(fs->disk_mutex);
+#else
+    (void)fs;
+#endif
+}
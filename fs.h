@@ -1,124 +1,354 @@
-#ifndef FS_H_
-#define FS_H_
-
-#include <stdint.h>
-#include <stddef.h>
-
-#define FS_OK 0
-#define FS_DISK_INIT_ERROR      1
-#define FS_DISK_READ_ERROR      2
-#define FS_DISK_WRITE_ERROR     3
-#define FS_DISK_CLOSE_ERROR     4
-#define FS_FULL                 5
-#define FS_NOT_A_DIRECTORY      6
-#define FS_WRONG_PATH           7
-#define FS_PATH_TOO_LONG        8
-#define FS_NAME_TOO_LONG        9
-#define FS_BUFFER_TOO_SMALL     10
-#define FS_NOT_A_FILE           11
-#define FS_NOT_EXISTS           12
-#define FS_FILE_CLOSED          13
-#define FS_EOF                  14
-#define FS_ALREADY_EXISTS       15
-
-#define FS_SECTOR_SIZE          128
-
-#define FS_PATH_MAX_LENGTH      255
-#define FS_NAME_MAX_LENGTH      27
-
-#define FS_FILE         1
-#define FS_DIR          2
-
-#define FS_CREATE       (1 << 0)
-#define FS_APPEND       (1 << 1)
-
-#define FS_SEEK_BEGIN   1
-#define FS_SEEK_CURRENT 2
-#define FS_SEEK_END     3
-
-typedef int (*disk_init)(void** result_state);
-typedef int (*disk_read)(void* state, void* buffer, size_t position, size_t size);
-typedef int (*disk_write)(void* state, const void* buffer, size_t position, size_t size);
-typedef int (*disk_close)(void* state);
-
-typedef struct
-{
-    disk_init   init;
-    disk_read   read;
-    disk_write  write;
-    disk_close  close;
-} fs_disk_operations_t;
-
-typedef struct
-{
-    void*       state;
-    fs_disk_operations_t operations;
-    uint32_t    sectors_count;
-    uint32_t    table_sector_start;
-    uint32_t    table_sectors_count;
-    uint32_t    clusters_sector_start;
-    uint32_t    clusters_count;
-    uint32_t    root_node;
-    char        buffer[FS_SECTOR_SIZE];
-} fs_t;
-
-typedef struct
-{
-    char        name[FS_NAME_MAX_LENGTH + 1];
-    uint32_t    node;
-    uint8_t     node_type;
-    uint16_t    node_links_count;
-    uint32_t    node_modification_time;
-} fs_dir_entry_t;
-
-typedef struct
-{
-    uint32_t    node;
-    uint32_t    pos;
-    uint32_t    size;
-    uint32_t    first_cluster;
-    uint32_t    current_cluster;
-    uint32_t    current_cluster_pos;
-    uint8_t     is_opened;
-} fs_file_t;
-
-typedef struct
-{
-    uint32_t    sectors;
-    uint32_t    clusters;
-    uint32_t    table_sectors;
-    uint32_t    free_clusters;
-    uint32_t    node_clusters;
-    uint32_t    data_clusters;
-    uint32_t    nodes;
-    uint32_t    allocated_nodes;
-    uint32_t    files_size;
-    uint32_t    dir_structures_size;
-    uint32_t    nodes_size;
-    uint32_t    used_space;
-    uint32_t    free_space;
-    uint32_t    total_size;
-    uint32_t    usable_space;
-} fs_info_t;
-
-int fs_create(const fs_disk_operations_t* operations, size_t size, fs_t* result_fs);
-int fs_open(const fs_disk_operations_t* operations, fs_t* result_fs);
-int fs_close(fs_t* fs);
-
-int fs_mkdir(fs_t* fs, const char* path);
-int fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result);
-int fs_size(fs_t* fs, uint32_t node, uint32_t* files_size);
-int fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results);
-int fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result);
-int fs_link(fs_t* fs, const char* path, uint32_t node);
-int fs_remove(fs_t* fs, const char* path);
-int fs_info(fs_t* fs, fs_info_t* result);
-
-int fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result);
-int fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written);
-int fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read);
-int fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos);
-int fs_file_discard(fs_t* fs, fs_file_t* file);
-int fs_file_close(fs_t* fs, fs_file_t* file);
-
+#ifndef FS_H_
+#define FS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef FS_THREAD_SAFE
+#define FS_THREAD_SAFE          1
+#endif
+
+#if FS_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#define FS_OK 0
+#define FS_DISK_INIT_ERROR      1
+#define FS_DISK_READ_ERROR      2
+#define FS_DISK_WRITE_ERROR     3
+#define FS_DISK_CLOSE_ERROR     4
+#define FS_FULL                 5
+#define FS_NOT_A_DIRECTORY      6
+#define FS_WRONG_PATH           7
+#define FS_PATH_TOO_LONG        8
+#define FS_NAME_TOO_LONG        9
+#define FS_BUFFER_TOO_SMALL     10
+#define FS_NOT_A_FILE           11
+#define FS_NOT_EXISTS           12
+#define FS_FILE_CLOSED          13
+#define FS_EOF                  14
+#define FS_ALREADY_EXISTS       15
+#define FS_OUT_OF_MEMORY        16
+#define FS_INVALID_PARAMETER    17
+#define FS_NOT_SUPPORTED        18
+#define FS_READ_ONLY            19
+
+#define FS_DEFAULT_SECTOR_SIZE          128
+#define FS_DEFAULT_SECTORS_PER_CLUSTER  1
+#define FS_MIN_SECTOR_SIZE              128
+#define FS_MAX_SECTOR_SIZE              4096
+#define FS_MAX_CLUSTER_SIZE             65536
+#define FS_DEFAULT_JOURNAL_SECTORS      256
+#define FS_MIN_JOURNAL_SECTORS          4
+
+#ifndef FS_CACHE_SECTORS
+#define FS_CACHE_SECTORS        64
+#endif
+
+#if FS_CACHE_SECTORS < 2
+#error "FS_CACHE_SECTORS must be at least 2"
+#endif
+
+#ifndef FS_DENTRY_CACHE_SIZE
+#define FS_DENTRY_CACHE_SIZE    128
+#endif
+
+#ifndef FS_SCAN_MAX_THREADS
+#define FS_SCAN_MAX_THREADS     16
+#endif
+
+#ifndef FS_NODE_LOCK_STRIPES
+#define FS_NODE_LOCK_STRIPES    64
+#endif
+
+#ifndef FS_CHAIN_MAP_MAX_ENTRIES
+#define FS_CHAIN_MAP_MAX_ENTRIES 4096
+#endif
+
+#ifndef FS_DELAYED_MAX_SIZE
+#define FS_DELAYED_MAX_SIZE     (1 << 20)
+#endif
+
+#ifndef FS_READ_AHEAD_MAX_SIZE
+#define FS_READ_AHEAD_MAX_SIZE  (128 * 1024)
+#endif
+
+#define FS_READ_AHEAD_MAX_RUNS  16
+
+#define FS_PATH_MAX_LENGTH      255
+#define FS_NAME_MAX_LENGTH      27
+
+#define FS_FILE         1
+#define FS_DIR          2
+
+#define FS_CREATE       (1 << 0)
+#define FS_APPEND       (1 << 1)
+#define FS_DELAYED      (1 << 2)
+
+#define FS_DIR_NAMES_ONLY   (1 << 0)
+#define FS_DIR_SKIP_DOTS    (1 << 1)
+
+#define FS_SEEK_BEGIN   1
+#define FS_SEEK_CURRENT 2
+#define FS_SEEK_END     3
+
+#define FS_ADVISE_NORMAL        0
+#define FS_ADVISE_SEQUENTIAL    1
+#define FS_ADVISE_RANDOM        2
+#define FS_ADVISE_WILLNEED      3
+
+#define FS_FORMAT_FULL_ZERO     (1 << 0)
+
+typedef struct
+{
+    void*       buffer;
+    size_t      size;
+} fs_disk_vector_t;
+
+typedef int (*disk_init)(void** result_state);
+typedef int (*disk_read)(void* state, void* buffer, size_t position, size_t size);
+typedef int (*disk_write)(void* state, const void* buffer, size_t position, size_t size);
+typedef int (*disk_close)(void* state);
+typedef int (*disk_sync)(void* state);
+typedef int (*disk_readv)(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+typedef int (*disk_writev)(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+typedef int (*disk_zero)(void* state, size_t position, size_t size);
+typedef int (*disk_map)(void* state, const void** result_address, size_t position, size_t size);
+
+typedef struct
+{
+    disk_init   init;
+    disk_read   read;
+    disk_write  write;
+    disk_close  close;
+    disk_sync   sync;       // optional, NULL if not supported
+    disk_readv  readv;      // optional, reads contiguous disk area into several buffers, NULL if not supported
+    disk_writev writev;     // optional, writes several buffers to contiguous disk area, NULL if not supported
+    disk_zero   zero;       // optional, makes disk area read as zeros (extending the disk if needed) without writing it, FS_NOT_SUPPORTED if it can't, NULL if not supported
+    disk_map    map;        // optional, address where disk area can be read directly until the disk is closed, NULL if not supported
+    uint8_t     is_thread_safe; // functions may be called from several threads at once, otherwise file system serializes them
+} fs_disk_operations_t;
+
+typedef struct
+{
+    uint32_t    sector;
+    uint32_t    last_use;
+    uint8_t     is_valid;
+    uint8_t     is_dirty;
+    uint8_t     is_metadata; // with journal, written to the disk only by journal commit
+    char*       data;       // points into fs_t cache_data
+} fs_cache_entry_t;
+
+typedef struct
+{
+    uint32_t    parent_node;
+    uint32_t    node;
+    uint8_t     status;
+    char        name[FS_NAME_MAX_LENGTH + 1];
+} fs_dentry_t;
+
+typedef struct
+{
+    void*       state;
+    fs_disk_operations_t operations;
+    uint32_t    sectors_count;
+    uint32_t    table_sector_start;
+    uint32_t    table_sectors_count;
+    uint32_t    refs_sector_start;
+    uint32_t    refs_sectors_count;         // 0 if file system has no reference count table, files cannot be cloned
+    uint32_t    clusters_sector_start;
+    uint32_t    clusters_count;
+    uint32_t    root_node;
+    uint32_t    snapshots_node;             // directory of snapshot roots, 0 (root node) if there are no snapshots
+    uint32_t    sector_size;
+    uint32_t    sectors_per_cluster;
+    uint32_t    cluster_size;
+    uint32_t    nodes_in_cluster;
+    fs_cache_entry_t cache[FS_CACHE_SECTORS];
+    char*       cache_data; // FS_CACHE_SECTORS sectors
+    uint32_t    cache_clock;
+    fs_dentry_t dentries[FS_DENTRY_CACHE_SIZE];
+    uint32_t*   free_bitmap;    // NULL until the first allocation if summary was clean at mount
+    uint32_t    free_cursor;
+    uint32_t    free_clusters;
+    uint32_t    node_clusters;
+    uint32_t    nodes;
+    uint64_t    files_size;
+    uint64_t    dir_structures_size;
+    uint8_t     is_summary_dirty;
+    void*       node_index;
+    uint32_t    node_index_count;
+    uint32_t    node_index_capacity;
+    uint32_t*   node_index_table;           // positions in node_index (plus one) hashed by cluster, twice its capacity
+    uint32_t    journal_sector_start;
+    uint32_t    journal_sectors_count;      // 0 if file system has no journal
+    uint32_t    journal_sequence;           // sequence number of the next transaction
+    uint32_t*   journal_held_sectors;       // changed metadata sectors evicted from cache before commit or end of batch
+    char*       journal_held_data;
+    uint32_t    journal_held_count;
+    uint32_t    journal_held_capacity;
+    uint32_t*   journal_freed;              // clusters freed since the last commit, reused only after it
+    uint32_t    journal_freed_count;
+    uint32_t    journal_freed_capacity;
+    uint32_t    batch_depth;                // nested fs_batch_begin calls not committed yet
+    uint8_t     is_read_only;               // snapshot view opened by fs_snapshot_open, disk belongs to the file system it was opened from
+    uint32_t    node_versions[FS_NODE_LOCK_STRIPES];    // changes of file contents per node lock stripe, invalidate read-ahead
+    uint32_t    node_relinks[FS_NODE_LOCK_STRIPES];     // changes of cluster chains by clone or copy on write, handles find position again
+#if FS_THREAD_SAFE
+    pthread_rwlock_t volume_lock;   // shared by lookups and file operations, exclusive for namespace changes
+    pthread_rwlock_t node_locks[FS_NODE_LOCK_STRIPES];  // file contents, shared by readers
+    pthread_mutex_t alloc_lock;     // free bitmap, node index and summary
+    pthread_mutex_t cache_lock;     // sector cache
+    pthread_mutex_t dentry_lock;    // path lookup cache
+    pthread_mutex_t disk_lock;      // disk operations which are not thread safe
+    pthread_mutex_t* disk_mutex;    // disk_lock of this file system or of the one snapshot view was opened from
+#endif
+} fs_t;
+
+typedef struct
+{
+    uint32_t    sector_size;            // power of two between FS_MIN_SECTOR_SIZE and FS_MAX_SECTOR_SIZE
+    uint32_t    sectors_per_cluster;    // power of two, cluster may not exceed FS_MAX_CLUSTER_SIZE
+    uint8_t     flags;                  // FS_FORMAT_FULL_ZERO writes zeros to every sector instead of fast format
+    uint32_t    journal_sectors;        // size of metadata journal, 0 for no journal, at least FS_MIN_JOURNAL_SECTORS
+} fs_format_options_t;
+
+typedef struct
+{
+    char        name[FS_NAME_MAX_LENGTH + 1];
+    uint32_t    node;
+    uint8_t     node_type;
+    uint16_t    node_links_count;
+    uint32_t    node_modification_time;
+} fs_dir_entry_t;
+
+typedef struct
+{
+    uint32_t    node;
+    uint32_t    first_cluster;      // first directory cluster, differs from the node if it was freed and reused
+    uint32_t    cluster;            // directory cluster of the next sector to load
+    uint32_t    sector;             // next sector to load in cluster
+    uint8_t     flags;              // FS_DIR_NAMES_ONLY leaves node type, links and time zeroed, FS_DIR_SKIP_DOTS
+    uint8_t     is_opened;
+    char*       entries;            // references from one directory sector followed by nodes they refer to
+    uint32_t    entries_count;
+    uint32_t    entries_pos;        // next entry to return
+} fs_dir_t;
+
+typedef struct
+{
+    uint32_t    offset;         // within read-ahead window
+    uint32_t    cluster;        // following clusters of run are physically adjacent
+    uint32_t    cluster_pos;
+} fs_file_run_t;
+
+typedef struct
+{
+    uint32_t    node;
+    uint32_t    pos;
+    uint32_t    size;
+    uint32_t    first_cluster;
+    uint32_t    current_cluster;
+    uint32_t    current_cluster_pos;
+    uint8_t     is_opened;
+    uint32_t*   chain_map;          // cluster at every chain_map_stride-th position of the chain, built lazily
+    uint32_t    chain_map_count;
+    uint32_t    chain_map_capacity;
+    uint32_t    chain_map_stride;   // doubled when FS_CHAIN_MAP_MAX_ENTRIES is reached
+    uint8_t     is_delayed;         // opened with FS_DELAYED
+    char*       delayed_data;       // data appended at the end of file, clusters are allocated when it is flushed
+    uint32_t    delayed_size;
+    uint32_t    delayed_capacity;
+    uint8_t     advice;             // FS_ADVISE_NORMAL, FS_ADVISE_SEQUENTIAL or FS_ADVISE_RANDOM
+    char*       ahead_data;         // read-ahead window, file contents from ahead_pos
+    uint32_t    ahead_pos;
+    uint32_t    ahead_size;
+    uint32_t    ahead_capacity;
+    uint32_t    ahead_next_size;    // size of the next window, grows while reads are sequential
+    uint32_t    ahead_version;      // node_versions entry of the node when window was read
+    uint32_t    ahead_read_end;     // position where previous read ended
+    fs_file_run_t ahead_runs[FS_READ_AHEAD_MAX_RUNS];
+    uint32_t    ahead_runs_count;
+    uint8_t     is_viewed;          // view returned by fs_file_read_view is not released yet
+    uint8_t     is_shared;          // file was cloned, its clusters may be shared with other files
+    uint32_t    private_clusters;   // clusters at the beginning of chain known to be owned only by this file
+    uint32_t    private_last_cluster;
+    uint32_t    relink_version;     // node_relinks entry of the node when chain was followed
+} fs_file_t;
+
+typedef struct
+{
+    uint32_t    sector_size;
+    uint32_t    cluster_size;
+    uint32_t    sectors;
+    uint32_t    clusters;
+    uint32_t    table_sectors;
+    uint32_t    refs_sectors;
+    uint32_t    journal_sectors;
+    uint32_t    free_clusters;
+    uint32_t    node_clusters;
+    uint32_t    data_clusters;
+    uint32_t    nodes;
+    uint32_t    allocated_nodes;
+    uint64_t    files_size;
+    uint64_t    dir_structures_size;
+    uint64_t    nodes_size;
+    uint64_t    used_space;
+    uint64_t    free_space;
+    uint64_t    total_size;
+    uint64_t    usable_space;
+} fs_info_t;
+
+int fs_create(const fs_disk_operations_t* operations, size_t size, const fs_format_options_t* options, fs_t* result_fs); // options may be NULL for defaults
+int fs_open(const fs_disk_operations_t* operations, fs_t* result_fs);
+int fs_close(fs_t* fs);
+int fs_sync(fs_t* fs);
+
+// Changes made between fs_batch_begin and fs_batch_commit (by any thread) are kept in memory and every changed
+// metadata sector is written once when the batch is committed. Batches may be nested, the outermost commit writes.
+int fs_batch_begin(fs_t* fs);
+int fs_batch_commit(fs_t* fs);
+
+int fs_mkdir(fs_t* fs, const char* path);
+int fs_dir_entries_count(fs_t* fs, const char* path, uint32_t* result);
+int fs_size(fs_t* fs, uint32_t node, uint32_t* files_size);
+int fs_dir_list(fs_t* fs, const char* path, fs_dir_entry_t* results, size_t* count, size_t max_results);
+// Iterator reads directory one sector at a time, nodes of entries in the sector are read together.
+// fs_dir_next returns FS_EOF after the last entry. Entries added or removed meanwhile may be skipped or returned.
+int fs_dir_open(fs_t* fs, const char* path, uint8_t flags, fs_dir_t* result);
+int fs_dir_next(fs_t* fs, fs_dir_t* dir, fs_dir_entry_t* result);
+int fs_dir_close(fs_t* fs, fs_dir_t* dir);
+int fs_entry_info(fs_t* fs, const char* path, fs_dir_entry_t* result);
+int fs_link(fs_t* fs, const char* path, uint32_t node);
+// Moves file or directory to destination path which must not exist. Within one directory only the name
+// in existing entry is rewritten, otherwise entries, ".." of moved directory and links of parents change together.
+int fs_rename(fs_t* fs, const char* source_path, const char* destination_path);
+// Destination file (created or replaced) shares all clusters of source file, they are copied when either file changes them.
+int fs_clone(fs_t* fs, const char* source_path, const char* destination_path);
+int fs_remove(fs_t* fs, const char* path);
+// Snapshot freezes the whole tree under given name: files share clusters with the live tree like clones,
+// directories and nodes are copied. Files open for writing are taken with the size of their last close.
+int fs_snapshot_create(fs_t* fs, const char* name);
+int fs_snapshot_delete(fs_t* fs, const char* name);
+int fs_snapshot_list(fs_t* fs, fs_dir_entry_t* results, size_t* count, size_t max_results);
+// Opens snapshot as a read-only file system sharing the disk of fs, closed with fs_close (which leaves the disk open).
+// Views have to be closed before fs is closed or the snapshot is deleted.
+int fs_snapshot_open(fs_t* fs, const char* name, fs_t* result_view);
+int fs_info(fs_t* fs, fs_info_t* result);
+
+int fs_file_open(fs_t* fs, const char* path, uint8_t flags, fs_file_t* result);
+int fs_file_write(fs_t* fs, fs_file_t* file, const void* buffer, size_t size, size_t* written);
+int fs_file_read(fs_t* fs, fs_file_t* file, void* buffer, size_t size, size_t* read);
+int fs_file_seek(fs_t* fs, fs_file_t* file, uint8_t mode, int32_t pos);
+int fs_file_discard(fs_t* fs, fs_file_t* file);
+int fs_file_flush(fs_t* fs, fs_file_t* file); // writes data held by file opened with FS_DELAYED
+int fs_file_advise(fs_t* fs, fs_file_t* file, uint8_t advice); // FS_ADVISE_WILLNEED reads ahead from current position at once
+
+// Read-only view of at most size bytes of file at current position, which moves past it. Data is not copied, it points
+// into the disk mapping (disk with map operation) or into read-ahead window of the handle. Writers of the file wait until
+// fs_file_release_view, which has to be called by the same thread before any other operation on the file system.
+int fs_file_read_view(fs_t* fs, fs_file_t* file, size_t size, const void** result_data, size_t* result_size);
+int fs_file_release_view(fs_t* fs, fs_file_t* file);
+int fs_file_close(fs_t* fs, fs_file_t* file);
+
 #endif
\ No newline at end of file
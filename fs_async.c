@@ -0,0 +1,233 @@
+#include "fs_async.h"
+
+#include <string.h>
+#include <unistd.h>
+
+static void* _fs_async_worker(void* arg);
+static fs_async_request_t* _fs_async_take(fs_async_t* async);
+static uint8_t _fs_async_is_busy(fs_async_t* async, const fs_file_t* file);
+static void _fs_async_execute(fs_async_t* async, fs_async_request_t* request);
+static void _fs_async_stop(fs_async_t* async, uint32_t threads);
+
+int fs_async_create(fs_t* fs, uint32_t threads, fs_async_t* result_async)
+{
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (threads > FS_ASYNC_MAX_THREADS) threads = FS_ASYNC_MAX_THREADS;
+    
+    memset(result_async, 0, sizeof(fs_async_t));
+    result_async->fs = fs;
+    
+    if (pthread_mutex_init(&result_async->lock, NULL) != 0) return FS_OUT_OF_MEMORY;
+    if (pthread_cond_init(&result_async->submitted, NULL) != 0) return FS_OUT_OF_MEMORY;
+    if (pthread_cond_init(&result_async->completed, NULL) != 0) return FS_OUT_OF_MEMORY;
+    
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        if (pthread_create(&result_async->threads[i], NULL, _fs_async_worker, result_async) != 0)
+        {
+            _fs_async_stop(result_async, i);
+            return FS_OUT_OF_MEMORY;
+        }
+        
+        result_async->threads_count++;
+    }
+    
+    return FS_OK;
+}
+
+int fs_async_submit(fs_async_t* async, fs_async_request_t* request)
+{
+    if (request->operation < FS_ASYNC_OPEN || request->operation > FS_ASYNC_CLOSE || request->file == NULL) return FS_INVALID_PARAMETER;
+    
+    request->next = NULL;
+    request->result = FS_OK;
+    request->result_size = 0;
+    
+    pthread_mutex_lock(&async->lock);
+    if (async->is_stopping)
+    {
+        pthread_mutex_unlock(&async->lock);
+        return FS_INVALID_PARAMETER;
+    }
+    
+    if (async->submitted_tail != NULL)
+    {
+        async->submitted_tail->next = request;
+    }
+    else
+    {
+        async->submitted_head = request;
+    }
+    async->submitted_tail = request;
+    async->in_flight++;
+    
+    pthread_cond_signal(&async->submitted);
+    pthread_mutex_unlock(&async->lock);
+    
+    return FS_OK;
+}
+
+int fs_async_complete(fs_async_t* async, uint8_t wait, fs_async_request_t** result)
+{
+    pthread_mutex_lock(&async->lock);
+    while (wait && async->completed_head == NULL && async->in_flight > 0)
+    {
+        pthread_cond_wait(&async->completed, &async->lock);
+    }
+    
+    fs_async_request_t* request = async->completed_head;
+    if (request != NULL)
+    {
+        async->completed_head = request->next;
+        if (async->completed_head == NULL) async->completed_tail = NULL;
+        request->next = NULL;
+    }
+    pthread_mutex_unlock(&async->lock);
+    
+    *result = request;
+    
+    return FS_OK;
+}
+
+int fs_async_close(fs_async_t* async)
+{
+    pthread_mutex_lock(&async->lock);
+    while (async->in_flight > 0) pthread_cond_wait(&async->completed, &async->lock);
+    pthread_mutex_unlock(&async->lock);
+    
+    _fs_async_stop(async, async->threads_count);
+    
+    return FS_OK;
+}
+
+static void* _fs_async_worker(void* arg)
+{
+    fs_async_t* async = (fs_async_t*)arg;
+    
+    pthread_mutex_lock(&async->lock);
+    for (;;)
+    {
+        fs_async_request_t* request = _fs_async_take(async);
+        if (request == NULL)
+        {
+            if (async->is_stopping) break;
+            
+            pthread_cond_wait(&async->submitted, &async->lock);
+            continue;
+        }
+        
+        // there are as many slots as threads, so one is always free
+        uint32_t slot = 0;
+        while (async->running[slot] != NULL) slot++;
+        async->running[slot] = request->file;
+        pthread_mutex_unlock(&async->lock);
+        
+        // request may be already freed by its callback when execution returns
+        uint8_t is_queued = request->callback == NULL;
+        _fs_async_execute(async, request);
+        
+        pthread_mutex_lock(&async->lock);
+        async->running[slot] = NULL;
+        
+        if (is_queued)
+        {
+            if (async->completed_tail != NULL)
+            {
+                async->completed_tail->next = request;
+            }
+            else
+            {
+                async->completed_head = request;
+            }
+            async->completed_tail = request;
+        }
+        async->in_flight--;
+        
+        // requests waiting for the same handle may be picked up now
+        if (async->submitted_head != NULL) pthread_cond_broadcast(&async->submitted);
+        pthread_cond_broadcast(&async->completed);
+    }
+    pthread_mutex_unlock(&async->lock);
+    
+    return NULL;
+}
+
+static fs_async_request_t* _fs_async_take(fs_async_t* async)
+{
+    // the oldest request whose handle is not used by other worker, this keeps order of requests on every handle
+    fs_async_request_t* prev = NULL;
+    fs_async_request_t* request = async->submitted_head;
+    while (request != NULL && _fs_async_is_busy(async, request->file))
+    {
+        prev = request;
+        request = request->next;
+    }
+    if (request == NULL) return NULL;
+    
+    if (prev != NULL)
+    {
+        prev->next = request->next;
+    }
+    else
+    {
+        async->submitted_head = request->next;
+    }
+    if (async->submitted_tail == request) async->submitted_tail = prev;
+    request->next = NULL;
+    
+    return request;
+}
+
+static uint8_t _fs_async_is_busy(fs_async_t* async, const fs_file_t* file)
+{
+    for (uint32_t i = 0; i < FS_ASYNC_MAX_THREADS; i++)
+    {
+        if (async->running[i] == file) return 1;
+    }
+    
+    return 0;
+}
+
+static void _fs_async_execute(fs_async_t* async, fs_async_request_t* request)
+{
+    fs_t* fs = async->fs;
+    
+    switch (request->operation)
+    {
+    case FS_ASYNC_OPEN:
+        request->result = fs_file_open(fs, request->path, request->flags, request->file);
+        break;
+    case FS_ASYNC_READ:
+        request->result = fs_file_read(fs, request->file, request->buffer, request->size, &request->result_size);
+        break;
+    case FS_ASYNC_WRITE:
+        request->result = fs_file_write(fs, request->file, request->buffer, request->size, &request->result_size);
+        break;
+    case FS_ASYNC_SEEK:
+        request->result = fs_file_seek(fs, request->file, request->seek_mode, request->seek_pos);
+        break;
+    case FS_ASYNC_CLOSE:
+        request->result = fs_file_close(fs, request->file);
+        break;
+    }
+    
+    if (request->callback != NULL) request->callback(request);
+}
+
+static void _fs_async_stop(fs_async_t* async, uint32_t threads)
+{
+    pthread_mutex_lock(&async->lock);
+    async->is_stopping = 1;
+    pthread_cond_broadcast(&async->submitted);
+    pthread_mutex_unlock(&async->lock);
+    
+    for (uint32_t i = 0; i < threads; i++) pthread_join(async->threads[i], NULL);
+    
+    pthread_cond_destroy(&async->completed);
+    pthread_cond_destroy(&async->submitted);
+    pthread_mutex_destroy(&async->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef FS_ASYNC_H_
+#define FS_ASYNC_H_
+
+#include "fs.h"
+
+#if !FS_THREAD_SAFE
+#error "fs_async requires FS_THREAD_SAFE"
+#endif
+
+#ifndef FS_ASYNC_MAX_THREADS
+#define FS_ASYNC_MAX_THREADS    16
+#endif
+
+#define FS_ASYNC_OPEN       1
+#define FS_ASYNC_READ       2
+#define FS_ASYNC_WRITE      3
+#define FS_ASYNC_SEEK       4
+#define FS_ASYNC_CLOSE      5
+
+typedef struct fs_async_request fs_async_request_t;
+typedef void (*fs_async_callback)(fs_async_request_t* request);
+
+struct fs_async_request
+{
+    uint8_t     operation;      // FS_ASYNC_OPEN, FS_ASYNC_READ, ...
+    fs_file_t*  file;           // handle used by the request, result handle for FS_ASYNC_OPEN
+    const char* path;           // FS_ASYNC_OPEN
+    uint8_t     flags;          // FS_ASYNC_OPEN, same as fs_file_open flags
+    void*       buffer;         // FS_ASYNC_READ and FS_ASYNC_WRITE
+    size_t      size;           // FS_ASYNC_READ and FS_ASYNC_WRITE
+    uint8_t     seek_mode;      // FS_ASYNC_SEEK, same as fs_file_seek mode
+    int32_t     seek_pos;       // FS_ASYNC_SEEK
+    fs_async_callback callback; // optional, called from worker thread instead of queueing completion
+    void*       user_data;      // not used by file system
+    int         result;         // error code of the operation, set on completion
+    size_t      result_size;    // bytes read or written, set on completion
+    fs_async_request_t* next;   // internal
+};
+
+typedef struct
+{
+    fs_t*       fs;
+    pthread_t   threads[FS_ASYNC_MAX_THREADS];
+    uint32_t    threads_count;
+    fs_file_t*  running[FS_ASYNC_MAX_THREADS];  // handles used by requests being executed, NULL in free slots
+    fs_async_request_t* submitted_head;
+    fs_async_request_t* submitted_tail;
+    fs_async_request_t* completed_head;
+    fs_async_request_t* completed_tail;
+    uint32_t    in_flight;      // submitted requests which have not completed yet
+    uint8_t     is_stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t  submitted;  // signalled when request may be picked up by a worker
+    pthread_cond_t  completed;  // signalled when request completes
+} fs_async_t;
+
+// Asynchronous file operations executed by a pool of worker threads.
+// Requests are owned by the caller and have to stay valid until they complete.
+// Requests using the same fs_file_t handle are executed one at a time in submission order,
+// requests on different handles run in parallel.
+// threads may be 0 to start one thread per online processor (at most FS_ASYNC_MAX_THREADS).
+int fs_async_create(fs_t* fs, uint32_t threads, fs_async_t* result_async);
+int fs_async_submit(fs_async_t* async, fs_async_request_t* request);
+// Takes the oldest completed request without callback. *result is set to NULL when there is none
+// (after waiting for one if wait is set, unless nothing is in flight).
+int fs_async_complete(fs_async_t* async, uint8_t wait, fs_async_request_t** result);
+// Waits for all submitted requests and stops worker threads. Completed requests which were not taken
+// with fs_async_complete are left as they are.
+int fs_async_close(fs_async_t* async);
+
+#endif
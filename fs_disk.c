@@ -0,0 +1,593 @@
+#define _GNU_SOURCE // O_DIRECT and fallocate
+
+#include "fs_disk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+
+typedef struct
+{
+    int         fd;
+    uint8_t*    data;
+    size_t      size;
+} _fs_disk_mmap_t;
+
+#define FS_CHECK_ERROR(x)               do { int error = x; if (error != FS_OK) return error; } while(0)
+#define FS_CHECK_DISK(x, e)             do { if ((x) != 0) return e; } while(0)
+
+#define FS_DISK_DIRECT_BOUNCE_SIZE      (16 * FS_DISK_DIRECT_ALIGNMENT)
+#define FS_DISK_MAX_VECTORS             64
+
+typedef struct
+{
+    int         fd;
+    uint8_t     flags;
+    uint8_t*    bounce;
+    size_t      bounce_size;
+    pthread_mutex_t bounce_lock;    // bounce buffer is shared by all threads reading from disk
+} _fs_disk_fd_t;
+
+static int _fs_disk_mmap_map(int fd, size_t size, void** result_state);
+
+static int _fs_disk_fd_init(int fd, uint8_t flags, void** result_state);
+static int _fs_disk_fd_read_bounce(_fs_disk_fd_t* disk, void* buffer, size_t position, size_t size);
+static int _fs_disk_fd_write_bounce(_fs_disk_fd_t* disk, const void* buffer, size_t position, size_t size);
+static int _fs_disk_fd_open_flags(uint8_t flags);
+static int _fs_disk_fd_pread(int fd, void* buffer, size_t position, size_t size, size_t* result_read);
+static int _fs_disk_fd_pwrite(int fd, const void* buffer, size_t position, size_t size);
+static int _fs_disk_fd_vector(int fd, const fs_disk_vector_t* vectors, size_t count, size_t position, uint8_t is_write);
+
+static int _fs_disk_punch_hole(int fd, size_t position, size_t size);
+
+int fs_disk_mmap_open(const char* path, void** result_state)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return FS_DISK_INIT_ERROR;
+    
+    // lseek works for both regular files and block devices, st_size is 0 for devices
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0)
+    {
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    return _fs_disk_mmap_map(fd, (size_t)size, result_state);
+}
+
+int fs_disk_mmap_create(const char* path, size_t size, void** result_state)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return FS_DISK_INIT_ERROR;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    if (S_ISREG(info.st_mode))
+    {
+        if (ftruncate(fd, (off_t)size) != 0)
+        {
+            close(fd);
+            return FS_DISK_INIT_ERROR;
+        }
+    }
+    else
+    {
+        off_t device_size = lseek(fd, 0, SEEK_END);
+        if (device_size < 0 || (size_t)device_size < size)
+        {
+            close(fd);
+            return FS_DISK_INIT_ERROR;
+        }
+    }
+    
+    return _fs_disk_mmap_map(fd, size, result_state);
+}
+
+int fs_disk_mmap_read(void* state, void* buffer, size_t position, size_t size)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    if (position > disk->size || size > disk->size - position) return FS_DISK_READ_ERROR;
+    
+    memcpy(buffer, disk->data + position, size);
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_write(void* state, const void* buffer, size_t position, size_t size)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    if (position > disk->size || size > disk->size - position) return FS_DISK_WRITE_ERROR;
+    
+    memcpy(disk->data + position, buffer, size);
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_readv(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(fs_disk_mmap_read(state, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_writev(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(fs_disk_mmap_write(state, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_zero(void* state, size_t position, size_t size)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    if (position > disk->size || size > disk->size - position) return FS_DISK_WRITE_ERROR;
+    
+    // deallocated file blocks are dropped from the shared mapping as well
+    if (_fs_disk_punch_hole(disk->fd, position, size) == 0) return FS_OK;
+    
+    // clearing the mapping would write every page of the area
+    return FS_NOT_SUPPORTED;
+}
+
+int fs_disk_mmap_map(void* state, const void** result_address, size_t position, size_t size)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    if (position > disk->size || size > disk->size - position) return FS_DISK_READ_ERROR;
+    
+    *result_address = disk->data + position;
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_sync(void* state)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    if (msync(disk->data, disk->size, MS_SYNC) != 0) return FS_DISK_WRITE_ERROR;
+    
+    return FS_OK;
+}
+
+int fs_disk_mmap_close(void* state)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)state;
+    
+    int result = FS_OK;
+    if (msync(disk->data, disk->size, MS_SYNC) != 0) result = FS_DISK_CLOSE_ERROR;
+    if (munmap(disk->data, disk->size) != 0) result = FS_DISK_CLOSE_ERROR;
+    if (close(disk->fd) != 0) result = FS_DISK_CLOSE_ERROR;
+    
+    free(disk);
+    
+    return result;
+}
+
+void fs_disk_mmap_operations(fs_disk_operations_t* operations)
+{
+    operations->read = &fs_disk_mmap_read;
+    operations->write = &fs_disk_mmap_write;
+    operations->readv = &fs_disk_mmap_readv;
+    operations->writev = &fs_disk_mmap_writev;
+    operations->zero = &fs_disk_mmap_zero;
+    operations->map = &fs_disk_mmap_map;
+    operations->sync = &fs_disk_mmap_sync;
+    operations->close = &fs_disk_mmap_close;
+    operations->is_thread_safe = 1;
+}
+
+int fs_disk_fd_open(const char* path, uint8_t flags, void** result_state)
+{
+    int fd = open(path, _fs_disk_fd_open_flags(flags));
+    if (fd < 0) return FS_DISK_INIT_ERROR;
+    
+    return _fs_disk_fd_init(fd, flags, result_state);
+}
+
+int fs_disk_fd_create(const char* path, size_t size, uint8_t flags, void** result_state)
+{
+    int fd = open(path, _fs_disk_fd_open_flags(flags) | O_CREAT, 0644);
+    if (fd < 0) return FS_DISK_INIT_ERROR;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (S_ISREG(info.st_mode) && ftruncate(fd, (off_t)size) != 0))
+    {
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    return _fs_disk_fd_init(fd, flags, result_state);
+}
+
+int fs_disk_fd_read(void* state, void* buffer, size_t position, size_t size)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    if (!(disk->flags & FS_DISK_FD_DIRECT))
+    {
+        size_t read;
+        FS_CHECK_DISK(_fs_disk_fd_pread(disk->fd, buffer, position, size, &read), FS_DISK_READ_ERROR);
+        if (read != size) return FS_DISK_READ_ERROR;
+        
+        return FS_OK;
+    }
+    
+    pthread_mutex_lock(&disk->bounce_lock);
+    int result = _fs_disk_fd_read_bounce(disk, buffer, position, size);
+    pthread_mutex_unlock(&disk->bounce_lock);
+    
+    return result;
+}
+
+int fs_disk_fd_write(void* state, const void* buffer, size_t position, size_t size)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    if (!(disk->flags & FS_DISK_FD_DIRECT))
+    {
+        return _fs_disk_fd_pwrite(disk->fd, buffer, position, size) == 0 ? FS_OK : FS_DISK_WRITE_ERROR;
+    }
+    
+    pthread_mutex_lock(&disk->bounce_lock);
+    int result = _fs_disk_fd_write_bounce(disk, buffer, position, size);
+    pthread_mutex_unlock(&disk->bounce_lock);
+    
+    return result;
+}
+
+int fs_disk_fd_readv(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    if (!(disk->flags & FS_DISK_FD_DIRECT))
+    {
+        return _fs_disk_fd_vector(disk->fd, vectors, count, position, 0) == 0 ? FS_OK : FS_DISK_READ_ERROR;
+    }
+    
+    // buffers are not aligned, every one of them goes through bounce buffer
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(fs_disk_fd_read(state, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+int fs_disk_fd_writev(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    if (!(disk->flags & FS_DISK_FD_DIRECT))
+    {
+        return _fs_disk_fd_vector(disk->fd, vectors, count, position, 1) == 0 ? FS_OK : FS_DISK_WRITE_ERROR;
+    }
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        FS_CHECK_ERROR(fs_disk_fd_write(state, vectors[i].buffer, position, vectors[i].size));
+        position += vectors[i].size;
+    }
+    
+    return FS_OK;
+}
+
+int fs_disk_fd_zero(void* state, size_t position, size_t size)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    struct stat info;
+    FS_CHECK_DISK(fstat(disk->fd, &info), FS_DISK_WRITE_ERROR);
+    
+    if (S_ISREG(info.st_mode))
+    {
+        // area past the end of file reads as zeros once file is extended over it
+        size_t file_size = (size_t)info.st_size;
+        if (position + size > file_size)
+        {
+            FS_CHECK_DISK(ftruncate(disk->fd, (off_t)(position + size)), FS_DISK_WRITE_ERROR);
+            if (position >= file_size) return FS_OK;
+            size = file_size - position;
+        }
+    }
+    
+    if (_fs_disk_punch_hole(disk->fd, position, size) == 0) return FS_OK;
+    
+    // no support for deallocation, caller decides what has to be written
+    return FS_NOT_SUPPORTED;
+}
+
+int fs_disk_fd_sync(void* state)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    if (fsync(disk->fd) != 0) return FS_DISK_WRITE_ERROR;
+    
+    return FS_OK;
+}
+
+int fs_disk_fd_close(void* state)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)state;
+    
+    int result = FS_OK;
+    if (fsync(disk->fd) != 0) result = FS_DISK_CLOSE_ERROR;
+    if (close(disk->fd) != 0) result = FS_DISK_CLOSE_ERROR;
+    
+    if (disk->flags & FS_DISK_FD_DIRECT) pthread_mutex_destroy(&disk->bounce_lock);
+    free(disk->bounce);
+    free(disk);
+    
+    return result;
+}
+
+void fs_disk_fd_operations(fs_disk_operations_t* operations)
+{
+    operations->read = &fs_disk_fd_read;
+    operations->write = &fs_disk_fd_write;
+    operations->readv = &fs_disk_fd_readv;
+    operations->writev = &fs_disk_fd_writev;
+    operations->zero = &fs_disk_fd_zero;
+    operations->map = NULL;
+    operations->sync = &fs_disk_fd_sync;
+    operations->close = &fs_disk_fd_close;
+    operations->is_thread_safe = 1;
+}
+
+static int _fs_disk_mmap_map(int fd, size_t size, void** result_state)
+{
+    _fs_disk_mmap_t* disk = (_fs_disk_mmap_t*)malloc(sizeof(_fs_disk_mmap_t));
+    if (disk == NULL)
+    {
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        free(disk);
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    disk->fd = fd;
+    disk->data = (uint8_t*)data;
+    disk->size = size;
+    
+    *result_state = disk;
+    
+    return FS_OK;
+}
+
+static int _fs_disk_fd_init(int fd, uint8_t flags, void** result_state)
+{
+    _fs_disk_fd_t* disk = (_fs_disk_fd_t*)malloc(sizeof(_fs_disk_fd_t));
+    if (disk == NULL)
+    {
+        close(fd);
+        return FS_DISK_INIT_ERROR;
+    }
+    
+    disk->fd = fd;
+    disk->flags = flags;
+    disk->bounce = NULL;
+    disk->bounce_size = 0;
+    
+    if (flags & FS_DISK_FD_DIRECT)
+    {
+        // bounce buffer has to be aligned as well as disk positions and sizes
+        void* bounce;
+        if (posix_memalign(&bounce, FS_DISK_DIRECT_ALIGNMENT, FS_DISK_DIRECT_BOUNCE_SIZE) != 0)
+        {
+            free(disk);
+            close(fd);
+            return FS_DISK_INIT_ERROR;
+        }
+        
+        disk->bounce = (uint8_t*)bounce;
+        disk->bounce_size = FS_DISK_DIRECT_BOUNCE_SIZE;
+        pthread_mutex_init(&disk->bounce_lock, NULL);
+    }
+    
+    *result_state = disk;
+    
+    return FS_OK;
+}
+
+static int _fs_disk_fd_open_flags(uint8_t flags)
+{
+    int open_flags = O_RDWR;
+    
+#ifdef O_DIRECT
+    if (flags & FS_DISK_FD_DIRECT) open_flags |= O_DIRECT;
+#endif
+    
+    return open_flags;
+}
+
+static int _fs_disk_fd_pread(int fd, void* buffer, size_t position, size_t size, size_t* result_read)
+{
+    uint8_t* byte_buffer = (uint8_t*)buffer;
+    
+    *result_read = 0;
+    while (size)
+    {
+        ssize_t result = pread(fd, byte_buffer, size, (off_t)position);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (result == 0) break; // end of disk
+        
+        size -= result;
+        position += result;
+        byte_buffer += result;
+        *result_read += result;
+    }
+    
+    return 0;
+}
+
+static int _fs_disk_fd_pwrite(int fd, const void* buffer, size_t position, size_t size)
+{
+    const uint8_t* byte_buffer = (const uint8_t*)buffer;
+    
+    while (size)
+    {
+        ssize_t result = pwrite(fd, byte_buffer, size, (off_t)position);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        
+        size -= result;
+        position += result;
+        byte_buffer += result;
+    }
+    
+    return 0;
+}
+
+static int _fs_disk_fd_vector(int fd, const fs_disk_vector_t* vectors, size_t count, size_t position, uint8_t is_write)
+{
+    struct iovec iov[FS_DISK_MAX_VECTORS];
+    
+    size_t index = 0;
+    size_t skip = 0; // bytes of vectors[index] already transferred
+    while (index < count)
+    {
+        size_t iov_count = 0;
+        while (index + iov_count < count && iov_count < FS_DISK_MAX_VECTORS)
+        {
+            const fs_disk_vector_t* vector = &vectors[index + iov_count];
+            size_t offset = iov_count == 0 ? skip : 0;
+            iov[iov_count].iov_base = (uint8_t*)vector->buffer + offset;
+            iov[iov_count].iov_len = vector->size - offset;
+            iov_count++;
+        }
+        
+        ssize_t result = is_write ? pwritev(fd, iov, (int)iov_count, (off_t)position) : preadv(fd, iov, (int)iov_count, (off_t)position);
+        if (result < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (result == 0) return -1; // end of disk
+        
+        // skip over fully transferred vectors, continue with partially transferred one
+        position += result;
+        size_t transferred = (size_t)result;
+        while (transferred)
+        {
+            size_t remaining = vectors[index].size - skip;
+            if (transferred < remaining)
+            {
+                skip += transferred;
+                break;
+            }
+            
+            transferred -= remaining;
+            skip = 0;
+            index++;
+        }
+    }
+    
+    return 0;
+}
+
+static int _fs_disk_punch_hole(int fd, size_t position, size_t size)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    if (size == 0) return 0;
+    
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)position, (off_t)size);
+#else
+    (void)fd;
+    (void)position;
+    (void)size;
+    return -1;
+#endif
+}
+
+static int _fs_disk_fd_read_bounce(_fs_disk_fd_t* disk, void* buffer, size_t position, size_t size)
+{
+    uint8_t* byte_buffer = (uint8_t*)buffer;
+    while (size)
+    {
+        size_t aligned_position = position & ~(size_t)(FS_DISK_DIRECT_ALIGNMENT - 1);
+        size_t offset = position - aligned_position;
+        size_t chunk = disk->bounce_size - offset;
+        if (size < chunk) chunk = size;
+        size_t aligned_size = (offset + chunk + FS_DISK_DIRECT_ALIGNMENT - 1) & ~(size_t)(FS_DISK_DIRECT_ALIGNMENT - 1);
+        
+        size_t read;
+        FS_CHECK_DISK(_fs_disk_fd_pread(disk->fd, disk->bounce, aligned_position, aligned_size, &read), FS_DISK_READ_ERROR);
+        if (read < offset + chunk) return FS_DISK_READ_ERROR;
+        
+        memcpy(byte_buffer, disk->bounce + offset, chunk);
+        
+        size -= chunk;
+        position += chunk;
+        byte_buffer += chunk;
+    }
+    
+    return FS_OK;
+}
+
+static int _fs_disk_fd_write_bounce(_fs_disk_fd_t* disk, const void* buffer, size_t position, size_t size)
+{
+    const uint8_t* byte_buffer = (const uint8_t*)buffer;
+    while (size)
+    {
+        size_t aligned_position = position & ~(size_t)(FS_DISK_DIRECT_ALIGNMENT - 1);
+        size_t offset = position - aligned_position;
+        size_t chunk = disk->bounce_size - offset;
+        if (size < chunk) chunk = size;
+        size_t aligned_size = (offset + chunk + FS_DISK_DIRECT_ALIGNMENT - 1) & ~(size_t)(FS_DISK_DIRECT_ALIGNMENT - 1);
+        
+        if (offset != 0 || chunk != aligned_size)
+        {
+            // partially covered blocks have to be read first, area past the end of disk reads as zeros
+            size_t read;
+            FS_CHECK_DISK(_fs_disk_fd_pread(disk->fd, disk->bounce, aligned_position, aligned_size, &read), FS_DISK_WRITE_ERROR);
+            memset(disk->bounce + read, 0, aligned_size - read);
+        }
+        
+        memcpy(disk->bounce + offset, byte_buffer, chunk);
+        
+        FS_CHECK_DISK(_fs_disk_fd_pwrite(disk->fd, disk->bounce, aligned_position, aligned_size), FS_DISK_WRITE_ERROR);
+        
+        size -= chunk;
+        position += chunk;
+        byte_buffer += chunk;
+    }
+    
+    return FS_OK;
+}
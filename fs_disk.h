@@ -0,0 +1,47 @@
+#ifndef FS_DISK_H_
+#define FS_DISK_H_
+
+#include "fs.h"
+
+#define FS_DISK_FD_DIRECT           (1 << 0)
+
+#ifndef FS_DISK_DIRECT_ALIGNMENT
+#define FS_DISK_DIRECT_ALIGNMENT    4096
+#endif
+
+// Memory mapped disk backend. Whole disk (image file or device) is mapped into memory,
+// reads and writes are plain memory copies and changes are written back with msync.
+// Disk areas are mapped for fs_file_read_view, so viewed file data is read straight from the mapping.
+// Zeroed areas are deallocated with fallocate hole punching, FS_NOT_SUPPORTED is returned where it is not supported.
+// init operation is not provided because it depends on disk path, call fs_disk_mmap_open
+// or fs_disk_mmap_create from your own init function.
+int fs_disk_mmap_open(const char* path, void** result_state);
+int fs_disk_mmap_create(const char* path, size_t size, void** result_state);
+int fs_disk_mmap_read(void* state, void* buffer, size_t position, size_t size);
+int fs_disk_mmap_write(void* state, const void* buffer, size_t position, size_t size);
+int fs_disk_mmap_readv(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+int fs_disk_mmap_writev(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+int fs_disk_mmap_zero(void* state, size_t position, size_t size);
+int fs_disk_mmap_map(void* state, const void** result_address, size_t position, size_t size);
+int fs_disk_mmap_sync(void* state);
+int fs_disk_mmap_close(void* state);
+void fs_disk_mmap_operations(fs_disk_operations_t* operations);
+
+// File descriptor disk backend using pread and pwrite, safe to use on devices.
+// With FS_DISK_FD_DIRECT flag disk is opened with O_DIRECT, page cache is bypassed and
+// every request is turned into FS_DISK_DIRECT_ALIGNMENT aligned transfers through an aligned bounce buffer.
+// Zeroed areas are deallocated (ftruncate past the end of image file, fallocate hole punching inside it),
+// FS_NOT_SUPPORTED is returned when the area cannot be deallocated (file is still extended over it).
+// As with memory mapped backend, init operation has to be provided by the caller.
+int fs_disk_fd_open(const char* path, uint8_t flags, void** result_state);
+int fs_disk_fd_create(const char* path, size_t size, uint8_t flags, void** result_state);
+int fs_disk_fd_read(void* state, void* buffer, size_t position, size_t size);
+int fs_disk_fd_write(void* state, const void* buffer, size_t position, size_t size);
+int fs_disk_fd_readv(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+int fs_disk_fd_writev(void* state, const fs_disk_vector_t* vectors, size_t count, size_t position);
+int fs_disk_fd_zero(void* state, size_t position, size_t size);
+int fs_disk_fd_sync(void* state);
+int fs_disk_fd_close(void* state);
+void fs_disk_fd_operations(fs_disk_operations_t* operations);
+
+#endif
@@ -0,0 +1,756 @@
+#include "fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Model based test: random operations are applied both to the file system and to a model of its tree, which have to
+// match after every operation. Every disk write is logged, then disk images cut at random writes (as if power failed
+// there) are opened, which replays the journal, and have to match the model after one of operations made until then.
+// Journal covers metadata only, file contents rewritten in place are not compared after a crash, just read.
+
+#define TEST_DISK_SIZE          (96 << 10) // small enough to get full
+#define TEST_OPERATIONS         400
+#define TEST_CRASH_POINTS       150
+#define TEST_MAX_ENTRIES        256
+#define TEST_MAX_WRITE          6000
+#define TEST_MAX_SNAPSHOTS      3
+#define TEST_LINE_LENGTH        (FS_PATH_MAX_LENGTH + 64)
+
+#define TEST_CHECK(x)   do { int test_error = x; if (test_error != FS_OK) _test_fail(__LINE__, #x, test_error); } while(0)
+#define TEST_ASSERT(x)  do { if (!(x)) _test_fail(__LINE__, #x, 0); } while(0)
+
+typedef struct
+{
+    size_t      position;
+    size_t      size;
+    char*       data;
+    size_t      synced_count;       // writes made durable by syncs before this one
+    uint32_t    operation;          // 0 for writes of fs_create
+} _test_write_t;
+
+typedef struct
+{
+    char*       data;
+    uint8_t     is_logged;          // only disk of the workload logs writes, opened crash images do not
+} _test_disk_t;
+
+typedef struct
+{
+    char        path[FS_PATH_MAX_LENGTH + 1];
+    uint8_t     type;
+    uint32_t    object;             // files with the same object are hard links
+} _test_entry_t;
+
+typedef struct
+{
+    char*       data;
+    uint32_t    size;
+} _test_object_t;
+
+typedef struct
+{
+    char        name[FS_NAME_MAX_LENGTH + 1];
+    uint64_t    digests[2];         // digests of the tree when snapshot was created, without and with file contents
+} _test_snapshot_t;
+
+typedef struct
+{
+    _test_entry_t entries[TEST_MAX_ENTRIES];
+    uint32_t    entries_count;
+    _test_object_t objects[TEST_OPERATIONS + 1];
+    uint32_t    objects_count;
+    _test_snapshot_t snapshots[TEST_MAX_SNAPSHOTS];
+    uint32_t    snapshots_count;
+} _test_model_t;
+
+static void _test_fail(int line, const char* expression, int error);
+static int _test_disk_init(void** result_state);
+static int _test_disk_read(void* state, void* buffer, size_t position, size_t size);
+static int _test_disk_write(void* state, const void* buffer, size_t position, size_t size);
+static int _test_disk_sync(void* state);
+static int _test_disk_close(void* state);
+static void _test_disk_operations(_test_disk_t* disk, fs_disk_operations_t* result);
+static uint64_t _test_hash(uint64_t hash, const void* data, size_t size);
+static uint64_t _test_lines_digest(char* lines, uint32_t count);
+static int _test_compare_lines(const void* a, const void* b);
+static uint64_t _test_model_tree_digest(const _test_model_t* model, uint8_t with_contents);
+static uint64_t _test_model_digest(const _test_model_t* model, uint8_t with_contents);
+static _test_entry_t* _test_model_find(_test_model_t* model, const char* path);
+static uint8_t _test_model_parent_exists(_test_model_t* model, const char* path);
+static uint32_t _test_model_new_object(_test_model_t* model);
+static void _test_model_add(_test_model_t* model, const char* path, uint8_t type, uint32_t object);
+static void _test_model_remove(_test_model_t* model, _test_entry_t* entry);
+static void _test_walk(fs_t* fs, const char* path, uint8_t with_contents, char* lines, uint32_t* count);
+static uint64_t _test_tree_digest(fs_t* fs, uint8_t with_contents);
+static uint64_t _test_digest(fs_t* fs, uint8_t with_contents);
+static void _test_remove_all(fs_t* fs);
+static void _test_check_leaks(fs_t* fs);
+static void _test_random_path(unsigned* seed, uint8_t type, char* result);
+static void _test_operation(fs_t* fs, _test_model_t* model, unsigned* seed, uint32_t operation, uint8_t* is_batch);
+static void _test_run(const fs_format_options_t* options, unsigned seed);
+static void _test_crash(uint32_t write, uint8_t keep_all, unsigned seed);
+
+static _test_disk_t* test_next_disk;   // taken by _test_disk_init
+static _test_write_t* test_log;
+static size_t test_log_count;
+static size_t test_log_capacity;
+static size_t test_synced_count;
+static uint32_t test_operation;
+
+static uint64_t test_digests[TEST_OPERATIONS + 1];     // digest of the model without file contents after every operation
+static uint64_t test_middle_digests[TEST_OPERATIONS + 1]; // digest between the calls of an operation, each call may commit
+static size_t test_sync_ends[TEST_OPERATIONS + 1];     // writes made until fs_sync operation returned, 0 for other operations
+static char test_buffer[TEST_MAX_WRITE];
+
+int main(int argc, char** argv)
+{
+    unsigned seeds = argc > 1 ? (unsigned)atoi(argv[1]) : 4;
+    
+    fs_format_options_t options[2] = { { 128, 1, 0, FS_DEFAULT_JOURNAL_SECTORS }, { 512, 2, 0, 64 } };
+    for (unsigned seed = 1; seed <= seeds; seed++)
+    {
+        _test_run(&options[seed % 2], seed);
+    }
+    
+    printf("fs_test: %u runs of %d operations and %d crash points passed\n", seeds, TEST_OPERATIONS, TEST_CRASH_POINTS);
+    return 0;
+}
+
+static void _test_fail(int line, const char* expression, int error)
+{
+    printf("fs_test.c:%d: %s failed (%d), operation %u\n", line, expression, error, test_operation);
+    exit(1);
+}
+
+static int _test_disk_init(void** result_state)
+{
+    *result_state = test_next_disk;
+    return FS_OK;
+}
+
+static int _test_disk_read(void* state, void* buffer, size_t position, size_t size)
+{
+    _test_disk_t* disk = (_test_disk_t*)state;
+    if (position + size > TEST_DISK_SIZE) return FS_DISK_READ_ERROR;
+    
+    memcpy(buffer, disk->data + position, size);
+    return FS_OK;
+}
+
+static int _test_disk_write(void* state, const void* buffer, size_t position, size_t size)
+{
+    _test_disk_t* disk = (_test_disk_t*)state;
+    if (position + size > TEST_DISK_SIZE) return FS_DISK_WRITE_ERROR;
+    
+    memcpy(disk->data + position, buffer, size);
+    if (!disk->is_logged) return FS_OK;
+    
+    if (test_log_count == test_log_capacity)
+    {
+        test_log_capacity = test_log_capacity == 0 ? 4096 : test_log_capacity * 2;
+        test_log = (_test_write_t*)realloc(test_log, test_log_capacity * sizeof(_test_write_t));
+        TEST_ASSERT(test_log != NULL);
+    }
+    
+    _test_write_t* write = &test_log[test_log_count++];
+    write->position = position;
+    write->size = size;
+    write->data = (char*)malloc(size);
+    TEST_ASSERT(write->data != NULL);
+    memcpy(write->data, buffer, size);
+    write->synced_count = test_synced_count;
+    write->operation = test_operation;
+    
+    return FS_OK;
+}
+
+static int _test_disk_sync(void* state)
+{
+    _test_disk_t* disk = (_test_disk_t*)state;
+    if (disk->is_logged) test_synced_count = test_log_count;
+    
+    return FS_OK;
+}
+
+static int _test_disk_close(void* state)
+{
+    (void)state;
+    return FS_OK;
+}
+
+static void _test_disk_operations(_test_disk_t* disk, fs_disk_operations_t* result)
+{
+    memset(result, 0, sizeof(fs_disk_operations_t));
+    result->init = _test_disk_init;
+    result->read = _test_disk_read;
+    result->write = _test_disk_write;
+    result->sync = _test_disk_sync;
+    result->close = _test_disk_close;
+    
+    test_next_disk = disk;
+}
+
+static uint64_t _test_hash(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    
+    return hash;
+}
+
+static int _test_compare_lines(const void* a, const void* b)
+{
+    return strcmp((const char*)a, (const char*)b);
+}
+
+static uint64_t _test_lines_digest(char* lines, uint32_t count)
+{
+    // directories are listed in any order, lines are sorted first
+    qsort(lines, count, TEST_LINE_LENGTH, _test_compare_lines);
+    
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        hash = _test_hash(hash, lines + (size_t)i * TEST_LINE_LENGTH, strlen(lines + (size_t)i * TEST_LINE_LENGTH) + 1);
+    }
+    
+    return hash;
+}
+
+static uint64_t _test_model_tree_digest(const _test_model_t* model, uint8_t with_contents)
+{
+    static char lines[TEST_MAX_ENTRIES * TEST_LINE_LENGTH];
+    
+    for (uint32_t i = 0; i < model->entries_count; i++)
+    {
+        const _test_entry_t* entry = &model->entries[i];
+    
+        // directory is linked from its parent, by its own "." and by ".." of every subdirectory
+        uint32_t links = entry->type == FS_DIR ? 2 : 0;
+        size_t length = strlen(entry->path);
+        for (uint32_t j = 0; j < model->entries_count; j++)
+        {
+            const _test_entry_t* other = &model->entries[j];
+            if (entry->type == FS_FILE && other->type == FS_FILE && other->object == entry->object) links++;
+            if (entry->type == FS_DIR && other->type == FS_DIR && strncmp(other->path, entry->path, length) == 0 &&
+                other->path[length] == '/' && strchr(other->path + length + 1, '/') == NULL)
+            {
+                links++;
+            }
+        }
+    
+        const _test_object_t* object = &model->objects[entry->object];
+        uint64_t contents = entry->type == FS_FILE && with_contents ? _test_hash(0, object->data, object->size) : 0;
+        uint32_t size = entry->type == FS_FILE ? object->size : 0;
+        sprintf(lines + (size_t)i * TEST_LINE_LENGTH, "%s %d %u %u %016llx", entry->path, entry->type, links, size, (unsigned long long)contents);
+    }
+    
+    return _test_lines_digest(lines, model->entries_count);
+}
+
+static uint64_t _test_model_digest(const _test_model_t* model, uint8_t with_contents)
+{
+    static char lines[TEST_MAX_SNAPSHOTS * TEST_LINE_LENGTH];
+    
+    for (uint32_t i = 0; i < model->snapshots_count; i++)
+    {
+        sprintf(lines + (size_t)i * TEST_LINE_LENGTH, "%s %016llx", model->snapshots[i].name, (unsigned long long)model->snapshots[i].digests[with_contents]);
+    }
+    
+    uint64_t hash = _test_model_tree_digest(model, with_contents);
+    uint64_t snapshots = _test_lines_digest(lines, model->snapshots_count);
+    return _test_hash(hash, &snapshots, sizeof(snapshots));
+}
+
+static _test_entry_t* _test_model_find(_test_model_t* model, const char* path)
+{
+    for (uint32_t i = 0; i < model->entries_count; i++)
+    {
+        if (strcmp(model->entries[i].path, path) == 0) return &model->entries[i];
+    }
+    
+    return NULL;
+}
+
+static uint8_t _test_model_parent_exists(_test_model_t* model, const char* path)
+{
+    char parent[FS_PATH_MAX_LENGTH + 1];
+    strcpy(parent, path);
+    *strrchr(parent, '/') = 0;
+    if (parent[0] == 0) return 1;
+    
+    _test_entry_t* entry = _test_model_find(model, parent);
+    return entry != NULL && entry->type == FS_DIR;
+}
+
+static uint32_t _test_model_new_object(_test_model_t* model)
+{
+    TEST_ASSERT(model->objects_count < TEST_OPERATIONS + 1);
+    
+    uint32_t object = model->objects_count++;
+    model->objects[object].data = NULL;
+    model->objects[object].size = 0;
+    return object;
+}
+
+static void _test_model_add(_test_model_t* model, const char* path, uint8_t type, uint32_t object)
+{
+    TEST_ASSERT(model->entries_count < TEST_MAX_ENTRIES);
+    
+    _test_entry_t* entry = &model->entries[model->entries_count++];
+    strcpy(entry->path, path);
+    entry->type = type;
+    entry->object = object;
+}
+
+static void _test_model_remove(_test_model_t* model, _test_entry_t* entry)
+{
+    *entry = model->entries[--model->entries_count];
+}
+
+static void _test_walk(fs_t* fs, const char* path, uint8_t with_contents, char* lines, uint32_t* count)
+{
+    uint32_t listed = 0;
+    fs_dir_t dir;
+    fs_dir_entry_t entry;
+    int error;
+    
+    TEST_CHECK(fs_dir_open(fs, path, FS_DIR_SKIP_DOTS, &dir));
+    while ((error = fs_dir_next(fs, &dir, &entry)) == FS_OK)
+    {
+        char entry_path[FS_PATH_MAX_LENGTH + 1];
+        sprintf(entry_path, "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry.name);
+        listed++;
+    
+        uint32_t size = 0;
+        uint64_t contents = 0;
+        if (entry.node_type == FS_FILE)
+        {
+            static char data[TEST_OPERATIONS * TEST_MAX_WRITE];
+            fs_file_t file;
+            size_t read;
+    
+            TEST_CHECK(fs_file_open(fs, entry_path, 0, &file));
+            while ((error = fs_file_read(fs, &file, data + size, sizeof(data) - size, &read)) == FS_OK) size += (uint32_t)read;
+            TEST_ASSERT(error == FS_EOF);
+            TEST_CHECK(fs_file_close(fs, &file));
+            if (with_contents) contents = _test_hash(0, data, size);
+        }
+    
+        TEST_ASSERT(*count < TEST_MAX_ENTRIES);
+        sprintf(lines + (size_t)*count * TEST_LINE_LENGTH, "%s %d %u %u %016llx", entry_path, entry.node_type, entry.node_links_count, size, (unsigned long long)contents);
+        (*count)++;
+    
+        if (entry.node_type == FS_DIR) _test_walk(fs, entry_path, with_contents, lines, count);
+    }
+    TEST_ASSERT(error == FS_EOF);
+    TEST_CHECK(fs_dir_close(fs, &dir));
+    
+    // iterator has to return the same entries as the whole directory listing
+    uint32_t entries_count;
+    TEST_CHECK(fs_dir_entries_count(fs, path, &entries_count));
+    TEST_ASSERT(entries_count == listed + 2);
+}
+
+static uint64_t _test_tree_digest(fs_t* fs, uint8_t with_contents)
+{
+    static char lines[TEST_MAX_ENTRIES * TEST_LINE_LENGTH];
+    uint32_t count = 0;
+    
+    _test_walk(fs, "/", with_contents, lines, &count);
+    return _test_lines_digest(lines, count);
+}
+
+static uint64_t _test_digest(fs_t* fs, uint8_t with_contents)
+{
+    static char lines[TEST_MAX_SNAPSHOTS * TEST_LINE_LENGTH];
+    fs_dir_entry_t snapshots[TEST_MAX_SNAPSHOTS + 1];
+    size_t count;
+    
+    TEST_CHECK(fs_snapshot_list(fs, snapshots, &count, TEST_MAX_SNAPSHOTS + 1));
+    TEST_ASSERT(count <= TEST_MAX_SNAPSHOTS);
+    
+    for (size_t i = 0; i < count; i++)
+    {
+        fs_t view;
+        TEST_CHECK(fs_snapshot_open(fs, snapshots[i].name, &view));
+        sprintf(lines + i * TEST_LINE_LENGTH, "%s %016llx", snapshots[i].name, (unsigned long long)_test_tree_digest(&view, with_contents));
+        TEST_CHECK(fs_close(&view));
+    }
+    
+    uint64_t hash = _test_tree_digest(fs, with_contents);
+    uint64_t snapshots_hash = _test_lines_digest(lines, (uint32_t)count);
+    return _test_hash(hash, &snapshots_hash, sizeof(snapshots_hash));
+}
+
+static void _test_remove_all(fs_t* fs)
+{
+    fs_dir_entry_t entry;
+    
+    for (;;)
+    {
+        // directory changes under the iterator, it is opened again after every removal
+        fs_dir_t dir;
+        TEST_CHECK(fs_dir_open(fs, "/", FS_DIR_SKIP_DOTS | FS_DIR_NAMES_ONLY, &dir));
+        int error = fs_dir_next(fs, &dir, &entry);
+        TEST_CHECK(fs_dir_close(fs, &dir));
+        if (error == FS_EOF) break;
+        TEST_CHECK(error);
+    
+        char entry_path[FS_PATH_MAX_LENGTH + 1];
+        sprintf(entry_path, "/%s", entry.name);
+        TEST_CHECK(fs_remove(fs, entry_path));
+    }
+}
+
+static void _test_check_leaks(fs_t* fs)
+{
+    // with everything removed, only root, snapshots directory and their clusters may stay allocated
+    fs_dir_entry_t snapshots[TEST_MAX_SNAPSHOTS + 1];
+    size_t count;
+    TEST_CHECK(fs_snapshot_list(fs, snapshots, &count, TEST_MAX_SNAPSHOTS + 1));
+    for (size_t i = 0; i < count; i++) TEST_CHECK(fs_snapshot_delete(fs, snapshots[i].name));
+    
+    _test_remove_all(fs);
+    
+    fs_info_t info;
+    TEST_CHECK(fs_info(fs, &info));
+    TEST_ASSERT(info.nodes == 1 + (fs->snapshots_node != 0));
+    TEST_ASSERT(info.free_clusters + info.node_clusters + info.dir_structures_size / info.cluster_size == info.clusters);
+}
+
+static void _test_random_path(unsigned* seed, uint8_t type, char* result)
+{
+    // few names, so that operations often meet existing entries
+    int dir = rand_r(seed) % 4;
+    int subdir = rand_r(seed) % 3;
+    int name = rand_r(seed) % 4;
+    
+    if (type == FS_DIR && subdir == 2) sprintf(result, "/d%d", dir);
+    else if (type == FS_DIR) sprintf(result, "/d%d/s%d", dir, subdir);
+    else if (subdir == 2) sprintf(result, "/d%d/f%d", dir, name);
+    else sprintf(result, "/d%d/s%d/f%d", dir, subdir, name);
+}
+
+static void _test_operation(fs_t* fs, _test_model_t* model, unsigned* seed, uint32_t operation, uint8_t* is_batch)
+{
+    char path[FS_PATH_MAX_LENGTH + 1];
+    char other_path[FS_PATH_MAX_LENGTH + 1];
+    int kind = rand_r(seed) % 16;
+    int error;
+    
+    _test_random_path(seed, kind < 2 || (kind == 8 && rand_r(seed) % 4 == 0) ? FS_DIR : FS_FILE, path);
+    _test_entry_t* entry = _test_model_find(model, path);
+    
+    if (kind < 2)
+    {
+        // missing parents are created too, existing directory is not an error
+        uint8_t is_valid = 1;
+        char* separator = path;
+        while (separator != NULL)
+        {
+            separator = strchr(separator + 1, '/');
+            if (separator != NULL) *separator = 0;
+            _test_entry_t* parent = _test_model_find(model, path);
+            if (parent != NULL && parent->type != FS_DIR) is_valid = 0;
+            if (separator != NULL) *separator = '/';
+        }
+        
+        error = fs_mkdir(fs, path);
+        TEST_ASSERT(is_valid ? error == FS_OK || error == FS_FULL : error != FS_OK);
+        if (!is_valid) return;
+        
+        // directories made before the disk got full stay
+        separator = path;
+        while (separator != NULL)
+        {
+            fs_dir_entry_t info;
+            separator = strchr(separator + 1, '/');
+            if (separator != NULL) *separator = 0;
+            if (_test_model_find(model, path) == NULL && fs_entry_info(fs, path, &info) == FS_OK) _test_model_add(model, path, FS_DIR, 0);
+            if (separator != NULL) *separator = '/';
+        }
+    }
+    else if (kind < 6)
+    {
+        // append to a file, created or truncated by FS_CREATE, data may be held until close with FS_DELAYED
+        uint8_t flags = FS_APPEND | (rand_r(seed) % 3 == 0 ? FS_CREATE : 0) | (rand_r(seed) % 2 ? FS_DELAYED : 0);
+        if (entry == NULL) flags |= FS_CREATE;
+        uint8_t is_valid = entry != NULL ? entry->type == FS_FILE : _test_model_parent_exists(model, path);
+    
+        fs_file_t file;
+        error = fs_file_open(fs, path, flags, &file);
+        TEST_ASSERT(is_valid ? error == FS_OK || error == FS_FULL : error != FS_OK);
+        if (error != FS_OK) return;
+    
+        if (entry == NULL)
+        {
+            _test_model_add(model, path, FS_FILE, _test_model_new_object(model));
+            entry = &model->entries[model->entries_count - 1];
+        }
+        _test_object_t* object = &model->objects[entry->object];
+        if (flags & FS_CREATE) object->size = 0;
+        
+        // new size is written at close, commits made by open and write leave the file at this one
+        test_middle_digests[operation] = _test_model_digest(model, 0);
+    
+        size_t size = rand_r(seed) % (kind == 2 ? TEST_MAX_WRITE : TEST_MAX_WRITE / 4) + 1;
+        for (size_t i = 0; i < size; i++) test_buffer[i] = (char)(operation + i * 7);
+    
+        size_t written;
+        error = fs_file_write(fs, &file, test_buffer, size, &written);
+        TEST_ASSERT(error == FS_OK || error == FS_FULL);
+        int close_error = fs_file_close(fs, &file);
+        TEST_ASSERT(close_error == FS_OK || close_error == FS_FULL);
+    
+        // data held by FS_DELAYED may fail to be written only when file is closed, the file tells how much was kept
+        if (close_error != FS_OK)
+        {
+            fs_file_t check;
+            TEST_CHECK(fs_file_open(fs, path, 0, &check));
+            TEST_ASSERT(check.size >= object->size && check.size <= object->size + written);
+            written = check.size - object->size;
+            TEST_CHECK(fs_file_close(fs, &check));
+            
+            // handle stays open with the rest of held data, which is given up here
+            free(file.delayed_data);
+            free(file.chain_map);
+            free(file.ahead_data);
+        }
+    
+        object->data = (char*)realloc(object->data, object->size + written + 1);
+        memcpy(object->data + object->size, test_buffer, written);
+        object->size += (uint32_t)written;
+    }
+    else if (kind == 6)
+    {
+        // cut the end of a file, shared clusters are copied first
+        fs_file_t file;
+        error = fs_file_open(fs, path, 0, &file);
+        TEST_ASSERT(entry != NULL && entry->type == FS_FILE ? error == FS_OK : error != FS_OK);
+        if (error != FS_OK) return;
+    
+        _test_object_t* object = &model->objects[entry->object];
+        uint32_t cut = object->size == 0 ? 0 : rand_r(seed) % (object->size + 1);
+        TEST_CHECK(fs_file_seek(fs, &file, FS_SEEK_END, (int32_t)cut));
+        error = fs_file_discard(fs, &file);
+        TEST_ASSERT(error == FS_OK || error == FS_FULL);
+        TEST_CHECK(fs_file_close(fs, &file));
+        if (error == FS_OK) object->size -= cut;
+    }
+    else if (kind < 9)
+    {
+        // directory is removed with everything in it
+        error = fs_remove(fs, path);
+        TEST_ASSERT(entry != NULL ? error == FS_OK : error != FS_OK);
+        if (error != FS_OK) return;
+        
+        size_t length = strlen(path);
+        for (uint32_t i = 0; i < model->entries_count; i++)
+        {
+            char* entry_path = model->entries[i].path;
+            if (strncmp(entry_path, path, length) == 0 && (entry_path[length] == 0 || entry_path[length] == '/')) _test_model_remove(model, &model->entries[i--]);
+        }
+    }
+    else if (kind == 9)
+    {
+        // destination file is created or its node gets contents of the source
+        _test_random_path(seed, FS_FILE, other_path);
+        _test_entry_t* destination = _test_model_find(model, other_path);
+        if (strcmp(path, other_path) == 0) return;
+    
+        uint8_t is_valid = entry != NULL && entry->type == FS_FILE &&
+            (destination != NULL ? destination->type == FS_FILE : _test_model_parent_exists(model, other_path));
+        error = fs_clone(fs, path, other_path);
+        TEST_ASSERT(is_valid ? error == FS_OK || error == FS_FULL : error != FS_OK);
+        if (error != FS_OK) return;
+    
+        if (destination == NULL)
+        {
+            _test_model_add(model, other_path, FS_FILE, _test_model_new_object(model));
+            destination = &model->entries[model->entries_count - 1];
+            entry = _test_model_find(model, path);
+        }
+    
+        _test_object_t* source_object = &model->objects[entry->object];
+        _test_object_t* object = &model->objects[destination->object];
+        if (object != source_object)
+        {
+            object->data = (char*)realloc(object->data, source_object->size + 1);
+            memcpy(object->data, source_object->data, source_object->size);
+            object->size = source_object->size;
+        }
+    }
+    else if (kind == 10)
+    {
+        _test_random_path(seed, FS_FILE, other_path);
+        uint8_t is_valid = entry != NULL && entry->type == FS_FILE && _test_model_find(model, other_path) == NULL &&
+            _test_model_parent_exists(model, other_path);
+    
+        fs_dir_entry_t info;
+        if (fs_entry_info(fs, path, &info) != FS_OK) return;
+        error = fs_link(fs, other_path, info.node);
+        TEST_ASSERT(is_valid ? error == FS_OK || error == FS_FULL : error != FS_OK);
+        if (error == FS_OK) _test_model_add(model, other_path, FS_FILE, entry->object);
+    }
+    else if (kind == 11)
+    {
+        // move a file or a directory with its whole subtree
+        if (rand_r(seed) % 2) _test_random_path(seed, FS_DIR, path);
+        entry = _test_model_find(model, path);
+        _test_random_path(seed, entry != NULL ? entry->type : FS_FILE, other_path);
+    
+        size_t length = strlen(path);
+        _test_entry_t* destination = _test_model_find(model, other_path);
+        // renaming to the same path or to another link of the same file changes nothing
+        uint8_t is_same = entry != NULL && destination != NULL && (destination == entry ||
+            (entry->type == FS_FILE && destination->type == FS_FILE && destination->object == entry->object));
+        uint8_t is_valid = entry != NULL && (is_same || (destination == NULL &&
+            _test_model_parent_exists(model, other_path) && !(strncmp(other_path, path, length) == 0 && other_path[length] == '/')));
+        error = fs_rename(fs, path, other_path);
+        TEST_ASSERT(is_valid ? error == FS_OK || error == FS_FULL : error != FS_OK);
+        if (error != FS_OK || is_same) return;
+    
+        for (uint32_t i = 0; i < model->entries_count; i++)
+        {
+            char* entry_path = model->entries[i].path;
+            if (strncmp(entry_path, path, length) != 0 || (entry_path[length] != 0 && entry_path[length] != '/')) continue;
+    
+            char moved_path[FS_PATH_MAX_LENGTH + 1];
+            sprintf(moved_path, "%s%s", other_path, entry_path + length);
+            strcpy(entry_path, moved_path);
+        }
+    }
+    else if (kind == 12)
+    {
+        char name[FS_NAME_MAX_LENGTH + 1];
+        sprintf(name, "s%d", rand_r(seed) % TEST_MAX_SNAPSHOTS);
+    
+        uint32_t index = 0;
+        while (index < model->snapshots_count && strcmp(model->snapshots[index].name, name) != 0) index++;
+    
+        if (index == model->snapshots_count)
+        {
+            error = fs_snapshot_create(fs, name);
+            TEST_ASSERT(error == FS_OK || error == FS_FULL);
+            if (error != FS_OK) return;
+    
+            strcpy(model->snapshots[index].name, name);
+            model->snapshots[index].digests[0] = _test_model_tree_digest(model, 0);
+            model->snapshots[index].digests[1] = _test_model_tree_digest(model, 1);
+            model->snapshots_count++;
+        }
+        else
+        {
+            TEST_ASSERT(fs_snapshot_create(fs, name) == FS_ALREADY_EXISTS);
+            TEST_CHECK(fs_snapshot_delete(fs, name));
+            model->snapshots[index] = model->snapshots[--model->snapshots_count];
+        }
+    }
+    else if (kind == 13)
+    {
+        if (*is_batch) TEST_CHECK(fs_batch_commit(fs));
+        else TEST_CHECK(fs_batch_begin(fs));
+        *is_batch = !*is_batch;
+    }
+    else if (kind == 14 && !*is_batch)
+    {
+        TEST_CHECK(fs_sync(fs));
+        test_sync_ends[operation] = test_log_count;
+    }
+}
+
+static void _test_run(const fs_format_options_t* options, unsigned seed)
+{
+    static _test_model_t model;
+    static fs_t fs;
+    _test_disk_t disk;
+    fs_disk_operations_t operations;
+    
+    memset(&model, 0, sizeof(model));
+    memset(test_sync_ends, 0, sizeof(test_sync_ends));
+    test_log_count = 0;
+    test_synced_count = 0;
+    test_operation = 0;
+    
+    disk.data = (char*)calloc(1, TEST_DISK_SIZE);
+    disk.is_logged = 1;
+    TEST_ASSERT(disk.data != NULL);
+    _test_disk_operations(&disk, &operations);
+    TEST_CHECK(fs_create(&operations, TEST_DISK_SIZE, options, &fs));
+    TEST_CHECK(fs_sync(&fs));
+    size_t created_count = test_log_count;
+    test_digests[0] = _test_model_digest(&model, 0);
+    
+    unsigned operations_seed = seed;
+    uint8_t is_batch = 0;
+    for (uint32_t operation = 1; operation <= TEST_OPERATIONS; operation++)
+    {
+        test_operation = operation;
+        test_middle_digests[operation] = test_digests[operation - 1];
+        _test_operation(&fs, &model, &operations_seed, operation, &is_batch);
+    
+        test_digests[operation] = _test_model_digest(&model, 0);
+        TEST_ASSERT(_test_digest(&fs, 1) == _test_model_digest(&model, 1));
+    }
+    if (is_batch) TEST_CHECK(fs_batch_commit(&fs));
+    TEST_CHECK(fs_close(&fs));
+    
+    unsigned crash_seed = seed;
+    for (uint32_t i = 0; i < TEST_CRASH_POINTS; i++)
+    {
+        uint32_t write = (uint32_t)(created_count + rand_r(&crash_seed) % (test_log_count - created_count + 1));
+        _test_crash(write, i % 2 == 0, crash_seed);
+    }
+    
+    for (size_t i = 0; i < test_log_count; i++) free(test_log[i].data);
+    for (uint32_t i = 0; i < model.objects_count; i++) free(model.objects[i].data);
+    free(disk.data);
+}
+
+static void _test_crash(uint32_t write, uint8_t keep_all, unsigned seed)
+{
+    static fs_t fs;
+    _test_disk_t disk;
+    fs_disk_operations_t operations;
+    
+    // writes before the last sync are on the disk, later ones all in order or only some of them
+    size_t synced_count = write < test_log_count ? test_log[write].synced_count : test_synced_count;
+    disk.data = (char*)calloc(1, TEST_DISK_SIZE);
+    disk.is_logged = 0;
+    TEST_ASSERT(disk.data != NULL);
+    for (size_t i = 0; i < write; i++)
+    {
+        if (i >= synced_count && !keep_all && rand_r(&seed) % 2) continue;
+        memcpy(disk.data + test_log[i].position, test_log[i].data, test_log[i].size);
+    }
+    
+    // state has to be the one after or within an operation made since the last fs_sync, up to the one which made the last write
+    uint32_t last = write == 0 ? 0 : test_log[write - 1].operation;
+    uint32_t first = 0;
+    for (uint32_t operation = 1; operation <= last; operation++)
+    {
+        if (test_sync_ends[operation] != 0 && test_sync_ends[operation] <= write) first = operation;
+    }
+    
+    test_operation = last;
+    _test_disk_operations(&disk, &operations);
+    TEST_CHECK(fs_open(&operations, &fs));
+    uint64_t digest = _test_digest(&fs, 0);
+    
+    uint32_t match = first;
+    while (match <= last && test_digests[match] != digest && test_middle_digests[match] != digest) match++;
+    if (match > last)
+    {
+        printf("fs_test: image cut at write %u (%s) matches no operation from %u to %u\n", write, keep_all ? "all writes" : "some writes", first, last);
+        exit(1);
+    }
+    
+    _test_check_leaks(&fs);
+    TEST_CHECK(fs_close(&fs));
+    free(disk.data);
+}